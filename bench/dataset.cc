@@ -0,0 +1,69 @@
+#include "dataset.h"
+#include <fstream>
+#include <random>
+
+std::vector<float> uniformVectors(size_t n, int dim, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+  std::vector<float> data(n * dim);
+  for (float &v : data) {
+    v = dist(rng);
+  }
+  return data;
+}
+
+std::vector<float> clusteredVectors(size_t n, int dim, size_t num_clusters,
+                                    float spread, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::vector<float> centers = uniformVectors(num_clusters, dim, seed + 1);
+  std::uniform_int_distribution<size_t> pick(0, num_clusters - 1);
+  std::normal_distribution<float> noise(0.0f, spread);
+
+  std::vector<float> data(n * dim);
+  for (size_t i = 0; i < n; ++i) {
+    const float *center = centers.data() + pick(rng) * dim;
+    for (int j = 0; j < dim; ++j) {
+      data[i * dim + j] = center[j] + noise(rng);
+    }
+  }
+  return data;
+}
+
+bool readVecs(const std::string &path, size_t max_n, int *dim,
+              std::vector<float> *data) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open()) {
+    return false;
+  }
+  bool bytes =
+      path.size() >= 6 && path.compare(path.size() - 6, 6, ".bvecs") == 0;
+
+  data->clear();
+  *dim = 0;
+  std::vector<uint8_t> byte_vector;
+  int32_t d;
+  for (size_t n = 0; (max_n == 0 || n < max_n) &&
+                     file.read(reinterpret_cast<char *>(&d), sizeof(d));
+       ++n) {
+    if (d <= 0 || (*dim != 0 && d != *dim)) {
+      return false;
+    }
+    *dim = d;
+    size_t offset = data->size();
+    data->resize(offset + d);
+    if (bytes) {
+      byte_vector.resize(d);
+      file.read(reinterpret_cast<char *>(byte_vector.data()), d);
+      for (int j = 0; j < d; ++j) {
+        (*data)[offset + j] = byte_vector[j];
+      }
+    } else {
+      file.read(reinterpret_cast<char *>(data->data() + offset),
+                d * sizeof(float));
+    }
+    if (!file) {
+      return false;
+    }
+  }
+  return *dim != 0;
+}
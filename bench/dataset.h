@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// synthetic and on-disk vector sets shared by the benchmarks and tools,
+// vectors are stored back to back
+
+std::vector<float> uniformVectors(size_t n, int dim, uint32_t seed);
+// gaussian blobs around num_clusters uniform centers, closer to real
+// embeddings than uniform noise
+std::vector<float> clusteredVectors(size_t n, int dim, size_t num_clusters,
+                                    float spread, uint32_t seed);
+// .fvecs/.bvecs: every vector is an int32 dim followed by dim float32 or
+// uint8 components. reads at most max_n vectors, 0 reads all.
+bool readVecs(const std::string &path, size_t max_n, int *dim,
+              std::vector<float> *data);
@@ -0,0 +1,449 @@
+// end to end load against a running server over http.
+//   vdb_load_gen --concurrency=32 --duration=30 --mix=upsert:1,search:8
+//   vdb_load_gen --rate=2000 --mix=search:1,filter_search:1,query:1
+// closed loop (default): every connection sends its next request as soon as
+// the previous one returns. open loop (--rate): requests are scheduled at a
+// fixed total rate and latency counts from the scheduled time, so a slow
+// server is not hidden by the client backing off.
+#include "constants.h"
+#include "httplib.h"
+#include "rapidjson/document.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+enum class Op { UPSERT, SEARCH, FILTER_SEARCH, QUERY, COUNT };
+constexpr const char *kOpNames[] = {"upsert", "search", "filter_search",
+                                    "query"};
+constexpr size_t kNumOps = static_cast<size_t>(Op::COUNT);
+
+struct Options {
+  std::string host = "localhost";
+  int port = 8080;
+  int concurrency = 16;
+  double duration_sec = 10;
+  // requests per second over all connections, 0 is closed loop
+  double rate = 0;
+  int dim = 1;
+  int k = 10;
+  std::string index_type = "FLAT";
+  // ids used by upsert and query, upserts spread over [0, id_range)
+  uint64_t id_range = 100000;
+  // upserts sent before the measured run so searches have data
+  uint64_t preload = 10000;
+  // distinct int_field values, a filter matches about 1 / cardinality
+  int cardinality = 100;
+  double weights[kNumOps] = {1, 4, 2, 1};
+};
+
+// log-linear buckets in the spirit of HdrHistogram: values below
+// kSubBuckets are exact, above that every power of two range is split into
+// kSubBuckets / 2 linear buckets, so a value is reported within 2 / kSubBuckets
+// of what was recorded.
+class LatencyHistogram {
+public:
+  LatencyHistogram() : counts_(kSubBuckets + kMagnitudes * kHalf, 0) {}
+
+  void record(uint64_t micros) {
+    ++counts_[bucketIndex(micros)];
+    ++total_;
+    max_ = std::max(max_, micros);
+  }
+
+  void merge(const LatencyHistogram &other) {
+    for (size_t i = 0; i < counts_.size(); ++i) {
+      counts_[i] += other.counts_[i];
+    }
+    total_ += other.total_;
+    max_ = std::max(max_, other.max_);
+  }
+
+  uint64_t count() const { return total_; }
+  uint64_t max() const { return max_; }
+
+  // upper bound of the bucket holding the q-th quantile
+  uint64_t percentile(double q) const {
+    if (total_ == 0) {
+      return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(std::ceil(q * total_));
+    rank = std::max<uint64_t>(rank, 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts_.size(); ++i) {
+      seen += counts_[i];
+      if (seen >= rank) {
+        return std::min(bucketUpperBound(i), max_);
+      }
+    }
+    return max_;
+  }
+
+private:
+  static constexpr int kSubBucketBits = 7;
+  static constexpr uint64_t kSubBuckets = 1 << kSubBucketBits;
+  static constexpr uint64_t kHalf = kSubBuckets / 2;
+  static constexpr int kMagnitudes = 64 - kSubBucketBits;
+
+  static size_t bucketIndex(uint64_t value) {
+    if (value < kSubBuckets) {
+      return value;
+    }
+    // value >> magnitude lands in [kHalf, kSubBuckets)
+    int magnitude = 63 - __builtin_clzll(value) - kSubBucketBits + 1;
+    uint64_t sub = (value >> magnitude) - kHalf;
+    return kSubBuckets + (magnitude - 1) * kHalf + sub;
+  }
+
+  static uint64_t bucketUpperBound(size_t index) {
+    if (index < kSubBuckets) {
+      return index;
+    }
+    size_t magnitude = (index - kSubBuckets) / kHalf + 1;
+    uint64_t sub = (index - kSubBuckets) % kHalf;
+    return ((kHalf + sub + 1) << magnitude) - 1;
+  }
+
+  std::vector<uint64_t> counts_;
+  uint64_t total_ = 0;
+  uint64_t max_ = 0;
+};
+
+struct WorkerStats {
+  LatencyHistogram latency[kNumOps];
+  uint64_t errors[kNumOps] = {};
+};
+
+bool parseMix(const std::string &value, double *weights) {
+  std::fill(weights, weights + kNumOps, 0.0);
+  std::stringstream ss(value);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    size_t colon = item.find(':');
+    std::string name = item.substr(0, colon);
+    double weight =
+        colon == std::string::npos ? 1.0 : std::stod(item.substr(colon + 1));
+    auto it = std::find(std::begin(kOpNames), std::end(kOpNames), name);
+    if (it == std::end(kOpNames) || weight < 0) {
+      return false;
+    }
+    weights[it - std::begin(kOpNames)] = weight;
+  }
+  return true;
+}
+
+bool parseOptions(int argc, char **argv, Options *options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    size_t eq = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+      return false;
+    }
+    std::string key = arg.substr(2, eq - 2);
+    std::string value = arg.substr(eq + 1);
+    if (key == "host") {
+      options->host = value;
+    } else if (key == "port") {
+      options->port = std::stoi(value);
+    } else if (key == "concurrency") {
+      options->concurrency = std::max(1, std::stoi(value));
+    } else if (key == "duration") {
+      options->duration_sec = std::stod(value);
+    } else if (key == "rate") {
+      options->rate = std::stod(value);
+    } else if (key == "dim") {
+      options->dim = std::stoi(value);
+    } else if (key == "k") {
+      options->k = std::stoi(value);
+    } else if (key == "index") {
+      options->index_type = value;
+    } else if (key == "id-range") {
+      options->id_range = std::max<uint64_t>(1, std::stoull(value));
+    } else if (key == "preload") {
+      options->preload = std::stoull(value);
+    } else if (key == "cardinality") {
+      options->cardinality = std::max(1, std::stoi(value));
+    } else if (key == "mix") {
+      if (!parseMix(value, options->weights)) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+class RequestBuilder {
+public:
+  RequestBuilder(const Options &options, uint32_t seed)
+      : options_(options), rng_(seed),
+        ids_(0, options.id_range - 1),
+        values_(0, options.cardinality - 1) {}
+
+  std::string upsert(uint64_t id) {
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key(REQUEST_ID);
+    writer.Uint64(id);
+    writeVector(&writer);
+    writer.Key("int_field");
+    writer.Int(static_cast<int>(id % options_.cardinality));
+    writer.Key(REQUEST_INDEX_TYPE);
+    writer.String(options_.index_type.c_str());
+    writer.EndObject();
+    return buffer.GetString();
+  }
+
+  std::string search(bool filtered) {
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writeVector(&writer);
+    writer.Key(REQUEST_K);
+    writer.Int(options_.k);
+    writer.Key(REQUEST_INDEX_TYPE);
+    writer.String(options_.index_type.c_str());
+    if (filtered) {
+      writer.Key(REQUEST_FILTER);
+      writer.StartObject();
+      writer.Key(REQUEST_FILTER_FIELD);
+      writer.String("int_field");
+      writer.Key(REQUEST_FILTER_FIELD_VALUE);
+      writer.Int(values_(rng_));
+      writer.Key(REQUEST_FILTER_OP);
+      writer.String("=");
+      writer.EndObject();
+    }
+    writer.EndObject();
+    return buffer.GetString();
+  }
+
+  std::string query() {
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key(REQUEST_ID);
+    writer.Uint64(ids_(rng_));
+    writer.EndObject();
+    return buffer.GetString();
+  }
+
+  uint64_t randomId() { return ids_(rng_); }
+  std::mt19937_64 &rng() { return rng_; }
+
+private:
+  void writeVector(rapidjson::Writer<rapidjson::StringBuffer> *writer) {
+    std::uniform_real_distribution<float> component(0.0f, 1.0f);
+    writer->Key(REQUEST_VECTORS);
+    writer->StartArray();
+    for (int i = 0; i < options_.dim; ++i) {
+      writer->Double(component(rng_));
+    }
+    writer->EndArray();
+  }
+
+  const Options &options_;
+  std::mt19937_64 rng_;
+  std::uniform_int_distribution<uint64_t> ids_;
+  std::uniform_int_distribution<int> values_;
+};
+
+// a request only counts as ok when http says so and the body has no error
+// retCode
+bool sendRequest(httplib::Client *client, Op op, RequestBuilder *builder) {
+  std::string path;
+  std::string body;
+  switch (op) {
+  case Op::UPSERT:
+    path = "/upsert";
+    body = builder->upsert(builder->randomId());
+    break;
+  case Op::SEARCH:
+  case Op::FILTER_SEARCH:
+    path = "/search";
+    body = builder->search(op == Op::FILTER_SEARCH);
+    break;
+  default:
+    path = "/query";
+    body = builder->query();
+    break;
+  }
+  auto res = client->Post(path, body, "application/json");
+  if (!res || res->status != 200) {
+    return false;
+  }
+  rapidjson::Document json;
+  json.Parse(res->body.c_str());
+  return !json.HasParseError() && json.IsObject() &&
+         (!json.HasMember(RESPONSE_RETCODE) ||
+          json[RESPONSE_RETCODE].GetInt() == RESPONSE_RETCODE_SUCCESS);
+}
+
+void preload(const Options &options) {
+  std::atomic<uint64_t> next{0};
+  std::atomic<uint64_t> failed{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < options.concurrency; ++t) {
+    threads.emplace_back([&options, &next, &failed, t]() {
+      httplib::Client client(options.host, options.port);
+      client.set_keep_alive(true);
+      RequestBuilder builder(options, 1000 + t);
+      for (uint64_t id = next++; id < options.preload; id = next++) {
+        std::string body = builder.upsert(id % options.id_range);
+        auto res = client.Post("/upsert", body, "application/json");
+        if (!res || res->status != 200) {
+          ++failed;
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  if (failed > 0) {
+    std::fprintf(stderr, "preload: %lu of %lu upserts failed\n",
+                 static_cast<unsigned long>(failed.load()),
+                 static_cast<unsigned long>(options.preload));
+  }
+}
+
+void runWorker(const Options &options, int worker,
+               std::chrono::steady_clock::time_point start,
+               std::chrono::steady_clock::time_point end,
+               WorkerStats *stats) {
+  httplib::Client client(options.host, options.port);
+  client.set_keep_alive(true);
+  RequestBuilder builder(options, worker);
+  std::discrete_distribution<int> pick(std::begin(options.weights),
+                                       std::end(options.weights));
+
+  // in open loop every worker owns an equal share of the rate, offset so
+  // the workers do not fire together
+  std::chrono::nanoseconds interval(0);
+  std::chrono::steady_clock::time_point scheduled = start;
+  if (options.rate > 0) {
+    interval = std::chrono::nanoseconds(
+        static_cast<int64_t>(1e9 * options.concurrency / options.rate));
+    scheduled += interval * worker / options.concurrency;
+  }
+
+  while (true) {
+    auto now = std::chrono::steady_clock::now();
+    if (options.rate > 0) {
+      if (scheduled >= end) {
+        break;
+      }
+      if (scheduled > now) {
+        std::this_thread::sleep_until(scheduled);
+      }
+    } else {
+      if (now >= end) {
+        break;
+      }
+      scheduled = now;
+    }
+
+    Op op = static_cast<Op>(pick(builder.rng()));
+    bool ok = sendRequest(&client, op, &builder);
+    auto done = std::chrono::steady_clock::now();
+    size_t index = static_cast<size_t>(op);
+    stats->latency[index].record(
+        std::chrono::duration_cast<std::chrono::microseconds>(done -
+                                                              scheduled)
+            .count());
+    if (!ok) {
+      ++stats->errors[index];
+    }
+    scheduled += interval;
+  }
+}
+
+void printRow(const char *name, const LatencyHistogram &latency,
+              uint64_t errors, double seconds) {
+  std::printf("%-14s %10lu %8lu %10.1f %9lu %9lu %9lu %9lu %9lu\n", name,
+              static_cast<unsigned long>(latency.count()),
+              static_cast<unsigned long>(errors), latency.count() / seconds,
+              static_cast<unsigned long>(latency.percentile(0.5)),
+              static_cast<unsigned long>(latency.percentile(0.9)),
+              static_cast<unsigned long>(latency.percentile(0.99)),
+              static_cast<unsigned long>(latency.percentile(0.999)),
+              static_cast<unsigned long>(latency.max()));
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  Options options;
+  if (!parseOptions(argc, argv, &options)) {
+    std::fprintf(stderr,
+                 "usage: %s [--host=localhost] [--port=8080] "
+                 "[--concurrency=16] [--duration=10] [--rate=0] [--dim=1] "
+                 "[--k=10] [--index=FLAT] [--id-range=100000] "
+                 "[--preload=10000] [--cardinality=100] "
+                 "[--mix=upsert:1,search:4,filter_search:2,query:1]\n",
+                 argv[0]);
+    return 1;
+  }
+
+  if (options.preload > 0) {
+    auto preload_start = std::chrono::steady_clock::now();
+    preload(options);
+    std::fprintf(stderr, "preloaded %lu records in %.1fs\n",
+                 static_cast<unsigned long>(options.preload),
+                 std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - preload_start)
+                     .count());
+  }
+
+  std::vector<WorkerStats> stats(options.concurrency);
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  auto end = start + std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::duration<double>(options.duration_sec));
+  for (int t = 0; t < options.concurrency; ++t) {
+    threads.emplace_back(runWorker, std::cref(options), t, start, end,
+                         &stats[t]);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  std::printf("%s loop, %d connections, %.1fs\n",
+              options.rate > 0 ? "open" : "closed", options.concurrency,
+              seconds);
+  std::printf("%-14s %10s %8s %10s %9s %9s %9s %9s %9s\n", "op", "requests",
+              "errors", "req/s", "p50_us", "p90_us", "p99_us", "p999_us",
+              "max_us");
+  LatencyHistogram total;
+  uint64_t total_errors = 0;
+  for (size_t op = 0; op < kNumOps; ++op) {
+    LatencyHistogram latency;
+    uint64_t errors = 0;
+    for (const WorkerStats &worker : stats) {
+      latency.merge(worker.latency[op]);
+      errors += worker.errors[op];
+    }
+    if (latency.count() == 0) {
+      continue;
+    }
+    printRow(kOpNames[op], latency, errors, seconds);
+    total.merge(latency);
+    total_errors += errors;
+  }
+  printRow("total", total, total_errors, seconds);
+  return total_errors == 0 ? 0 : 2;
+}
@@ -0,0 +1,243 @@
+// microbenchmarks for the index, filter and storage layers. json output:
+//   vdb_bench --benchmark_format=json --benchmark_out=bench.json
+#include "dataset.h"
+#include "faiss_index.h"
+#include "filter_index.h"
+#include "hnswlib_index.h"
+#include "index_factory.h"
+#include "logger.h"
+#include "persistence.h"
+#include "scalar_storage.h"
+#include <benchmark/benchmark.h>
+#include <faiss/IndexFlat.h>
+#include <faiss/IndexIDMap.h>
+#include <filesystem>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <rapidjson/document.h>
+#include <string>
+#include <vector>
+
+namespace {
+constexpr uint32_t kSeed = 42;
+
+std::vector<long> sequentialLabels(size_t n) {
+  std::vector<long> labels(n);
+  std::iota(labels.begin(), labels.end(), 0);
+  return labels;
+}
+
+FaissIndex *newFlatIndex(int dim) {
+  faiss::IndexIDMap *id_map =
+      new faiss::IndexIDMap(new faiss::IndexFlat(dim, faiss::METRIC_L2));
+  id_map->own_fields = true;
+  return new FaissIndex(id_map);
+}
+
+// a fresh directory under the system temp dir, removed on destruction
+class ScratchDir {
+public:
+  explicit ScratchDir(const std::string &name)
+      : path_(std::filesystem::temp_directory_path() /
+              (name + "_" + std::to_string(std::random_device()()))) {
+    std::filesystem::create_directories(path_);
+  }
+  ~ScratchDir() {
+    std::error_code ec;
+    std::filesystem::remove_all(path_, ec);
+  }
+  std::string path(const std::string &name) const {
+    return (path_ / name).string();
+  }
+
+private:
+  std::filesystem::path path_;
+};
+
+rapidjson::Document upsertDocument(uint64_t id, const float *vector,
+                                   int dim) {
+  rapidjson::Document doc;
+  doc.SetObject();
+  rapidjson::Document::AllocatorType &allocator = doc.GetAllocator();
+  rapidjson::Value vectors(rapidjson::kArrayType);
+  for (int i = 0; i < dim; ++i) {
+    vectors.PushBack(vector[i], allocator);
+  }
+  doc.AddMember("vectors", vectors, allocator);
+  doc.AddMember("id", id, allocator);
+  doc.AddMember("category", static_cast<int64_t>(id % 16), allocator);
+  doc.AddMember("indexType", "FLAT", allocator);
+  return doc;
+}
+} // namespace
+
+// args: dim
+static void BM_FlatInsert(benchmark::State &state) {
+  int dim = state.range(0);
+  const size_t batch = 1000;
+  std::vector<float> data = uniformVectors(batch, dim, kSeed);
+  std::vector<long> labels = sequentialLabels(batch);
+  for (auto _ : state) {
+    state.PauseTiming();
+    std::unique_ptr<FaissIndex> index(newFlatIndex(dim));
+    state.ResumeTiming();
+    index->insert_vectors(data, labels);
+  }
+  state.SetItemsProcessed(state.iterations() * batch);
+}
+BENCHMARK(BM_FlatInsert)->Arg(32)->Arg(128)->Arg(768);
+
+// args: dim, number of vectors
+static void BM_FlatSearch(benchmark::State &state) {
+  int dim = state.range(0);
+  size_t n = state.range(1);
+  std::unique_ptr<FaissIndex> index(newFlatIndex(dim));
+  index->insert_vectors(clusteredVectors(n, dim, 64, 0.05f, kSeed),
+                        sequentialLabels(n));
+  std::vector<float> queries = uniformVectors(256, dim, kSeed + 1);
+
+  size_t q = 0;
+  for (auto _ : state) {
+    std::vector<float> query(queries.begin() + q * dim,
+                             queries.begin() + (q + 1) * dim);
+    benchmark::DoNotOptimize(index->search_vectors(query, 10));
+    q = (q + 1) % 256;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FlatSearch)
+    ->Args({32, 10000})
+    ->Args({128, 10000})
+    ->Args({128, 100000})
+    ->Args({768, 10000});
+
+// args: dim
+static void BM_HNSWBuild(benchmark::State &state) {
+  int dim = state.range(0);
+  const size_t n = 10000;
+  std::vector<float> data = clusteredVectors(n, dim, 64, 0.05f, kSeed);
+  std::vector<long> labels = sequentialLabels(n);
+  for (auto _ : state) {
+    HNSWLibIndex index(dim, n, IndexFactory::MetricType::L2, 16, 200);
+    index.insert_vectors(data, labels);
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_HNSWBuild)->Arg(32)->Arg(128)->Unit(benchmark::kMillisecond);
+
+// args: dim, ef_search
+static void BM_HNSWSearch(benchmark::State &state) {
+  int dim = state.range(0);
+  int ef_search = state.range(1);
+  const size_t n = 20000;
+  HNSWLibIndex index(dim, n, IndexFactory::MetricType::L2, 16, 200);
+  index.insert_vectors(clusteredVectors(n, dim, 64, 0.05f, kSeed),
+                       sequentialLabels(n));
+  std::vector<float> queries = uniformVectors(256, dim, kSeed + 1);
+
+  size_t q = 0;
+  for (auto _ : state) {
+    std::vector<float> query(queries.begin() + q * dim,
+                             queries.begin() + (q + 1) * dim);
+    benchmark::DoNotOptimize(
+        index.search_vectors(query, 10, nullptr, ef_search));
+    q = (q + 1) % 256;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_HNSWSearch)
+    ->ArgsProduct({{32, 128}, {16, 50, 200}});
+
+// args: number of ids, distinct values of the field, 0 for '=' 1 for '!='
+static void BM_FilterBitmap(benchmark::State &state) {
+  size_t n = state.range(0);
+  int64_t cardinality = state.range(1);
+  FilterIndex::Operation op = state.range(2) == 0
+                                  ? FilterIndex::Operation::EQUAL
+                                  : FilterIndex::Operation::NOT_EQUAL;
+  FilterIndex filter;
+  for (size_t id = 0; id < n; ++id) {
+    filter.updateIntFieldFilter("category", nullptr, id % cardinality, id);
+  }
+
+  for (auto _ : state) {
+    roaring_bitmap_t *bitmap = roaring_bitmap_create();
+    filter.getIntFieldFilterBitmap("category", op, 0, bitmap);
+    benchmark::DoNotOptimize(bitmap);
+    roaring_bitmap_free(bitmap);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FilterBitmap)
+    ->ArgsProduct({{1000000}, {2, 16, 1024}, {0, 1}});
+
+// args: 0 for no fsync, 1 for fsync per record (group commit under load)
+static void BM_WALWrite(benchmark::State &state) {
+  const int dim = 128;
+  ScratchDir dir("vdb_bench_wal");
+  WALOptions options;
+  options.durability =
+      state.range(0) == 0 ? WALDurability::NONE : WALDurability::SYNC;
+  Persistence persistence;
+  persistence.init(dir.path("wal"), options);
+
+  std::vector<float> vector = uniformVectors(1, dim, kSeed);
+  uint64_t id = 0;
+  for (auto _ : state) {
+    rapidjson::Document doc = upsertDocument(id++, vector.data(), dim);
+    persistence.waitDurable(persistence.writeWALLog("upsert", doc));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_WALWrite)->Arg(0)->Arg(1)->UseRealTime();
+
+static void BM_ScalarPut(benchmark::State &state) {
+  const int dim = 128;
+  ScratchDir dir("vdb_bench_scalar");
+  ScalarStorage storage(dir.path("db"));
+  std::vector<float> vector = uniformVectors(1, dim, kSeed);
+
+  uint64_t id = 0;
+  for (auto _ : state) {
+    storage.insert_scalar(id, upsertDocument(id, vector.data(), dim));
+    id++;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ScalarPut);
+
+// args: 0 for the whole record, 1 for one projected field
+static void BM_ScalarGet(benchmark::State &state) {
+  const int dim = 128;
+  const uint64_t n = 100000;
+  ScratchDir dir("vdb_bench_scalar");
+  ScalarStorage storage(dir.path("db"));
+  std::vector<float> vector = uniformVectors(1, dim, kSeed);
+  for (uint64_t id = 0; id < n; ++id) {
+    storage.insert_scalar(id, upsertDocument(id, vector.data(), dim));
+  }
+  std::vector<std::string> fields = {"category"};
+  const std::vector<std::string> *projection =
+      state.range(0) == 0 ? nullptr : &fields;
+
+  std::mt19937_64 rng(kSeed);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(storage.get_scalar(rng() % n, projection));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ScalarGet)->Arg(0)->Arg(1);
+
+int main(int argc, char **argv) {
+  init_global_logger();
+  set_log_level(spdlog::level::err);
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
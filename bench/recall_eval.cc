@@ -0,0 +1,273 @@
+// recall against exact search and throughput/latency for index settings.
+//   vdb_recall_eval --n=100000 --dim=128 --m=16,32 --ef-search=16,64,256
+//   vdb_recall_eval --base=sift_base.fvecs --query=sift_query.fvecs
+// prints one csv row per (index, M, ef_construction, ef_search,
+// selectivity) to stdout.
+#include "dataset.h"
+#include "faiss_index.h"
+#include "filter_index.h"
+#include "hnswlib_index.h"
+#include "index_factory.h"
+#include "logger.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+struct Options {
+  std::string base_path;
+  std::string query_path;
+  size_t n = 100000;
+  size_t nq = 1000;
+  int dim = 128;
+  int k = 10;
+  std::vector<int> m = {16};
+  std::vector<int> ef_construction = {200};
+  std::vector<int> ef_search = {16, 32, 64, 128, 256};
+  // fraction of ids a filtered query may return, 1 means no filter
+  std::vector<double> selectivity = {1.0, 0.1, 0.01};
+};
+
+template <typename T> std::vector<T> parseList(const std::string &value) {
+  std::vector<T> list;
+  std::stringstream ss(value);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    list.push_back(static_cast<T>(std::stod(item)));
+  }
+  return list;
+}
+
+bool parseOptions(int argc, char **argv, Options *options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    size_t eq = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+      return false;
+    }
+    std::string key = arg.substr(2, eq - 2);
+    std::string value = arg.substr(eq + 1);
+    if (key == "base") {
+      options->base_path = value;
+    } else if (key == "query") {
+      options->query_path = value;
+    } else if (key == "n") {
+      options->n = std::stoull(value);
+    } else if (key == "nq") {
+      options->nq = std::stoull(value);
+    } else if (key == "dim") {
+      options->dim = std::stoi(value);
+    } else if (key == "k") {
+      options->k = std::stoi(value);
+    } else if (key == "m") {
+      options->m = parseList<int>(value);
+    } else if (key == "ef-construction") {
+      options->ef_construction = parseList<int>(value);
+    } else if (key == "ef-search") {
+      options->ef_search = parseList<int>(value);
+    } else if (key == "selectivity") {
+      options->selectivity = parseList<double>(value);
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+struct RunResult {
+  double recall;
+  double qps;
+  double p50_us;
+  double p99_us;
+};
+
+using SearchFn = std::function<std::pair<std::vector<long>, std::vector<float>>(
+    const std::vector<float> &query, const roaring_bitmap_t *bitmap)>;
+
+RunResult runQueries(const std::vector<float> &queries, int dim, int k,
+                     const roaring_bitmap_t *bitmap, const SearchFn &search,
+                     const std::vector<std::vector<long>> *truth,
+                     std::vector<std::vector<long>> *results) {
+  size_t nq = queries.size() / dim;
+  std::vector<double> latencies(nq);
+  double recall_sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t q = 0; q < nq; ++q) {
+    std::vector<float> query(queries.begin() + q * dim,
+                             queries.begin() + (q + 1) * dim);
+    auto query_start = std::chrono::steady_clock::now();
+    std::vector<long> ids = search(query, bitmap).first;
+    latencies[q] = std::chrono::duration<double, std::micro>(
+                       std::chrono::steady_clock::now() - query_start)
+                       .count();
+    ids.erase(std::remove(ids.begin(), ids.end(), -1), ids.end());
+
+    if (truth != nullptr) {
+      const std::vector<long> &expected = (*truth)[q];
+      std::unordered_set<long> expected_set(expected.begin(), expected.end());
+      size_t hits = std::count_if(ids.begin(), ids.end(), [&](long id) {
+        return expected_set.count(id) != 0;
+      });
+      recall_sum += expected.empty()
+                        ? 1.0
+                        : static_cast<double>(hits) / expected.size();
+    }
+    if (results != nullptr) {
+      results->push_back(std::move(ids));
+    }
+  }
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  std::sort(latencies.begin(), latencies.end());
+  RunResult result;
+  result.recall = recall_sum / nq;
+  result.qps = nq / seconds;
+  result.p50_us = latencies[nq / 2];
+  result.p99_us = latencies[std::min(nq - 1, nq * 99 / 100)];
+  return result;
+}
+
+void printRow(const char *index, int m, int ef_construction, int ef_search,
+              double selectivity, int k, const RunResult &result) {
+  std::printf("%s,%d,%d,%d,%g,%d,%.4f,%.1f,%.1f,%.1f\n", index, m,
+              ef_construction, ef_search, selectivity, k, result.recall,
+              result.qps, result.p50_us, result.p99_us);
+  std::fflush(stdout);
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  init_global_logger();
+  set_log_level(spdlog::level::err);
+
+  Options options;
+  if (!parseOptions(argc, argv, &options)) {
+    std::fprintf(stderr,
+                 "usage: %s [--base=f.fvecs --query=f.fvecs] [--n=N] "
+                 "[--nq=N] [--dim=D] [--k=K] [--m=16,32] "
+                 "[--ef-construction=200] [--ef-search=16,64] "
+                 "[--selectivity=1,0.1]\n",
+                 argv[0]);
+    return 1;
+  }
+
+  std::vector<float> base;
+  std::vector<float> queries;
+  int dim = options.dim;
+  if (!options.base_path.empty()) {
+    int query_dim = 0;
+    if (!readVecs(options.base_path, options.n, &dim, &base) ||
+        !readVecs(options.query_path, options.nq, &query_dim, &queries) ||
+        query_dim != dim) {
+      std::fprintf(stderr, "failed to read %s / %s\n",
+                   options.base_path.c_str(), options.query_path.c_str());
+      return 1;
+    }
+  } else {
+    // queries drawn from the same clusters as the data
+    std::vector<float> all = clusteredVectors(options.n + options.nq, dim,
+                                              100, 0.05f, 42);
+    base.assign(all.begin(), all.begin() + options.n * dim);
+    queries.assign(all.begin() + options.n * dim, all.end());
+  }
+  size_t n = base.size() / dim;
+  std::vector<long> labels(n);
+  std::iota(labels.begin(), labels.end(), 0);
+  std::fprintf(stderr, "%zu vectors, %zu queries, dim %d\n", n,
+               queries.size() / dim, dim);
+
+  // the flat index gives the exact answers and the baseline throughput
+  IndexFactory exact_factory;
+  exact_factory.init(IndexFactory::IndexType::FLAT, dim);
+  exact_factory.init(IndexFactory::IndexType::FILTER);
+  FaissIndex *flat = static_cast<FaissIndex *>(
+      exact_factory.getIndex(IndexFactory::IndexType::FLAT));
+  FilterIndex *filter = static_cast<FilterIndex *>(
+      exact_factory.getIndex(IndexFactory::IndexType::FILTER));
+  flat->insert_vectors(base, labels);
+
+  // one field per selectivity, value 0 matches the wanted share of ids
+  std::mt19937 rng(7);
+  std::map<double, roaring_bitmap_t *> bitmaps;
+  for (double selectivity : options.selectivity) {
+    if (selectivity >= 1.0) {
+      bitmaps[selectivity] = nullptr;
+      continue;
+    }
+    std::string field = "s" + std::to_string(selectivity);
+    std::uniform_real_distribution<double> coin(0.0, 1.0);
+    for (size_t id = 0; id < n; ++id) {
+      filter->updateIntFieldFilter(field, nullptr,
+                                   coin(rng) < selectivity ? 0 : 1, id);
+    }
+    roaring_bitmap_t *bitmap = roaring_bitmap_create();
+    filter->getIntFieldFilterBitmap(field, FilterIndex::Operation::EQUAL, 0,
+                                    bitmap);
+    bitmaps[selectivity] = bitmap;
+  }
+
+  std::printf("index,m,ef_construction,ef_search,selectivity,k,recall,qps,"
+              "p50_us,p99_us\n");
+  std::map<double, std::vector<std::vector<long>>> truth;
+  SearchFn flat_search = [flat, &options](const std::vector<float> &query,
+                                          const roaring_bitmap_t *bitmap) {
+    return flat->search_vectors(query, options.k, bitmap);
+  };
+  for (const auto &entry : bitmaps) {
+    RunResult result = runQueries(queries, dim, options.k, entry.second,
+                                  flat_search, nullptr, &truth[entry.first]);
+    result.recall = 1.0;
+    printRow("FLAT", 0, 0, 0, entry.first, options.k, result);
+  }
+
+  for (int m : options.m) {
+    for (int ef_construction : options.ef_construction) {
+      IndexFactory factory;
+      factory.init(IndexFactory::IndexType::HNSW, dim, n,
+                   IndexFactory::MetricType::L2, m, ef_construction);
+      HNSWLibIndex *hnsw = static_cast<HNSWLibIndex *>(
+          factory.getIndex(IndexFactory::IndexType::HNSW));
+      auto build_start = std::chrono::steady_clock::now();
+      hnsw->insert_vectors(base, labels);
+      std::fprintf(stderr, "HNSW M=%d ef_construction=%d built in %.1fs\n",
+                   m, ef_construction,
+                   std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - build_start)
+                       .count());
+
+      for (int ef_search : options.ef_search) {
+        SearchFn hnsw_search = [hnsw, ef_search, &options](
+                                   const std::vector<float> &query,
+                                   const roaring_bitmap_t *bitmap) {
+          return hnsw->search_vectors(query, options.k, bitmap,
+                                      std::max(ef_search, options.k));
+        };
+        for (const auto &entry : bitmaps) {
+          RunResult result =
+              runQueries(queries, dim, options.k, entry.second, hnsw_search,
+                         &truth[entry.first], nullptr);
+          printRow("HNSW", m, ef_construction, ef_search, entry.first,
+                   options.k, result);
+        }
+      }
+    }
+  }
+
+  for (auto &entry : bitmaps) {
+    if (entry.second != nullptr) {
+      roaring_bitmap_free(entry.second);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+// deadline of the request running on this thread. searches check it
+// between their stages and give up once it passed.
+class RequestDeadline {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // Clock::time_point::max() when the request has no deadline
+  static Clock::time_point current() { return current_; }
+  static bool exceeded() {
+    return current_ != Clock::time_point::max() && Clock::now() >= current_;
+  }
+
+  class Scope {
+  public:
+    explicit Scope(Clock::time_point deadline) : previous_(current_) {
+      current_ = deadline;
+    }
+    ~Scope() { current_ = previous_; }
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+  private:
+    Clock::time_point previous_;
+  };
+
+private:
+  static inline thread_local Clock::time_point current_ =
+      Clock::time_point::max();
+};
+
+struct AdmissionLimits {
+  // requests of the class running at once
+  size_t max_running;
+  // requests waiting for a slot, more are rejected right away
+  size_t max_queued;
+};
+
+struct AdmissionOptions {
+  AdmissionLimits read{16, 32};
+  AdmissionLimits write{4, 16};
+  AdmissionLimits snapshot{1, 0};
+  // /scan exports and replica wal streams, each holds its slot until the
+  // response ends
+  AdmissionLimits stream{8, 0};
+  // longest wait for a slot, a shorter request deadline wins
+  uint32_t max_queue_wait_ms = 200;
+  // http workers beyond the admitted and queued requests, they keep
+  // /metrics and /admin/* answering under load
+  size_t spare_threads = 8;
+  // threads of the fixed pools that run parts of admitted requests, the
+  // bm25 side of hybrid searches or a coordinator's shard requests
+  size_t helper_threads = 0;
+};
+
+// bounds the requests of every class that run or wait at once, so that
+// expensive classes cannot take all http workers. slots go to the waiting
+// requests of a class in arrival order. a request is rejected when the
+// queue of its class is full, its deadline ends before a slot would likely
+// free up, or it waited max_queue_wait_ms.
+class AdmissionController {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  enum class Class { READ, WRITE, SNAPSHOT, STREAM, COUNT };
+  enum class Result { ADMITTED, QUEUE_FULL, DEADLINE_TOO_SHORT, TIMED_OUT };
+
+  struct ClassStats {
+    size_t running;
+    size_t queued;
+    uint64_t rejected;
+    // moving average of the time a request holds its slot
+    double service_seconds;
+  };
+
+  // holds the slot of an admitted request and makes its deadline current
+  // until it goes out of scope
+  class Ticket {
+  public:
+    Ticket() = default;
+    ~Ticket();
+    Ticket(const Ticket &) = delete;
+    Ticket &operator=(const Ticket &) = delete;
+
+  private:
+    friend class AdmissionController;
+    AdmissionController *controller_ = nullptr;
+    Class class_ = Class::READ;
+    Clock::time_point start_;
+    std::optional<RequestDeadline::Scope> deadline_;
+  };
+
+  explicit AdmissionController(const AdmissionOptions &options);
+  AdmissionController(const AdmissionController &) = delete;
+  AdmissionController &operator=(const AdmissionController &) = delete;
+
+  Result admit(Class request_class, Clock::time_point deadline,
+               Ticket *ticket);
+  // how long a rejected client should wait before it retries
+  std::chrono::milliseconds retryAfter(Class request_class) const;
+  ClassStats getStats(Class request_class) const;
+  // every thread serving requests: the http workers plus helper_threads
+  size_t workerThreads() const;
+  // http workers needed for every class to reach its limits
+  size_t httpThreads() const;
+
+  static const char *classToString(Class request_class);
+  static const char *resultToString(Result result);
+
+private:
+  struct Lane {
+    AdmissionLimits limits;
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    size_t running = 0;
+    // numbers of the waiting requests, the front one gets the next slot
+    std::deque<uint64_t> waiting;
+    uint64_t next_number = 0;
+    uint64_t rejected = 0;
+    // moving average of the slot hold time, 0 until the first release
+    double service_nanos = 0;
+  };
+
+  void release(Class request_class, Clock::duration held);
+
+  AdmissionOptions options_;
+  Lane lanes_[static_cast<size_t>(Class::COUNT)];
+};
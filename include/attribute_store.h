@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <rapidjson/document.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// in-memory copy of the int fields of every record, one typed column per
+// field and one row per id. lets upserts find the old filter values
+// without reading rocksdb. not locked, VectorDatabase::index_mutex_
+// guards it like the indexes.
+class AttributeStore {
+public:
+  bool contains(uint64_t id) const;
+  // false when id has no int value for fieldname
+  bool getInt(uint64_t id, const std::string &fieldname, int64_t *value) const;
+  // replaces the attributes of id with the int members of record
+  void upsert(uint64_t id, const rapidjson::Value &record);
+  // drops the attributes of id, its row is reused by a later upsert
+  void remove(uint64_t id);
+  // calls visit once per id and int field that has a value
+  void forEachInt(const std::function<void(uint64_t, const std::string &,
+                                           int64_t)> &visit) const;
+  // the same for the fields of one id
+  void forEachIntOf(
+      uint64_t id,
+      const std::function<void(const std::string &, int64_t)> &visit) const;
+  size_t size() const;
+
+private:
+  struct IntColumn {
+    std::vector<int64_t> values;
+    std::vector<bool> present;
+  };
+
+  std::unordered_map<uint64_t, uint32_t> rows_;
+  std::unordered_map<std::string, IntColumn> int_columns_;
+  // rows ever handed out, and the ones freed by remove()
+  uint32_t row_count_ = 0;
+  std::vector<uint32_t> free_rows_;
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "roaring/roaring.h"
+#include "scalar_storage.h"
+#include <cstdint>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class BM25Index {
+public:
+  BM25Index(float k1 = 1.2f, float b = 0.75f);
+
+  void addTextField(const std::string &fieldname);
+  bool isTextField(const std::string &fieldname) const;
+
+  // replaces whatever was indexed for id before
+  void upsertDocument(uint64_t id, const std::vector<std::string> &texts);
+  void removeDocument(uint64_t id);
+
+  std::pair<std::vector<long>, std::vector<float>>
+  search(const std::string &query, int k,
+         const roaring_bitmap_t *bitmap = nullptr);
+
+  std::string serialize();
+  // only documents changed since the previous delta or clearDirty(), a
+  // removed document is written as its bare id
+  std::string serializeDelta();
+  void clearDirty();
+  void deserialize(const std::string &serialized_data);
+  void saveIndex(ScalarStorage &scalar_storage, const std::string &key);
+  void loadIndex(ScalarStorage &scalar_storage, const std::string &key);
+
+  static std::vector<std::string> tokenize(const std::string &text);
+
+private:
+  void removeDocumentLocked(uint64_t id);
+
+  float k1_;
+  float b_;
+  std::set<std::string> text_fields_;
+  // term -> (id -> term frequency)
+  std::unordered_map<std::string, std::unordered_map<uint64_t, uint32_t>>
+      postings_;
+  // id -> (term -> term frequency), needed to undo an upsert
+  std::unordered_map<uint64_t, std::unordered_map<std::string, uint32_t>>
+      doc_terms_;
+  std::unordered_map<uint64_t, uint32_t> doc_length_;
+  uint64_t total_length_{0};
+  std::set<uint64_t> dirty_docs_;
+  mutable std::shared_mutex mutex_;
+};
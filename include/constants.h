@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstddef>
+
 constexpr char LOGGER_NAME[] = "GlobalLogger";
 
 constexpr char RESPONSE_VECTORS[] = "vectors";
@@ -26,4 +28,81 @@ constexpr char REQUEST_FILTER_FIELD[] = "fieldName";
 constexpr char REQUEST_FILTER_FIELD_VALUE[] = "fieldValue";
 constexpr char REQUEST_FILTER_OP[] = "op";
 
+constexpr char REQUEST_TEXT_QUERY[] = "textQuery";
+constexpr char REQUEST_FUSION[] = "fusion";
+constexpr char REQUEST_FUSION_ALPHA[] = "alpha";
+constexpr char REQUEST_CANDIDATE_K[] = "candidateK";
+
+constexpr char FUSION_RRF[] = "rrf";
+constexpr char FUSION_WEIGHTED[] = "weighted";
+constexpr int FUSION_RRF_K = 60;
+// threads shared by all hybrid searches for their bm25 side
+constexpr size_t HYBRID_SEARCH_THREADS = 4;
+
+constexpr char RESPONSE_SCORES[] = "scores";
+
+constexpr char REQUEST_FACET_FIELD[] = "facetField";
+constexpr char RESPONSE_FACETS[] = "facets";
+constexpr char RESPONSE_FACET_VALUE[] = "value";
+constexpr char RESPONSE_FACET_COUNT[] = "count";
+
+constexpr char REQUEST_FIELDS[] = "fields";
+constexpr char REQUEST_IDS[] = "ids";
+constexpr char RESPONSE_RECORDS[] = "records";
+constexpr char REQUEST_START_ID[] = "startId";
+constexpr char REQUEST_LIMIT[] = "limit";
+constexpr char RESPONSE_CONTENT_TYPE_NDJSON[] = "application/x-ndjson";
+constexpr char RESPONSE_CONTENT_TYPE_PROMETHEUS[] = "text/plain; version=0.0.4";
+// records written to the connection per call of the chunk provider
+constexpr size_t SCAN_CHUNK_SIZE = 1000;
+
+constexpr char REQUEST_ALLOW_STALE[] = "allowStale";
+constexpr char RESPONSE_STALE[] = "stale";
+constexpr char RESPONSE_RECOVERY_PHASE[] = "phase";
+constexpr char RESPONSE_REPLAYED_RECORDS[] = "replayedRecords";
+constexpr char RESPONSE_REPLAYED_BYTES[] = "replayedBytes";
+constexpr char RESPONSE_WAL_BYTES[] = "walBytes";
+constexpr char RESPONSE_RECOVERY_PROGRESS[] = "progress";
+constexpr char RESPONSE_ELAPSED_SECONDS[] = "elapsedSeconds";
+
+constexpr char REQUEST_LEVEL[] = "level";
+constexpr char RESPONSE_LEVEL[] = "level";
+
+constexpr char REQUEST_FROM_LOG_ID[] = "fromLogId";
+constexpr char RESPONSE_LOG_ID[] = "logId";
+constexpr char RESPONSE_ROLE[] = "role";
+constexpr char RESPONSE_LEADER[] = "leader";
+constexpr char RESPONSE_REPLICATION_STATE[] = "state";
+constexpr char RESPONSE_APPLIED_LOG_ID[] = "appliedLogId";
+constexpr char RESPONSE_LEADER_LOG_ID[] = "leaderLogId";
+constexpr char RESPONSE_LAG_RECORDS[] = "lagRecords";
+constexpr char RESPONSE_LAG_SECONDS[] = "lagSeconds";
+constexpr char RESPONSE_BOOTSTRAPS[] = "bootstraps";
+constexpr char RESPONSE_RECONNECTS[] = "reconnects";
+constexpr char RESPONSE_INCARNATION[] = "incarnation";
+constexpr char RESPONSE_INCARNATION_LOG_ID[] = "incarnationLogId";
+// index metadata key of the leader incarnation and log id a replica's
+// records are applied up to
+constexpr char REPLICA_STATE_KEY[] = "__replica_state";
+constexpr char ROLE_LEADER[] = "leader";
+constexpr char ROLE_REPLICA[] = "replica";
+constexpr char RESPONSE_CONTENT_TYPE_WAL[] = "application/octet-stream";
+// wal bytes written to a replica per call of the chunk provider
+constexpr size_t REPLICATION_CHUNK_BYTES = 1024 * 1024;
+// an idle wal stream carries a heartbeat this often
+constexpr unsigned int REPLICATION_HEARTBEAT_MS = 1000;
+
+constexpr char RESPONSE_SKIPPED[] = "skipped";
+// pause after a failed scheduled snapshot before the next attempt
+constexpr unsigned int SNAPSHOT_RETRY_SECONDS = 60;
+
+constexpr char RESPONSE_PARTIAL[] = "partial";
+constexpr char RESPONSE_FAILED_SHARDS[] = "failedShards";
+
+// budget of a request in milliseconds, it is rejected or answered 504 once
+// the budget is spent
+constexpr char REQUEST_HEADER_TIMEOUT_MS[] = "X-Timeout-Ms";
+constexpr char RESPONSE_HEADER_RETRY_AFTER[] = "Retry-After";
+constexpr char RESPONSE_RETRY_AFTER_MS[] = "retryAfterMs";
+
 constexpr char VERSION[] = "1.0";
\ No newline at end of file
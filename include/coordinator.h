@@ -0,0 +1,101 @@
+#pragma once
+
+#include "admission.h"
+#include "worker_pool.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <rapidjson/document.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace httplib {
+class Client;
+}
+
+struct CoordinatorOptions {
+  // host and port of every shard, the order decides which ids a shard owns
+  std::vector<std::pair<std::string, int>> shards;
+  // connect, send and receive timeout of one shard request
+  uint32_t shard_timeout_ms = 1000;
+  // answer with the shards that replied when others failed or timed out,
+  // instead of failing the request
+  bool allow_partial = true;
+  // threads sending shard requests beside the request thread
+  size_t fanout_threads = 16;
+  // keep-alive connections kept open to each shard between requests
+  size_t idle_connections_per_shard = 16;
+};
+
+// spreads a collection over several simple_vector processes. every id
+// belongs to one shard by hash, writes and lookups go to the owner,
+// searches go to all shards in parallel and their top k are merged.
+// methods return the http status and fill in the json response.
+class Coordinator {
+public:
+  explicit Coordinator(const CoordinatorOptions &options);
+  ~Coordinator();
+  Coordinator(const Coordinator &) = delete;
+  Coordinator &operator=(const Coordinator &) = delete;
+
+  size_t shardOf(uint64_t id) const;
+  size_t shardCount() const { return options_.shards.size(); }
+
+  // sends body to the shard owning id, the reply is passed through
+  int forward(const std::string &path, uint64_t id, const std::string &body,
+              rapidjson::Document *response) const;
+  int search(const rapidjson::Document &request, const std::string &body,
+             rapidjson::Document *response) const;
+  // single ids are forwarded, lists are split by shard and put back into
+  // the requested order
+  int query(const rapidjson::Document &request, const std::string &body,
+            rapidjson::Document *response) const;
+  int snapshot(rapidjson::Document *response) const;
+
+private:
+  struct ShardReply {
+    // false when the shard was not asked
+    bool sent = false;
+    // the shard answered 200 with a json object
+    bool ok = false;
+    int status = 0;
+    std::string error;
+    rapidjson::Document json;
+  };
+
+  // deadline is the end of the request's budget, max() for none
+  ShardReply call(size_t shard, const std::string &path,
+                  const std::string &body,
+                  RequestDeadline::Clock::time_point deadline) const;
+  // one request per shard with a non-empty body, all in parallel
+  std::vector<ShardReply> fanOut(const std::string &path,
+                                 const std::vector<std::string> &bodies) const;
+  // the failed shards, or an error status when the request cannot be
+  // answered with the others
+  int collectFailures(const std::vector<ShardReply> &replies,
+                      std::vector<size_t> *failed,
+                      rapidjson::Document *response) const;
+  // lists the failed shards in the response
+  void addFailures(const std::vector<size_t> &failed,
+                   rapidjson::Document *response) const;
+  std::string shardName(size_t shard) const;
+  static void setError(rapidjson::Document *response,
+                       const std::string &message);
+
+  // idle connections of one shard, a request takes one for itself and
+  // gives it back unless it failed
+  struct ConnectionPool {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<httplib::Client>> idle;
+  };
+  std::unique_ptr<httplib::Client> acquireConnection(size_t shard) const;
+  void releaseConnection(size_t shard,
+                         std::unique_ptr<httplib::Client> client) const;
+
+  CoordinatorOptions options_;
+  std::vector<std::unique_ptr<ConnectionPool>> connections_;
+  // sends the shard requests of fanOut()
+  mutable WorkerPool fanout_pool_;
+};
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// crc32c (castagnoli), uses the sse4.2 instruction when compiled for it
+uint32_t crc32c_extend(uint32_t crc, const char *data, size_t size);
+
+inline uint32_t crc32c(const char *data, size_t size) {
+  return crc32c_extend(0, data, size);
+}
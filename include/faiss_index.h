@@ -4,6 +4,9 @@
 #include "roaring/roaring.h"
 #include <faiss/Index.h>
 #include <faiss/utils/utils.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 struct RoaringBitmapIDSelector : faiss::IDSelector {
@@ -18,8 +21,15 @@ struct RoaringBitmapIDSelector : faiss::IDSelector {
 
 class FaissIndex {
 public:
+  // takes ownership of index
   FaissIndex(faiss::Index *index);
+  ~FaissIndex();
+  FaissIndex(const FaissIndex &) = delete;
+  FaissIndex &operator=(const FaissIndex &) = delete;
   void insert_vectors(const std::vector<float> &data, uint64_t label);
+  // data holds labels.size() vectors back to back
+  void insert_vectors(const std::vector<float> &data,
+                      const std::vector<long> &labels);
   void remove_vectors(const std::vector<long> &ids);
   std::pair<std::vector<long>, std::vector<float>>
   search_vectors(const std::vector<float> &query, int k,
@@ -27,6 +37,16 @@ public:
   void saveIndex(const std::string &file_path);
   void loadIndex(const std::string &file_path);
 
+  // ids inserted or removed since the previous call. vectors, when given,
+  // receives the vectors of the ones still in the index
+  std::vector<long> takeDirtyIds(
+      std::unordered_map<long, std::vector<float>> *vectors = nullptr);
+  size_t size() const;
+
 private:
   faiss::Index *index;
+  std::unordered_set<long> dirty_ids_;
+  // copies of the dirty vectors taken on insert, reading them back from the
+  // flat index would need a scan of its whole id map
+  std::unordered_map<long, std::vector<float>> dirty_vectors_;
 };
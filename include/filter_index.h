@@ -5,6 +5,7 @@
 #include <memory>
 #include <scalar_storage.h>
 #include <set>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -13,17 +14,34 @@ public:
   enum class Operation { EQUAL, NOT_EQUAL };
 
   FilterIndex();
+  ~FilterIndex();
+  FilterIndex(const FilterIndex &) = delete;
+  FilterIndex &operator=(const FilterIndex &) = delete;
   void addIntFieldFilter(const std::string &fieldname, int64_t value,
                          uint64_t id);
   void updateIntFieldFilter(const std::string &fieldname, int64_t *old_value,
                             int64_t new_value, uint64_t id);
+  void removeIntFieldFilter(const std::string &fieldname, int64_t value,
+                            uint64_t id);
+  // drops every bitmap
+  void clear();
   void getIntFieldFilterBitmap(const std::string &fieldname, Operation op,
                                int64_t value, roaring_bitmap_t *result_bitmap);
+  // counts ids per value of fieldname, restricted to base_bitmap if given
+  std::map<long, uint64_t>
+  getIntFieldFacetCounts(const std::string &fieldname,
+                         const roaring_bitmap_t *base_bitmap = nullptr);
   std::string serializeIntFieldFilter();
+  size_t bitmapCount() const;
+  // serialized size of all bitmaps, close to what they take in memory
+  size_t bitmapBytes() const;
   void deserializeIntFieldFilter(const std::string &serialized_data);
   void saveIndex(ScalarStorage &scalar_storage, const std::string &key);
   void loadIndex(ScalarStorage &scalar_storage, const std::string &key);
 
 private:
+  void serializeBitmap(std::ostringstream &oss, const std::string &field_name,
+                       long value, const roaring_bitmap_t *bitmap);
+
   std::map<std::string, std::map<long, roaring_bitmap_t *>> intFieldFilter;
 };
@@ -3,20 +3,46 @@
 #include "hnswlib/hnswlib.h"
 #include "index_factory.h"
 #include "roaring/roaring.h"
+#include <functional>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 class HNSWLibIndex {
 public:
   HNSWLibIndex(int dim, int num_data, IndexFactory::MetricType metric,
                int M = 16, int ef_construction = 200);
+  ~HNSWLibIndex();
+  HNSWLibIndex(const HNSWLibIndex &) = delete;
+  HNSWLibIndex &operator=(const HNSWLibIndex &) = delete;
   void insert_vectors(const std::vector<float> &data, uint64_t label);
+  // data holds labels.size() vectors back to back
+  void insert_vectors(const std::vector<float> &data,
+                      const std::vector<long> &labels);
+  void remove_vectors(const std::vector<long> &ids);
 
   std::pair<std::vector<long>, std::vector<float>>
   search_vectors(const std::vector<float> &query, int k,
                  const roaring_bitmap_t *bitmap = nullptr, int ef_search = 50);
+  // brute force over the stored vectors, nearest first. the reference
+  // answer for search_vectors on the same data. between_blocks runs after
+  // every block_size vectors, the caller may let go of its lock there.
+  std::vector<long>
+  exactSearch(const std::vector<float> &query, int k,
+              const roaring_bitmap_t *bitmap, size_t block_size,
+              const std::function<void()> &between_blocks) const;
   void saveIndex(const std::string &file_path);
   void loadIndex(const std::string &file_path);
 
+  // ids inserted or removed since the previous call
+  std::vector<long> takeDirtyIds();
+  // ids missing from the index are left out of the result
+  std::unordered_map<long, std::vector<float>>
+  getVectors(const std::vector<long> &ids) const;
+  // vectors not marked deleted
+  size_t size() const;
+
   class RoaringBitmapIDFilter : public hnswlib::BaseFilterFunctor {
   public:
     RoaringBitmapIDFilter(const roaring_bitmap_t *bitmap) : bitmap_(bitmap) {}
@@ -30,7 +56,12 @@ public:
   };
 
 private:
+  // pops the hnswlib result queue, farthest first
+  static std::pair<std::vector<long>, std::vector<float>>
+  toResults(std::priority_queue<std::pair<float, hnswlib::labeltype>> &result);
+
   hnswlib::HierarchicalNSW<float> *index;
   hnswlib::SpaceInterface<float> *space;
   size_t max_elements;
+  std::unordered_set<long> dirty_ids_;
 };
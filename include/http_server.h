@@ -1,39 +1,111 @@
 #pragma once
 
+#include "admission.h"
+#include "coordinator.h"
 #include "faiss_index.h"
 #include "httplib.h"
 #include "index_factory.h"
+#include "replica.h"
 #include "vector_database.h"
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <rapidjson/document.h>
 #include <string>
+#include <thread>
+#include <vector>
 
 class HttpServer {
 public:
-  enum class CheckType { SEARCH, INSERT, UPSERT };
+  enum class CheckType { SEARCH, INSERT, UPSERT, QUERY, FACET };
 
   HttpServer(const std::string &host, int port,
-             VectorDatabase *vector_database);
+             VectorDatabase *vector_database,
+             const AdmissionOptions &admission_options = AdmissionOptions());
+  ~HttpServer();
   void start();
-  void startTimerThread(unsigned int interval_seconds);
+  // snapshots every interval_seconds, or earlier once max_wal_records or
+  // max_wal_bytes were logged since the last one; 0 disables a trigger
+  void startTimerThread(unsigned int interval_seconds,
+                        uint64_t max_wal_records = 0,
+                        uint64_t max_wal_bytes = 0);
+  // serves as a read-only replica: writes are refused and reads wait until
+  // the replica copied the leader's records
+  void setReplica(Replica *replica);
+  // forwards requests to the shards of the coordinator instead of serving
+  // them from the local database
+  void setCoordinator(Coordinator *coordinator);
 
 private:
   void searchHandler(const httplib::Request &req, httplib::Response &res);
   void insertHandler(const httplib::Request &req, httplib::Response &res);
   void upsertHandler(const httplib::Request &req, httplib::Response &res);
   void queryHandler(const httplib::Request &req, httplib::Response &res);
+  void facetHandler(const httplib::Request &req, httplib::Response &res);
+  // the response keeps ticket until the stream ends
+  void scanHandler(const httplib::Request &req, httplib::Response &res,
+                   std::shared_ptr<AdmissionController::Ticket> ticket);
   void snapshotHandler(const httplib::Request &req, httplib::Response &res);
+  void readyHandler(const httplib::Request &req, httplib::Response &res);
+  void metricsHandler(const httplib::Request &req, httplib::Response &res);
+  // GET returns the log level, POST {"level": "debug"} changes it
+  void logLevelHandler(const httplib::Request &req, httplib::Response &res);
+  // leader side of replication: the log id a copy of the records starts
+  // at, and the wal stream from ?fromLogId=
+  void replicationStatusHandler(const httplib::Request &req,
+                                httplib::Response &res);
+  void walStreamHandler(const httplib::Request &req, httplib::Response &res,
+                        std::shared_ptr<AdmissionController::Ticket> ticket);
+  // role, and for a replica its position and lag
+  void replicationHandler(const httplib::Request &req,
+                          httplib::Response &res);
+
+  // answers 503 and returns false while recovery keeps the request from
+  // being served, or 403 for a write to a replica. reads that set
+  // allowStale are served during wal replay and while a replica copies the
+  // leader's records, *stale is set for them.
+  bool checkRecovery(const rapidjson::Document &json_request, bool read_only,
+                     httplib::Response &res, bool *stale);
+
+  // takes a slot of request_class for the handler, the budget comes from
+  // the X-Timeout-Ms header. answers 400 for a bad budget, 503 with a
+  // retry hint when the class is over capacity, and returns false then.
+  bool admit(AdmissionController::Class request_class,
+             const httplib::Request &req, httplib::Response &res,
+             AdmissionController::Ticket *ticket);
+  // answers 504 and returns true once the request's deadline passed
+  bool checkDeadline(httplib::Response &res);
 
   void setJsonResponse(const rapidjson::Document &json_response,
                        httplib::Response &res);
   void setErrorJsonResponse(httplib::Response &res, int error_code,
                             const std::string &errorMsg);
+  // answers with the reply a coordinator method put together
+  void setCoordinatorResponse(int status,
+                              const rapidjson::Document &json_response,
+                              httplib::Response &res);
+  // answers 501 for the requests a coordinator cannot spread over shards
+  bool checkCoordinator(httplib::Response &res);
   bool isRequestValid(const rapidjson::Document &json_request,
                       CheckType check_type);
   IndexFactory::IndexType
   getIndexTypeFromRequest(const rapidjson::Document &json_request);
+  // returns false when the request has no fields member
+  bool getFieldsFromRequest(const rapidjson::Document &json_request,
+                            std::vector<std::string> *fields);
 
   httplib::Server server;
   std::string host;
   int port;
   VectorDatabase *vector_database_;
+  // null on a leader
+  Replica *replica_{nullptr};
+  Coordinator *coordinator_{nullptr};
+  AdmissionController admission_;
+
+  std::thread timer_thread_;
+  std::mutex timer_mutex_;
+  std::condition_variable timer_cv_;
+  bool timer_stop_{false};
 };
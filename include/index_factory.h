@@ -2,23 +2,65 @@
 
 #include "faiss_index.h"
 #include "scalar_storage.h"
+#include <cstdint>
 #include <map>
+#include <string>
+#include <vector>
 
 class IndexFactory {
 public:
-  enum class IndexType { FLAT, HNSW, FILTER, UNKNOWN = -1 };
+  enum class IndexType { FLAT, HNSW, FILTER, BM25, UNKNOWN = -1 };
 
   enum class MetricType { L2, IP };
 
+  IndexFactory() = default;
+  ~IndexFactory();
+  IndexFactory(const IndexFactory &) = delete;
+  IndexFactory &operator=(const IndexFactory &) = delete;
+
+  // hnsw_m and hnsw_ef_construction only apply to HNSW
   void init(IndexFactory::IndexType type, int dim = 1, int num_data = 0,
-            IndexFactory::MetricType metric = IndexFactory::MetricType::L2);
+            IndexFactory::MetricType metric = IndexFactory::MetricType::L2,
+            int hnsw_m = 16, int hnsw_ef_construction = 200);
   void *getIndex(IndexType type) const;
+  MetricType getMetricType(IndexType type) const;
 
   void saveIndex(const std::string &folder_path, ScalarStorage &scalar_storage);
+  // vector indexes go to <folder_path><type>.index<suffix>, returns false
+  // instead of throwing so it can run in a forked child
+  bool saveIndexFiles(const std::string &folder_path,
+                      const std::string &suffix = "");
+  // the text index lives in scalar storage, keyed like its file. the filter
+  // bitmaps are not saved, they are rebuilt from the records on load
+  std::map<std::string, std::string>
+  serializeScalarIndexes(const std::string &folder_path);
+  std::vector<std::string> indexFilePaths(const std::string &folder_path) const;
   void loadIndex(const std::string &folder_path, ScalarStorage &scalar_storage);
 
+  // what changed since the previous delta or clearDirty(). vector deltas go
+  // to files, the text index delta to scalar storage, both keyed by
+  // deltaPath()
+  struct IndexDelta {
+    std::map<std::string, std::string> files;
+    std::map<std::string, std::string> scalars;
+  };
+  IndexDelta serializeDeltas(const std::string &folder_path,
+                             uint32_t sequence);
+  void clearDirty();
+  std::vector<std::string> deltaFilePaths(const std::string &folder_path,
+                                          uint32_t sequence) const;
+  // applies one link of the delta chain on top of what is loaded
+  void loadDelta(const std::string &folder_path, uint32_t sequence,
+                 ScalarStorage &scalar_storage);
+
 private:
+  static std::string deltaPath(const std::string &folder_path, IndexType type,
+                               uint32_t sequence);
+  std::string serializeVectorDelta(IndexType type, void *index);
+  void applyVectorDelta(IndexType type, void *index, const std::string &delta);
+
   std::map<IndexType, void *> index_map;
+  std::map<IndexType, MetricType> metric_map;
 };
 
 IndexFactory *getGlobalIndexFactory();
@@ -1,8 +1,40 @@
 #pragma once
 
 #include "spdlog/spdlog.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
 
 extern std::shared_ptr<spdlog::logger> GlobalLogger;
 
-void init_global_logger();
-void set_log_level(spdlog::level::level_enum log_level);
\ No newline at end of file
+// messages are formatted on the calling thread and written by a background
+// thread. when the queue of queue_size messages is full the oldest one is
+// dropped, so callers never wait for log io.
+void init_global_logger(size_t queue_size = 8192);
+// may be called at any time, also while requests are logging
+void set_log_level(spdlog::level::level_enum log_level);
+spdlog::level::level_enum get_log_level();
+
+// the first max_bytes of a payload for the log, with its full size
+std::string truncate_for_log(const std::string &payload,
+                             size_t max_bytes = 512);
+
+// throttles a per-request log statement: lets one in sample_every calls
+// through, and at most max_per_second of those. the number held back is
+// logged once the next second starts.
+class LogLimiter {
+public:
+  LogLimiter(const char *name, uint32_t max_per_second,
+             uint32_t sample_every = 1);
+  bool allow();
+
+private:
+  const char *name_;
+  uint32_t max_per_second_;
+  uint32_t sample_every_;
+  std::atomic<uint64_t> calls_{0};
+  std::atomic<int64_t> window_{0};
+  std::atomic<uint32_t> allowed_{0};
+  std::atomic<uint64_t> suppressed_{0};
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "request_trace.h"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// request and stage latency histograms in the prometheus text format.
+// every thread records into its own shard, a scrape sums the shards, so the
+// hot path never shares a cache line with another thread.
+class Metrics {
+public:
+  enum class Handler { SEARCH, INSERT, UPSERT, QUERY, FACET, SNAPSHOT, COUNT };
+  enum class Stage {
+    JSON_PARSE,
+    FILTER_BITMAP,
+    INDEX_SEARCH,
+    SCALAR_IO,
+    WAL_WRITE,
+    WAL_SYNC,
+    RESPONSE_SERIALIZE,
+    COUNT
+  };
+
+  void observe(Handler handler, uint64_t nanos, bool error);
+  void observe(Stage stage, uint64_t nanos);
+
+  // appends the histograms and error counters
+  void render(std::string *out) const;
+  static void appendGauge(std::string *out, const std::string &name,
+                          const std::string &help, double value,
+                          const std::string &labels = "");
+
+  static const char *handlerToString(Handler handler);
+  static const char *stageToString(Stage stage);
+
+private:
+  static constexpr size_t kNumHandlers = static_cast<size_t>(Handler::COUNT);
+  static constexpr size_t kNumSeries =
+      kNumHandlers + static_cast<size_t>(Stage::COUNT);
+  // upper bounds in nanoseconds, 1-2.5-5 steps from 10us to 10s, plus +Inf
+  static constexpr size_t kNumBuckets = 20;
+
+  // written by its owning thread only, read by scrapes
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> buckets[kNumSeries][kNumBuckets];
+    std::atomic<uint64_t> sum_nanos[kNumSeries];
+    std::atomic<uint64_t> errors[kNumHandlers];
+  };
+
+  Shard *localShard();
+  void record(size_t series, uint64_t nanos);
+  void renderHistogram(std::string *out, const std::string &name,
+                       const std::string &label, size_t first,
+                       size_t count) const;
+
+  mutable std::mutex shards_mutex_;
+  // shards outlive their threads so their counts stay in the totals
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+Metrics *getGlobalMetrics();
+
+// observes the lifetime of the scope as one stage, and adds it to the
+// current request trace if there is one
+class StageTimer {
+public:
+  explicit StageTimer(Metrics::Stage stage)
+      : stage_(stage), start_(std::chrono::steady_clock::now()) {}
+  ~StageTimer() {
+    auto end = std::chrono::steady_clock::now();
+    getGlobalMetrics()->observe(
+        stage_,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start_)
+            .count());
+    if (RequestTrace *trace = RequestTrace::current()) {
+      trace->addSpan(Metrics::stageToString(stage_), start_, end);
+    }
+  }
+  StageTimer(const StageTimer &) = delete;
+  StageTimer &operator=(const StageTimer &) = delete;
+
+private:
+  Metrics::Stage stage_;
+  std::chrono::steady_clock::time_point start_;
+};
@@ -1,34 +1,228 @@
 #pragma once
 
 #include "scalar_storage.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <fstream>
+#include <map>
+#include <mutex>
 #include <rapidjson/document.h>
+#include <shared_mutex>
 #include <string>
+#include <sys/uio.h>
+#include <thread>
+#include <vector>
+
+// every wal record starts with this header, followed by payload_size bytes.
+// crc covers log_id, op_code and the payload so a torn or corrupted record
+// is rejected as a whole.
+struct WALRecordHeader {
+  uint32_t magic;
+  uint16_t format_version;
+  uint16_t op_code;
+  uint64_t log_id;
+  uint32_t payload_size;
+  uint32_t crc;
+};
+static_assert(sizeof(WALRecordHeader) == 24, "wal header must stay 24 bytes");
+
+// NONE never syncs, INTERVAL syncs in the background every sync_interval_ms
+// or sync_bytes, SYNC makes writeWALLog wait until the batch holding its
+// record has been fdatasync'ed
+enum class WALDurability { NONE, INTERVAL, SYNC };
+
+struct WALOptions {
+  WALDurability durability = WALDurability::NONE;
+  uint32_t sync_interval_ms = 100;
+  uint64_t sync_bytes = 1024 * 1024;
+  uint64_t segment_size = 64 * 1024 * 1024;
+  // delta snapshots chained to a full one before the next full snapshot
+  uint32_t max_delta_snapshots = 8;
+};
+
+// SKIPPED when nothing was logged since the last snapshot, FAILED keeps the
+// previous snapshot
+enum class SnapshotResult { TAKEN, SKIPPED, FAILED };
+
+// a wal record as it sits in the mapped segment, payload is not copied.
+// format_version 0 marks a legacy text record whose payload is plain json.
+struct WALRecordView {
+  uint64_t log_id;
+  uint16_t format_version;
+  uint16_t op_code;
+  const char *payload;
+  uint32_t payload_size;
+};
+
+// position of a replication stream in the wal segments. the segment stays
+// readable through fd after a snapshot removed its file.
+struct WALCursor {
+  uint64_t segment = 0;
+  uint64_t offset = 0;
+  int fd = -1;
+
+  WALCursor() = default;
+  ~WALCursor();
+  WALCursor(const WALCursor &) = delete;
+  WALCursor &operator=(const WALCursor &) = delete;
+};
 
 class Persistence {
 public:
+  // HEARTBEAT is never logged, it only appears on the replication stream
+  // and carries the leader's latest log id, its payload the leader's
+  // incarnation and the log id it started that incarnation at
+  enum class OpCode : uint16_t { UNKNOWN = 0, UPSERT = 1, HEARTBEAT = 2 };
+  enum class ParseResult { OK, INCOMPLETE, CORRUPT };
+
   Persistence();
   ~Persistence();
 
-  void init(const std::string &local_path, bool flush = false);
+  // local_path is the prefix of the numbered segment files
+  void init(const std::string &local_path,
+            const WALOptions &options = WALOptions());
+  // queue_mutex_ must be held
   uint64_t increaseID();
   uint64_t getID() const;
-  void writeWALLog(const std::string &operation_type,
-                   const rapidjson::Document &json_data,
-                   const std::string &version);
+  uint64_t getLastSnapshotID() const;
+  uint64_t getWALBytesSinceSnapshot() const;
+  // size of the wal found at init that replay has to go through
+  uint64_t getReplayBytesTotal() const;
+  // queues the record and returns its log id without waiting for it
+  uint64_t writeWALLog(const std::string &operation_type,
+                       const rapidjson::Document &json_data);
+  // same for a record built by encodeWALRecord, so callers can encode it
+  // before taking their own locks
+  uint64_t appendWALRecord(std::string record);
+  // with SYNC durability blocks until log_id is on disk, no-op otherwise
+  void waitDurable(uint64_t log_id);
   void readNextWALLog(std::string *operation_type,
                       rapidjson::Document *json_data);
-  void takeSnapshot(ScalarStorage &scalar_storage);
+  // zero-copy replay: views stay valid until finishReplay() is called
+  bool nextWALRecord(WALRecordView *record);
+  void finishReplay();
+  // write_gate is the lock updates hold from their wal write until their
+  // records are stored, index_lock the one searches share. both are held
+  // exclusively only while the state is captured. most snapshots only
+  // write what changed since the previous one, every
+  // options_.max_delta_snapshots + 1 a full one.
+  SnapshotResult takeSnapshot(ScalarStorage &scalar_storage,
+                              std::shared_mutex &write_gate,
+                              std::shared_mutex &index_lock);
   void loadSnapshot(ScalarStorage &scalar_storage);
-  void saveLastSnapshotID();
+  // false when the marker may not be on disk
+  bool saveLastSnapshotID();
   void loadLastSnapshotID();
 
+  // whether the wal still holds every record from log_id on
+  bool hasWALFrom(uint64_t log_id) const;
+  // appends the sealed records with log ids from from_id on that follow the
+  // cursor to *out, until about max_bytes. returns the log id of the last
+  // one, 0 when there is nothing new yet.
+  uint64_t readWAL(WALCursor *cursor, uint64_t from_id, size_t max_bytes,
+                   std::string *out) const;
+  // waits until a record after log_id was written or the timeout passed
+  void waitWritten(uint64_t log_id, std::chrono::milliseconds timeout);
+
+  static std::string encodeWALRecord(uint64_t log_id, OpCode op_code,
+                                     const rapidjson::Document &json_data);
+  // fills in log id and crc of a record built by encodeWALRecord
+  static void sealWALRecord(std::string *record, uint64_t log_id);
+  static bool decodeWALPayload(OpCode op_code, const char *payload,
+                               uint32_t payload_size,
+                               rapidjson::Document *json_data);
+  static bool decodeWALRecord(const WALRecordView &record,
+                              rapidjson::Document *json_data);
+  static std::string opCodeToString(OpCode op_code);
+  // looks at the sealed record at the front of data
+  static ParseResult parseWALRecord(const char *data, size_t size,
+                                    WALRecordView *record);
+  static std::string encodeHeartbeat(uint64_t log_id, uint64_t incarnation,
+                                     uint64_t incarnation_log_id);
+  // false for a heartbeat without the incarnation
+  static bool decodeHeartbeat(const WALRecordView &record,
+                              uint64_t *incarnation,
+                              uint64_t *incarnation_log_id);
+
 private:
+  struct PendingRecord {
+    uint64_t log_id;
+    std::string data;
+    bool rotate; // snapshot marker, switch segments at this point
+  };
+
+  void writerLoop();
+  void writeRecords(std::vector<struct iovec> &iov);
+  void syncWAL();
+
+  std::string segmentPath(uint64_t segment) const;
+  std::vector<uint64_t> listSegments() const;
+  // 0 when the segment does not start with a binary record
+  uint64_t firstLogID(uint64_t segment) const;
+  bool openCursor(WALCursor *cursor, uint64_t segment) const;
+  // moves a cursor to the segment after its current one, if there is one
+  bool advanceCursor(WALCursor *cursor) const;
+  void openSegment(uint64_t segment);
+  void rotateSegment();
+  void removeSegmentsBefore(uint64_t segment);
+  bool writeDeltaFiles(const std::map<std::string, std::string> &files);
+
+  bool openNextReadSegment();
+  void finishReadSegment();
+  bool mapWAL();
+  void unmapWAL();
+  bool readLegacyWALLog(WALRecordView *record);
+
   uint64_t increaseID_;
   uint64_t lastSnapshotID_;
-  char buf_[1024];
-  bool need_flush_;
-  int wal_fd_;
-  int read_offset_{0};
+  WALOptions options_;
+  std::string wal_path_;
+
+  // group commit: request threads queue sealed records, the writer thread
+  // appends them with one writev and syncs according to options_.durability
+  std::thread writer_thread_;
+  mutable std::mutex queue_mutex_;
+  std::condition_variable queue_cv_;
+  std::condition_variable durable_cv_;
+  std::vector<PendingRecord> pending_;
+  uint64_t written_id_{0};
+  uint64_t durable_id_{0};
+  uint64_t rotations_requested_{0};
+  uint64_t rotations_done_{0};
+  uint64_t rotated_segment_{0};
+  // replay cut a torn tail off the current segment
+  bool resync_segment_bytes_{false};
+  bool stop_{false};
+
+  // owned by the writer thread once it runs
+  int wal_fd_{-1};
+  uint64_t current_segment_{0};
+  uint64_t current_segment_bytes_{0};
+  uint64_t unsynced_bytes_{0};
+  std::atomic<uint64_t> wal_bytes_since_snapshot_{0};
+  // one snapshot at a time, whether triggered by http or the timer
+  std::mutex snapshot_mutex_;
+  std::chrono::steady_clock::time_point last_sync_;
+
+  // position in the wal the last snapshot covers up to
+  uint64_t snapshot_segment_{0};
+  uint64_t snapshot_offset_{0};
+  // deltas applied on top of the full snapshot, guarded by snapshot_mutex_
+  uint32_t delta_chain_length_{0};
+  // set when a failed snapshot consumed the dirty state of the indexes
+  bool force_full_snapshot_{false};
+
+  // replay state
+  uint64_t replay_bytes_total_{0};
+  std::vector<uint64_t> read_segments_;
+  size_t read_segment_index_{0};
+  bool read_started_{false};
+  int read_fd_{-1};
+  const char *wal_map_{nullptr};
+  size_t wal_map_size_{0};
+  size_t read_offset_{0};
+  // segments already read, kept mapped until finishReplay()
+  std::vector<std::pair<const char *, size_t>> retired_maps_;
 };
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "index_factory.h"
+#include "roaring/roaring.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct RecallMonitorOptions {
+  // share of approximate searches checked against an exact scan, 0 is off
+  double sample_rate = 0;
+  // recall is averaged over the last window samples of an index
+  size_t window = 1000;
+  // samples waiting for the background thread, more are dropped
+  size_t max_pending = 64;
+};
+
+// re-runs a sample of live searches exactly on a background thread and
+// keeps a rolling recall@k per index type. the searching request only pays
+// for copying its query and results.
+class RecallMonitor {
+public:
+  struct Sample {
+    IndexFactory::IndexType index_type;
+    std::vector<float> query;
+    int k;
+    // owned copy of the filter, null when unfiltered
+    roaring_bitmap_t *bitmap;
+    std::vector<long> approximate;
+  };
+  // the exact top k ids for a sample
+  using ExactSearch = std::function<std::vector<long>(const Sample &)>;
+
+  struct IndexRecall {
+    double recall;
+    size_t window_samples;
+    uint64_t total_samples;
+  };
+
+  RecallMonitor(const RecallMonitorOptions &options,
+                ExactSearch exact_search);
+  ~RecallMonitor();
+  RecallMonitor(const RecallMonitor &) = delete;
+  RecallMonitor &operator=(const RecallMonitor &) = delete;
+
+  // cheap, decides whether the next search is sampled
+  bool shouldSample();
+  // takes the query and results of a sampled search, bitmap is copied
+  void submit(IndexFactory::IndexType index_type,
+              const std::vector<float> &query, int k,
+              const roaring_bitmap_t *bitmap,
+              const std::vector<long> &approximate);
+  std::map<IndexFactory::IndexType, IndexRecall> getRecall() const;
+
+private:
+  struct Window {
+    std::deque<double> recalls;
+    double sum = 0;
+    uint64_t total = 0;
+  };
+
+  void run();
+  void record(IndexFactory::IndexType index_type, double recall);
+
+  RecallMonitorOptions options_;
+  ExactSearch exact_search_;
+  // every sample_every_-th search is sampled, 0 when off
+  uint64_t sample_every_;
+  std::atomic<uint64_t> searches_{0};
+
+  std::mutex queue_mutex_;
+  std::condition_variable queue_cv_;
+  std::deque<Sample> pending_;
+  bool stop_{false};
+
+  mutable std::mutex recall_mutex_;
+  std::map<IndexFactory::IndexType, Window> windows_;
+
+  std::thread worker_;
+};
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+#include <rapidjson/document.h>
+#include <string>
+#include <vector>
+
+// compact binary form of a scalar record:
+//   kRecordFormat | varint count | (varint name size | name | tag | value)*
+// ints are zigzag varints, doubles 8 bytes, strings length prefixed. arrays
+// and objects are kept as json text.
+constexpr char kRecordFormat = 0x01;
+
+// skip_field, if given, is left out of the encoding
+std::string encodeRecord(const rapidjson::Value &record,
+                         const char *skip_field = nullptr);
+// fields, if given, limits the decoded members to the listed names
+bool decodeRecord(const char *data, size_t size,
+                  const std::vector<std::string> *fields,
+                  rapidjson::Document *record);
+// records written before the binary encoding are json text
+inline bool isEncodedRecord(const char *data, size_t size) {
+  return size != 0 && data[0] == kRecordFormat;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "httplib.h"
+#include "vector_database.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+struct ReplicaOptions {
+  std::string leader_host = "localhost";
+  int leader_port = 8080;
+  // records per /scan page while copying the leader's records
+  size_t bootstrap_page_size = 1000;
+  // pause before reconnecting to the leader
+  uint32_t retry_interval_ms = 1000;
+  // the leader sends a heartbeat every second, a silent stream is dead
+  uint32_t read_timeout_seconds = 5;
+};
+
+// read replica of a leader. it copies the leader's records once, then
+// follows the leader's wal stream and applies every record through
+// VectorDatabase::upsert. after a disconnect or a restart it resumes from
+// the last applied log id, and copies the records again when the leader no
+// longer has the wal from there or restarted without the records applied.
+class Replica {
+public:
+  enum class State { STOPPED, BOOTSTRAPPING, STREAMING, DISCONNECTED };
+
+  struct Status {
+    State state;
+    uint64_t applied_log_id;
+    // highest log id the leader reported
+    uint64_t leader_log_id;
+    // time since the replica last had every record of the leader
+    double lag_seconds;
+    uint64_t bootstraps;
+    uint64_t reconnects;
+  };
+
+  Replica(VectorDatabase *vector_database, const ReplicaOptions &options);
+  ~Replica();
+  Replica(const Replica &) = delete;
+  Replica &operator=(const Replica &) = delete;
+
+  // call once the local recovery finished
+  void start();
+  // whether the leader's records were copied, reads wait for it
+  bool bootstrapped() const { return bootstrapped_; }
+  Status getStatus() const;
+  const ReplicaOptions &options() const { return options_; }
+  static std::string stateToString(State state);
+
+private:
+  void run();
+  // picks up the records a previous run applied, false when there are
+  // none or the copy was not finished
+  bool resume();
+  // copies the leader's records as of one log id
+  bool bootstrap(httplib::Client &client);
+  // follows the wal until the stream breaks. sets *gone when the leader
+  // no longer has the records after the applied log id.
+  void stream(httplib::Client &client, bool *gone);
+  // applies the complete records at the front of buffer and drops them.
+  // false on a corrupted record, or a gap in the log ids which also sets
+  // *gone.
+  bool applyRecords(std::string *buffer, bool *gone);
+  // false when the leader restarted and lost log ids already applied here
+  bool followIncarnation(uint64_t incarnation, uint64_t incarnation_log_id);
+  // records the position in rocksdb after the records up to it were
+  // written there
+  void saveState();
+  void setLeaderLogID(uint64_t log_id);
+  // waits retry_interval_ms, false when stopping
+  bool sleepBeforeRetry();
+
+  VectorDatabase *vector_database_;
+  ReplicaOptions options_;
+
+  std::atomic<State> state_{State::STOPPED};
+  std::atomic<bool> bootstrapped_{false};
+  std::atomic<uint64_t> applied_log_id_{0};
+  // incarnation of the leader the applied log ids belong to
+  uint64_t leader_incarnation_{0};
+  std::atomic<uint64_t> leader_log_id_{0};
+  // steady clock time the replica was last caught up, in milliseconds
+  std::atomic<int64_t> caught_up_millis_{0};
+  std::atomic<uint64_t> bootstraps_{0};
+  std::atomic<uint64_t> reconnects_{0};
+
+  std::mutex stop_mutex_;
+  std::condition_variable stop_cv_;
+  std::atomic<bool> stop_{false};
+  std::thread thread_;
+};
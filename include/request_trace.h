@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// stage timestamps of one request, logged when the request turns out slower
+// than the slow query threshold. a trace only exists while the threshold is
+// set, with tracing off a stage costs one thread_local load.
+class RequestTrace {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit RequestTrace(const char *name);
+
+  // 0 disables tracing
+  static void setSlowThreshold(std::chrono::microseconds threshold);
+  static std::chrono::microseconds slowThreshold();
+  static bool enabled();
+  // the trace of the request running on this thread, null when not tracing
+  static RequestTrace *current() { return current_; }
+
+  uint64_t id() const { return id_; }
+  // spans may come from helper threads of the request
+  void addSpan(const char *name, Clock::time_point start,
+               Clock::time_point end);
+  // describes the request shape, e.g. dim, k or the search plan
+  void annotate(const char *key, std::string value);
+  void annotate(const char *key, uint64_t value);
+
+  // logs the breakdown if the request took longer than the threshold
+  void finish();
+
+  // makes trace the current one of this thread for the scope, also used to
+  // carry a trace over to a helper thread
+  class Scope {
+  public:
+    explicit Scope(RequestTrace *trace);
+    ~Scope();
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+  private:
+    RequestTrace *previous_;
+  };
+
+private:
+  struct Span {
+    const char *name;
+    Clock::time_point start;
+    Clock::time_point end;
+  };
+
+  static inline thread_local RequestTrace *current_ = nullptr;
+  static std::atomic<int64_t> slow_threshold_micros_;
+  static std::atomic<uint64_t> next_id_;
+
+  uint64_t id_;
+  const char *name_;
+  Clock::time_point start_;
+  std::mutex mutex_;
+  std::vector<Span> spans_;
+  std::vector<std::pair<const char *, std::string>> annotations_;
+};
+
+// records the scope as a span of the current trace, if any
+class TraceSpan {
+public:
+  explicit TraceSpan(const char *name)
+      : name_(name), trace_(RequestTrace::current()) {
+    if (trace_ != nullptr) {
+      start_ = RequestTrace::Clock::now();
+    }
+  }
+  ~TraceSpan() {
+    if (trace_ != nullptr) {
+      trace_->addSpan(name_, start_, RequestTrace::Clock::now());
+    }
+  }
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+  const char *name_;
+  RequestTrace *trace_;
+  RequestTrace::Clock::time_point start_;
+};
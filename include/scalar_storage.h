@@ -1,22 +1,121 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
 #include <rapidjson/document.h>
+#include <rocksdb/cache.h>
 #include <rocksdb/db.h>
+#include <rocksdb/options.h>
 #include <string>
 #include <vector>
 
+struct ScalarStorageOptions {
+  // shared by all column families
+  size_t block_cache_size = 256 * 1024 * 1024;
+  // 0 disables the bloom filters on records and vectors
+  int bloom_bits_per_key = 10;
+  size_t write_buffer_size = 64 * 1024 * 1024;
+  rocksdb::CompressionType records_compression = rocksdb::kLZ4Compression;
+  // float32 barely compresses, not worth the cpu on every read
+  rocksdb::CompressionType vectors_compression = rocksdb::kNoCompression;
+  rocksdb::CompressionType index_compression = rocksdb::kZSTD;
+};
+
+// records are kept in the default column family in the binary encoding of
+// record_codec.h, their vectors as raw float32 in "vectors" and the
+// serialized filter/text indexes in "index_meta". records and vectors are
+// keyed by the big-endian id so key order is id order.
 class ScalarStorage {
 public:
-  ScalarStorage(const std::string &db_path);
+  // reads records in id order from the point in time it was opened at,
+  // across any number of next() calls. holds a rocksdb snapshot until it
+  // is destroyed, which must happen before the storage goes away.
+  class ScanCursor {
+  public:
+    ~ScanCursor();
+    ScanCursor(const ScanCursor &) = delete;
+    ScanCursor &operator=(const ScanCursor &) = delete;
+
+    // visits the records after the ones already visited, until limit
+    // records were visited or visit returns false. returns the number
+    // visited, fewer than limit only at the end or when visit stopped.
+    size_t next(size_t limit,
+                const std::function<bool(uint64_t, rapidjson::Document &)>
+                    &visit);
+
+  private:
+    friend class ScalarStorage;
+    ScanCursor(ScalarStorage *storage, uint64_t start_id,
+               const std::vector<std::string> *fields, bool include_vectors);
+
+    rocksdb::DB *db_;
+    const rocksdb::Snapshot *snapshot_;
+    bool projected_;
+    std::vector<std::string> fields_;
+    std::unique_ptr<rocksdb::Iterator> records_;
+    std::unique_ptr<rocksdb::Iterator> vectors_;
+  };
+
+  ScalarStorage(const std::string &db_path,
+                const ScalarStorageOptions &options = ScalarStorageOptions());
 
   ~ScalarStorage();
 
   void insert_scalar(uint64_t id, const rapidjson::Document &data);
 
-  rapidjson::Document get_scalar(uint64_t id);
+  // writes all documents in one rocksdb WriteBatch
+  void insert_scalars(const std::vector<uint64_t> &ids,
+                      const std::vector<const rapidjson::Document *> &data);
+  // deletes the records and their vectors in one WriteBatch
+  void remove_scalars(const std::vector<uint64_t> &ids);
+
+  // fields, if given, limits the result to the listed members, the vectors
+  // are only read when "vectors" is one of them
+  rapidjson::Document get_scalar(uint64_t id,
+                                 const std::vector<std::string> *fields =
+                                     nullptr);
+  // missing ids come back as null documents
+  std::vector<rapidjson::Document>
+  get_scalars(const std::vector<uint64_t> &ids,
+              const std::vector<std::string> *fields = nullptr);
+  // include_vectors false leaves the vectors out whatever fields says
+  std::unique_ptr<ScanCursor>
+  openScan(uint64_t start_id, const std::vector<std::string> *fields,
+           bool include_vectors = true);
+  // visits records in id order from start_id on, until limit records were
+  // visited or visit returns false. returns the number visited.
+  size_t scan(uint64_t start_id, size_t limit,
+              const std::vector<std::string> *fields,
+              const std::function<bool(uint64_t, rapidjson::Document &)>
+                  &visit,
+              bool include_vectors = true);
+
+  static std::string encodeKey(uint64_t id);
+  static uint64_t decodeKey(const rocksdb::Slice &key);
+
+  // index metadata, kept apart from the records
   void put(const std::string &key, const std::string &value);
+  // writes the entries in one WriteBatch and syncs the rocksdb wal, which
+  // makes every earlier write durable as well
+  bool putSynced(const std::map<std::string, std::string> &entries);
   std::string get(const std::string &key);
 
+  // an integer rocksdb property such as "rocksdb.estimate-num-keys" for
+  // each column family, as (column family name, value)
+  std::vector<std::pair<std::string, uint64_t>>
+  getIntProperty(const std::string &property);
+  size_t blockCacheUsage() const;
+
 private:
+  // rewrites decimal keys from before the fixed-width ones, once
+  void migrateKeys();
+
   rocksdb::DB *db_;
+  std::shared_ptr<rocksdb::Cache> block_cache_;
+  rocksdb::ColumnFamilyHandle *records_cf_;
+  rocksdb::ColumnFamilyHandle *vectors_cf_;
+  rocksdb::ColumnFamilyHandle *index_cf_;
 };
@@ -1,32 +1,182 @@
 #pragma once
 
+#include "attribute_store.h"
 #include "index_factory.h"
 #include "persistence.h"
+#include "recall_monitor.h"
 #include "scalar_storage.h"
+#include "worker_pool.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
 #include <rapidjson/document.h>
+#include <shared_mutex>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 class VectorDatabase {
 public:
-  VectorDatabase(const std::string &db_path, const std::string &wal_path);
+  enum class RecoveryPhase {
+    STARTING,
+    LOADING_ATTRIBUTES,
+    LOADING_SNAPSHOT,
+    REPLAYING_WAL,
+    READY
+  };
+
+  struct RecoveryStatus {
+    RecoveryPhase phase;
+    uint64_t replayed_records;
+    // wal bytes replayed so far out of the wal found at startup
+    uint64_t replayed_bytes;
+    uint64_t total_bytes;
+    double elapsed_seconds;
+  };
+
+  // gauges for /metrics, the rocksdb ones per column family
+  struct Stats {
+    uint64_t flat_vectors = 0;
+    uint64_t hnsw_vectors = 0;
+    uint64_t filter_bitmaps = 0;
+    uint64_t filter_bitmap_bytes = 0;
+    uint64_t attribute_rows = 0;
+    uint64_t wal_records_since_snapshot = 0;
+    uint64_t wal_bytes_since_snapshot = 0;
+    uint64_t block_cache_bytes = 0;
+    std::vector<std::pair<std::string, uint64_t>> storage_keys;
+    std::vector<std::pair<std::string, uint64_t>> storage_live_bytes;
+    std::vector<std::pair<std::string, uint64_t>> storage_sst_bytes;
+    std::vector<std::pair<std::string, uint64_t>> storage_memtable_bytes;
+    std::vector<std::pair<std::string, uint64_t>>
+        storage_pending_compaction_bytes;
+    // rolling recall@k of the sampled searches
+    std::map<IndexFactory::IndexType, RecallMonitor::IndexRecall> recall;
+  };
+
+  VectorDatabase(const std::string &db_path, const std::string &wal_path,
+                 const WALOptions &wal_options = WALOptions(),
+                 const ScalarStorageOptions &storage_options =
+                     ScalarStorageOptions(),
+                 const RecallMonitorOptions &recall_options =
+                     RecallMonitorOptions());
 
   void upsert(uint64_t id, const rapidjson::Document &data,
               IndexFactory::IndexType index_type);
-  rapidjson::Document query(uint64_t id);
+  // writes the wal record and applies it as one step with respect to
+  // snapshots, then waits for the configured durability
+  void logAndUpsert(uint64_t id, const rapidjson::Document &data,
+                    IndexFactory::IndexType index_type);
+  // ids must be distinct, applies the same changes as one upsert per id
+  void upsertBatch(const std::vector<uint64_t> &ids,
+                   const std::vector<const rapidjson::Document *> &data,
+                   IndexFactory::IndexType index_type);
+  // fields, if given, limits the result to the listed members
+  rapidjson::Document query(uint64_t id,
+                            const std::vector<std::string> *fields = nullptr);
+  // one rocksdb MultiGet, missing ids come back as null documents
+  std::vector<rapidjson::Document>
+  query(const std::vector<uint64_t> &ids,
+        const std::vector<std::string> *fields = nullptr);
+
+  // records in id order as of now, see ScalarStorage::ScanCursor
+  std::unique_ptr<ScalarStorage::ScanCursor>
+  openScan(uint64_t start_id, const std::vector<std::string> *fields);
 
   std::pair<std::vector<long>, std::vector<float>>
   search(const rapidjson::Document &json_request);
+  std::pair<std::vector<long>, std::vector<float>>
+  hybridSearch(const rapidjson::Document &json_request);
+  std::map<long, uint64_t> facet(const rapidjson::Document &json_request);
 
+  // the indexes may be searched once the snapshot is loaded, they only
+  // miss updates still waiting in the wal then
   void reloadDatabase();
+  RecoveryStatus getRecoveryStatus() const;
+  static std::string recoveryPhaseToString(RecoveryPhase phase);
   void writeWALLog(const std::string &operation_type,
                    const rapidjson::Document &json_data);
   IndexFactory::IndexType
   getIndexTypeFromRequest(const rapidjson::Document &json_request);
 
-  void takeSnapshot();
+  // replication leader side. every update up to the returned log id is
+  // applied, so a scan started afterwards sees all of them.
+  uint64_t appliedLogID();
+  uint64_t latestLogID() const;
+  bool hasWALFrom(uint64_t log_id) const;
+  uint64_t readWAL(WALCursor *cursor, uint64_t from_id, size_t max_bytes,
+                   std::string *out) const;
+  void waitForWAL(uint64_t log_id, std::chrono::milliseconds timeout);
+  // random for every start of the process. log ids up to
+  // incarnationLogID() were recovered, later ones may have been handed out
+  // by an earlier incarnation for other updates that did not survive.
+  uint64_t incarnation() const { return incarnation_; }
+  uint64_t incarnationLogID() const { return incarnation_log_id_; }
+
+  // replica side. metadata kept next to the indexes in rocksdb.
+  void putMetadata(const std::string &key, const std::string &value);
+  std::string getMetadata(const std::string &key);
+  // applies every record in rocksdb to the indexes again without writing
+  // them back, for a replica whose indexes were never snapshotted
+  void reindexFromStorage();
+  // deletes the records with ids in [first_id, last_id] that are not in
+  // keep, with their index entries, and returns how many there were. for
+  // a replica copying its leader's records over its own.
+  size_t removeRecordsExcept(uint64_t first_id, uint64_t last_id,
+                             const std::unordered_set<uint64_t> &keep);
+
+  // skipped while recovery is still running
+  SnapshotResult takeSnapshot();
+  uint64_t walRecordsSinceSnapshot() const;
+  uint64_t walBytesSinceSnapshot() const;
+  Stats getStats();
 
 private:
+  // updates the indexes and attributes, index_mutex_ held exclusively
+  void applyUpsertBatch(const std::vector<uint64_t> &ids,
+                        const std::vector<const rapidjson::Document *> &data,
+                        IndexFactory::IndexType index_type);
+  // writes the records to rocksdb after letting go of index_lock, so
+  // searches do not wait for the write
+  void storeScalars(std::unique_lock<std::shared_mutex> &index_lock,
+                    const std::vector<uint64_t> &ids,
+                    const std::vector<const rapidjson::Document *> &data);
+  // refills the filter bitmaps from attributes_ before replay
+  void rebuildFilterIndex();
+  roaring_bitmap_t *buildFilterBitmap(const rapidjson::Document &json_request);
+  // the reference answer for a search sampled by recall_monitor_
+  std::vector<long> exactSearch(const RecallMonitor::Sample &sample);
+  std::pair<std::vector<long>, std::vector<float>>
+  vectorSearch(const std::vector<float> &query, int k,
+               IndexFactory::IndexType indexType,
+               const roaring_bitmap_t *filter_bitmap);
+
   ScalarStorage scalar_storage_;
   Persistence persistence_;
+  // int fields of every record, mirrors scalar_storage_
+  AttributeStore attributes_;
+  // updates share it from their wal write until their records are in
+  // rocksdb, the snapshot capture takes it exclusively
+  std::shared_mutex write_gate_;
+  // searches share it, updates take it exclusively while they apply to the
+  // indexes, as does the snapshot capture. also guards attributes_.
+  std::shared_mutex index_mutex_;
+  // orders the rocksdb writes of updates, taken before index_mutex_ is
+  // released
+  std::mutex storage_mutex_;
+
+  std::atomic<RecoveryPhase> recovery_phase_{RecoveryPhase::STARTING};
+  std::atomic<uint64_t> replayed_records_{0};
+  std::atomic<uint64_t> replayed_bytes_{0};
+  std::chrono::steady_clock::time_point recovery_start_;
+  std::atomic<int64_t> recovery_millis_{-1};
+  const uint64_t incarnation_;
+  std::atomic<uint64_t> incarnation_log_id_{0};
+  // runs the bm25 side of hybrid searches
+  WorkerPool search_pool_;
+
+  // last, so its thread stops before the state it searches goes away
+  RecallMonitor recall_monitor_;
 };
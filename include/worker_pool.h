@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// a fixed set of threads for the parts of a request that run beside the
+// request thread. a job nobody picked up yet is run by the thread waiting
+// for it, so a busy pool makes a request serial instead of slower.
+class WorkerPool {
+public:
+  class Job {
+  public:
+    explicit Job(std::function<void()> work) : work_(std::move(work)) {}
+
+  private:
+    friend class WorkerPool;
+    // whoever sets it first runs the work
+    bool claim() { return !claimed_.exchange(true); }
+    void run();
+
+    std::function<void()> work_;
+    std::atomic<bool> claimed_{false};
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool done_ = false;
+  };
+
+  explicit WorkerPool(size_t num_threads);
+  ~WorkerPool();
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+
+  std::shared_ptr<Job> submit(std::function<void()> work);
+  // runs job on this thread unless a worker took it, then waits for it
+  static void wait(const std::shared_ptr<Job> &job);
+  size_t size() const { return threads_.size(); }
+
+private:
+  void workerLoop();
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::shared_ptr<Job>> jobs_;
+  bool stop_ = false;
+  std::vector<std::thread> threads_;
+};
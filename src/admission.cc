@@ -0,0 +1,178 @@
+#include "admission.h"
+#include <algorithm>
+
+namespace {
+// weight of the latest request in the service time average
+constexpr double SERVICE_TIME_WEIGHT = 0.1;
+// retry hint while a class has no service time yet, and its bounds
+constexpr std::chrono::milliseconds DEFAULT_RETRY_AFTER{100};
+constexpr std::chrono::milliseconds MAX_RETRY_AFTER{10000};
+} // namespace
+
+AdmissionController::Ticket::~Ticket() {
+  if (controller_ != nullptr) {
+    controller_->release(class_, Clock::now() - start_);
+  }
+}
+
+AdmissionController::AdmissionController(const AdmissionOptions &options)
+    : options_(options) {
+  lanes_[static_cast<size_t>(Class::READ)].limits = options.read;
+  lanes_[static_cast<size_t>(Class::WRITE)].limits = options.write;
+  lanes_[static_cast<size_t>(Class::SNAPSHOT)].limits = options.snapshot;
+  lanes_[static_cast<size_t>(Class::STREAM)].limits = options.stream;
+  for (auto &lane : lanes_) {
+    lane.limits.max_running = std::max<size_t>(lane.limits.max_running, 1);
+  }
+}
+
+AdmissionController::Result
+AdmissionController::admit(Class request_class, Clock::time_point deadline,
+                           Ticket *ticket) {
+  Lane &lane = lanes_[static_cast<size_t>(request_class)];
+  std::unique_lock<std::mutex> lock(lane.mutex);
+  auto now = Clock::now();
+  if (now >= deadline) {
+    lane.rejected++;
+    return Result::DEADLINE_TOO_SHORT;
+  }
+
+  // a free slot goes to the queue first, newcomers do not pass it
+  if (lane.running >= lane.limits.max_running || !lane.waiting.empty()) {
+    size_t queued = lane.waiting.size();
+    if (queued >= lane.limits.max_queued) {
+      lane.rejected++;
+      return Result::QUEUE_FULL;
+    }
+    // the requests ahead leave at max_running per service time, do not
+    // queue one that would time out before it starts
+    auto expected_wait = std::chrono::nanoseconds(static_cast<int64_t>(
+        lane.service_nanos * (queued + 1) / lane.limits.max_running));
+    if (deadline != Clock::time_point::max() &&
+        now + expected_wait >= deadline) {
+      lane.rejected++;
+      return Result::DEADLINE_TOO_SHORT;
+    }
+
+    auto wait_until = std::min(
+        deadline, now + std::chrono::milliseconds(options_.max_queue_wait_ms));
+    uint64_t number = lane.next_number++;
+    lane.waiting.push_back(number);
+    bool free = lane.cv.wait_until(lock, wait_until, [&lane, number] {
+      return lane.running < lane.limits.max_running &&
+             lane.waiting.front() == number;
+    });
+    // a slot that frees up right at the deadline is of no use to it
+    if (free && Clock::now() >= deadline) {
+      free = false;
+    }
+    lane.waiting.erase(
+        std::find(lane.waiting.begin(), lane.waiting.end(), number));
+    if (!free) {
+      lane.rejected++;
+      // the one behind may be first now
+      lock.unlock();
+      lane.cv.notify_all();
+      return wait_until == deadline ? Result::DEADLINE_TOO_SHORT
+                                    : Result::TIMED_OUT;
+    }
+  }
+  lane.running++;
+  bool more = lane.running < lane.limits.max_running && !lane.waiting.empty();
+  lock.unlock();
+  if (more) {
+    lane.cv.notify_all();
+  }
+
+  ticket->controller_ = this;
+  ticket->class_ = request_class;
+  ticket->start_ = Clock::now();
+  ticket->deadline_.emplace(deadline);
+  return Result::ADMITTED;
+}
+
+void AdmissionController::release(Class request_class, Clock::duration held) {
+  Lane &lane = lanes_[static_cast<size_t>(request_class)];
+  {
+    std::lock_guard<std::mutex> lock(lane.mutex);
+    lane.running--;
+    double nanos =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(held).count();
+    lane.service_nanos =
+        lane.service_nanos == 0
+            ? nanos
+            : lane.service_nanos +
+                  SERVICE_TIME_WEIGHT * (nanos - lane.service_nanos);
+  }
+  // only the first in line may take the slot, wake them all to find it
+  lane.cv.notify_all();
+}
+
+std::chrono::milliseconds
+AdmissionController::retryAfter(Class request_class) const {
+  const Lane &lane = lanes_[static_cast<size_t>(request_class)];
+  std::lock_guard<std::mutex> lock(lane.mutex);
+  if (lane.service_nanos == 0) {
+    return DEFAULT_RETRY_AFTER;
+  }
+  // time for the queue in front of a retry to drain
+  auto drain = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::nanoseconds(static_cast<int64_t>(
+          lane.service_nanos * (lane.waiting.size() + 1) /
+          lane.limits.max_running)));
+  return std::clamp(drain, DEFAULT_RETRY_AFTER, MAX_RETRY_AFTER);
+}
+
+AdmissionController::ClassStats
+AdmissionController::getStats(Class request_class) const {
+  const Lane &lane = lanes_[static_cast<size_t>(request_class)];
+  std::lock_guard<std::mutex> lock(lane.mutex);
+  ClassStats stats;
+  stats.running = lane.running;
+  stats.queued = lane.waiting.size();
+  stats.rejected = lane.rejected;
+  stats.service_seconds = lane.service_nanos / 1e9;
+  return stats;
+}
+
+size_t AdmissionController::workerThreads() const {
+  return httpThreads() + options_.helper_threads;
+}
+
+size_t AdmissionController::httpThreads() const {
+  size_t threads = options_.spare_threads;
+  for (const auto &lane : lanes_) {
+    threads += lane.limits.max_running + lane.limits.max_queued;
+  }
+  return threads;
+}
+
+const char *AdmissionController::classToString(Class request_class) {
+  switch (request_class) {
+  case Class::READ:
+    return "read";
+  case Class::WRITE:
+    return "write";
+  case Class::SNAPSHOT:
+    return "snapshot";
+  case Class::STREAM:
+    return "stream";
+  default:
+    return "";
+  }
+}
+
+const char *AdmissionController::resultToString(Result result) {
+  switch (result) {
+  case Result::ADMITTED:
+    return "admitted";
+  case Result::QUEUE_FULL:
+    return "queue full";
+  case Result::DEADLINE_TOO_SHORT:
+    return "deadline too short for the queue";
+  case Result::TIMED_OUT:
+    return "timed out waiting for a slot";
+  default:
+    return "";
+  }
+}
@@ -0,0 +1,113 @@
+#include "attribute_store.h"
+#include "constants.h"
+#include <cstring>
+
+bool AttributeStore::contains(uint64_t id) const {
+  return rows_.count(id) != 0;
+}
+
+bool AttributeStore::getInt(uint64_t id, const std::string &fieldname,
+                            int64_t *value) const {
+  auto row_it = rows_.find(id);
+  if (row_it == rows_.end()) {
+    return false;
+  }
+  auto column_it = int_columns_.find(fieldname);
+  if (column_it == int_columns_.end()) {
+    return false;
+  }
+  const IntColumn &column = column_it->second;
+  uint32_t row = row_it->second;
+  if (row >= column.present.size() || !column.present[row]) {
+    return false;
+  }
+  *value = column.values[row];
+  return true;
+}
+
+void AttributeStore::upsert(uint64_t id, const rapidjson::Value &record) {
+  auto inserted = rows_.emplace(id, 0);
+  if (inserted.second) {
+    if (free_rows_.empty()) {
+      inserted.first->second = row_count_++;
+    } else {
+      inserted.first->second = free_rows_.back();
+      free_rows_.pop_back();
+    }
+  }
+  uint32_t row = inserted.first->second;
+
+  // the record replaces the old one, fields it lacks are gone. a reused
+  // row was cleared by remove()
+  if (!inserted.second) {
+    for (auto &entry : int_columns_) {
+      if (row < entry.second.present.size()) {
+        entry.second.present[row] = false;
+      }
+    }
+  }
+  if (!record.IsObject()) {
+    return;
+  }
+
+  for (auto it = record.MemberBegin(); it != record.MemberEnd(); ++it) {
+    if (!it->value.IsInt64() ||
+        std::strcmp(it->name.GetString(), REQUEST_ID) == 0) {
+      continue;
+    }
+    IntColumn &column = int_columns_[it->name.GetString()];
+    // columns grow lazily, rows past their end have no value
+    if (column.values.size() <= row) {
+      column.values.resize(row + 1);
+      column.present.resize(row + 1, false);
+    }
+    column.values[row] = it->value.GetInt64();
+    column.present[row] = true;
+  }
+}
+
+void AttributeStore::remove(uint64_t id) {
+  auto row_it = rows_.find(id);
+  if (row_it == rows_.end()) {
+    return;
+  }
+  uint32_t row = row_it->second;
+  for (auto &entry : int_columns_) {
+    if (row < entry.second.present.size()) {
+      entry.second.present[row] = false;
+    }
+  }
+  rows_.erase(row_it);
+  free_rows_.push_back(row);
+}
+
+void AttributeStore::forEachInt(
+    const std::function<void(uint64_t, const std::string &, int64_t)> &visit)
+    const {
+  for (const auto &entry : int_columns_) {
+    const IntColumn &column = entry.second;
+    for (const auto &row : rows_) {
+      if (row.second < column.present.size() && column.present[row.second]) {
+        visit(row.first, entry.first, column.values[row.second]);
+      }
+    }
+  }
+}
+
+void AttributeStore::forEachIntOf(
+    uint64_t id,
+    const std::function<void(const std::string &, int64_t)> &visit) const {
+  auto row_it = rows_.find(id);
+  if (row_it == rows_.end()) {
+    return;
+  }
+  uint32_t row = row_it->second;
+  for (const auto &entry : int_columns_) {
+    const IntColumn &column = entry.second;
+    if (row < column.present.size() && column.present[row]) {
+      visit(entry.first, column.values[row]);
+    }
+  }
+}
+
+size_t AttributeStore::size() const { return rows_.size(); }
@@ -0,0 +1,217 @@
+#include "bm25_index.h"
+#include "logger.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <mutex>
+#include <sstream>
+
+BM25Index::BM25Index(float k1, float b) : k1_(k1), b_(b) {}
+
+void BM25Index::addTextField(const std::string &fieldname) {
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  text_fields_.insert(fieldname);
+}
+
+bool BM25Index::isTextField(const std::string &fieldname) const {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  return text_fields_.count(fieldname) != 0;
+}
+
+std::vector<std::string> BM25Index::tokenize(const std::string &text) {
+  std::vector<std::string> tokens;
+  std::string token;
+  for (unsigned char c : text) {
+    // bytes >= 0x80 are kept so utf-8 words survive as a single token
+    if (std::isalnum(c) || c >= 0x80) {
+      token.push_back(static_cast<char>(std::tolower(c)));
+    } else if (!token.empty()) {
+      tokens.push_back(std::move(token));
+      token.clear();
+    }
+  }
+  if (!token.empty()) {
+    tokens.push_back(std::move(token));
+  }
+  return tokens;
+}
+
+void BM25Index::upsertDocument(uint64_t id,
+                               const std::vector<std::string> &texts) {
+  std::unordered_map<std::string, uint32_t> term_freq;
+  uint32_t length = 0;
+  for (const auto &text : texts) {
+    for (auto &token : tokenize(text)) {
+      term_freq[token]++;
+      length++;
+    }
+  }
+
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  removeDocumentLocked(id);
+  dirty_docs_.insert(id);
+  if (length == 0) {
+    return;
+  }
+  for (const auto &entry : term_freq) {
+    postings_[entry.first][id] = entry.second;
+  }
+  doc_terms_[id] = std::move(term_freq);
+  doc_length_[id] = length;
+  total_length_ += length;
+  GlobalLogger->debug("Indexed text document: id={}, length={}", id, length);
+}
+
+void BM25Index::removeDocument(uint64_t id) {
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  removeDocumentLocked(id);
+  dirty_docs_.insert(id);
+}
+
+void BM25Index::removeDocumentLocked(uint64_t id) {
+  auto it = doc_terms_.find(id);
+  if (it == doc_terms_.end()) {
+    return;
+  }
+  for (const auto &entry : it->second) {
+    auto posting_it = postings_.find(entry.first);
+    if (posting_it != postings_.end()) {
+      posting_it->second.erase(id);
+      if (posting_it->second.empty()) {
+        postings_.erase(posting_it);
+      }
+    }
+  }
+  doc_terms_.erase(it);
+  total_length_ -= doc_length_[id];
+  doc_length_.erase(id);
+}
+
+std::pair<std::vector<long>, std::vector<float>>
+BM25Index::search(const std::string &query, int k,
+                  const roaring_bitmap_t *bitmap) {
+  std::vector<std::string> terms = tokenize(query);
+  std::sort(terms.begin(), terms.end());
+  terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  std::vector<long> indices;
+  std::vector<float> scores;
+  size_t num_docs = doc_length_.size();
+  if (num_docs == 0 || k <= 0) {
+    return {indices, scores};
+  }
+  float avg_length = static_cast<float>(total_length_) / num_docs;
+
+  std::unordered_map<uint64_t, float> accumulator;
+  for (const auto &term : terms) {
+    auto posting_it = postings_.find(term);
+    if (posting_it == postings_.end()) {
+      continue;
+    }
+    float df = static_cast<float>(posting_it->second.size());
+    float idf = std::log(1.0f + (num_docs - df + 0.5f) / (df + 0.5f));
+    for (const auto &entry : posting_it->second) {
+      if (bitmap != nullptr &&
+          !roaring_bitmap_contains(bitmap,
+                                   static_cast<uint32_t>(entry.first))) {
+        continue;
+      }
+      float tf = static_cast<float>(entry.second);
+      float norm =
+          k1_ * (1.0f - b_ + b_ * doc_length_.at(entry.first) / avg_length);
+      accumulator[entry.first] += idf * tf * (k1_ + 1.0f) / (tf + norm);
+    }
+  }
+
+  std::vector<std::pair<float, uint64_t>> ranked;
+  ranked.reserve(accumulator.size());
+  for (const auto &entry : accumulator) {
+    ranked.emplace_back(entry.second, entry.first);
+  }
+  size_t top = std::min(ranked.size(), static_cast<size_t>(k));
+  std::partial_sort(ranked.begin(), ranked.begin() + top, ranked.end(),
+                    [](const auto &a, const auto &b) {
+                      return a.first > b.first ||
+                             (a.first == b.first && a.second < b.second);
+                    });
+  for (size_t i = 0; i < top; ++i) {
+    indices.push_back(static_cast<long>(ranked[i].second));
+    scores.push_back(ranked[i].first);
+  }
+  return {indices, scores};
+}
+
+std::string BM25Index::serialize() {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  std::ostringstream oss;
+  for (const auto &doc : doc_terms_) {
+    oss << doc.first;
+    for (const auto &entry : doc.second) {
+      oss << " " << entry.first << " " << entry.second;
+    }
+    oss << "\n";
+  }
+  return oss.str();
+}
+
+std::string BM25Index::serializeDelta() {
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  std::ostringstream oss;
+  for (uint64_t id : dirty_docs_) {
+    oss << id;
+    auto it = doc_terms_.find(id);
+    if (it != doc_terms_.end()) {
+      for (const auto &entry : it->second) {
+        oss << " " << entry.first << " " << entry.second;
+      }
+    }
+    oss << "\n";
+  }
+  dirty_docs_.clear();
+  return oss.str();
+}
+
+void BM25Index::clearDirty() {
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  dirty_docs_.clear();
+}
+
+void BM25Index::deserialize(const std::string &serialized_data) {
+  std::istringstream iss(serialized_data);
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  std::string line;
+  while (std::getline(iss, line)) {
+    std::istringstream line_iss(line);
+    uint64_t id;
+    if (!(line_iss >> id)) {
+      continue;
+    }
+    removeDocumentLocked(id);
+    std::unordered_map<std::string, uint32_t> term_freq;
+    uint32_t length = 0;
+    std::string term;
+    uint32_t tf;
+    while (line_iss >> term >> tf) {
+      term_freq[term] = tf;
+      postings_[term][id] = tf;
+      length += tf;
+    }
+    if (length == 0) {
+      continue;
+    }
+    doc_terms_[id] = std::move(term_freq);
+    doc_length_[id] = length;
+    total_length_ += length;
+  }
+}
+
+void BM25Index::saveIndex(ScalarStorage &scalar_storage,
+                          const std::string &key) {
+  scalar_storage.put(key, serialize());
+}
+
+void BM25Index::loadIndex(ScalarStorage &scalar_storage,
+                          const std::string &key) {
+  deserialize(scalar_storage.get(key));
+}
@@ -0,0 +1,392 @@
+#include "coordinator.h"
+#include "constants.h"
+#include "httplib.h"
+#include "logger.h"
+#include "request_trace.h"
+#include <algorithm>
+#include <chrono>
+#include <queue>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+Coordinator::Coordinator(const CoordinatorOptions &options)
+    : options_(options), fanout_pool_(options.fanout_threads) {
+  for (size_t shard = 0; shard < options_.shards.size(); ++shard) {
+    GlobalLogger->info("Shard {}: {}", shard, shardName(shard));
+    connections_.push_back(std::make_unique<ConnectionPool>());
+  }
+}
+
+// the pool threads are joined before the connections they use go away
+Coordinator::~Coordinator() = default;
+
+size_t Coordinator::shardOf(uint64_t id) const {
+  // splitmix64 finalizer, so runs of consecutive ids spread over the shards
+  uint64_t x = id + 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x % options_.shards.size();
+}
+
+std::string Coordinator::shardName(size_t shard) const {
+  return options_.shards[shard].first + ":" +
+         std::to_string(options_.shards[shard].second);
+}
+
+std::unique_ptr<httplib::Client>
+Coordinator::acquireConnection(size_t shard) const {
+  ConnectionPool &pool = *connections_[shard];
+  {
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    if (!pool.idle.empty()) {
+      std::unique_ptr<httplib::Client> client = std::move(pool.idle.back());
+      pool.idle.pop_back();
+      return client;
+    }
+  }
+  auto client = std::make_unique<httplib::Client>(
+      options_.shards[shard].first, options_.shards[shard].second);
+  client->set_keep_alive(true);
+  return client;
+}
+
+void Coordinator::releaseConnection(
+    size_t shard, std::unique_ptr<httplib::Client> client) const {
+  ConnectionPool &pool = *connections_[shard];
+  std::lock_guard<std::mutex> lock(pool.mutex);
+  if (pool.idle.size() < options_.idle_connections_per_shard) {
+    pool.idle.push_back(std::move(client));
+  }
+}
+
+void Coordinator::setError(rapidjson::Document *response,
+                           const std::string &message) {
+  response->SetObject();
+  rapidjson::Document::AllocatorType &allocator = response->GetAllocator();
+  response->AddMember(RESPONSE_RETCODE, RESPONSE_RETCODE_ERROR, allocator);
+  rapidjson::Value error_msg;
+  error_msg.SetString(message.c_str(), allocator);
+  response->AddMember(RESPONSE_ERROR_MSG, error_msg, allocator);
+}
+
+Coordinator::ShardReply
+Coordinator::call(size_t shard, const std::string &path,
+                  const std::string &body,
+                  RequestDeadline::Clock::time_point deadline) const {
+  ShardReply reply;
+  reply.sent = true;
+
+  // the shard gets what is left of the request's budget, it gives up on
+  // its own instead of searching for an answer nobody waits for
+  int64_t timeout_ms = options_.shard_timeout_ms;
+  httplib::Headers headers;
+  if (deadline != RequestDeadline::Clock::time_point::max()) {
+    int64_t remaining_ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - RequestDeadline::Clock::now())
+            .count();
+    if (remaining_ms <= 0) {
+      reply.error = "deadline exceeded";
+      return reply;
+    }
+    timeout_ms = std::min(timeout_ms, remaining_ms);
+    headers.emplace(REQUEST_HEADER_TIMEOUT_MS, std::to_string(remaining_ms));
+  }
+
+  // connections are kept open between requests, the timeouts are set for
+  // each one and bound a slow shard
+  std::unique_ptr<httplib::Client> client = acquireConnection(shard);
+  time_t seconds = timeout_ms / 1000;
+  time_t micros = (timeout_ms % 1000) * 1000;
+  client->set_connection_timeout(seconds, micros);
+  client->set_read_timeout(seconds, micros);
+  client->set_write_timeout(seconds, micros);
+
+  auto res = client->Post(path, headers, body, RESPONSE_CONTENT_TYPE_JSON);
+  if (!res) {
+    // the connection may be half way through a response, it is dropped
+    reply.error = httplib::to_string(res.error());
+    return reply;
+  }
+  releaseConnection(shard, std::move(client));
+  reply.status = res->status;
+  reply.json.Parse(res->body.c_str());
+  if (!reply.json.IsObject()) {
+    reply.error = "invalid json response";
+    return reply;
+  }
+  reply.ok = res->status == 200;
+  if (!reply.ok) {
+    reply.error = "status " + std::to_string(res->status);
+  }
+  return reply;
+}
+
+std::vector<Coordinator::ShardReply>
+Coordinator::fanOut(const std::string &path,
+                    const std::vector<std::string> &bodies) const {
+  TraceSpan span("shard_fanout");
+  // the deadline is thread local, the pool threads get it passed in
+  auto deadline = RequestDeadline::current();
+  std::vector<ShardReply> replies(bodies.size());
+  std::vector<std::shared_ptr<WorkerPool::Job>> jobs;
+  for (size_t shard = 0; shard < bodies.size(); ++shard) {
+    if (!bodies[shard].empty()) {
+      jobs.push_back(fanout_pool_.submit([this, shard, &path, &bodies,
+                                          &replies, deadline]() {
+        replies[shard] = call(shard, path, bodies[shard], deadline);
+      }));
+    }
+  }
+  // requests no pool thread took yet are sent from this thread
+  for (const auto &job : jobs) {
+    WorkerPool::wait(job);
+  }
+  return replies;
+}
+
+int Coordinator::collectFailures(const std::vector<ShardReply> &replies,
+                                 std::vector<size_t> *failed,
+                                 rapidjson::Document *response) const {
+  size_t sent = 0;
+  for (size_t shard = 0; shard < replies.size(); ++shard) {
+    if (!replies[shard].sent) {
+      continue;
+    }
+    sent++;
+    if (!replies[shard].ok) {
+      GlobalLogger->warn("Shard {} failed: {}", shardName(shard),
+                         replies[shard].error);
+      failed->push_back(shard);
+    }
+  }
+  if (RequestTrace *trace = RequestTrace::current()) {
+    trace->annotate("failed_shards", failed->size());
+  }
+  if (failed->empty() || (options_.allow_partial && failed->size() < sent)) {
+    return 200;
+  }
+  setError(response, std::to_string(failed->size()) + " of " +
+                         std::to_string(sent) + " shards failed");
+  addFailures(*failed, response);
+  return 503;
+}
+
+void Coordinator::addFailures(const std::vector<size_t> &failed,
+                              rapidjson::Document *response) const {
+  if (failed.empty()) {
+    return;
+  }
+  rapidjson::Document::AllocatorType &allocator = response->GetAllocator();
+  rapidjson::Value shards(rapidjson::kArrayType);
+  for (size_t shard : failed) {
+    rapidjson::Value name;
+    name.SetString(shardName(shard).c_str(), allocator);
+    shards.PushBack(name, allocator);
+  }
+  response->AddMember(RESPONSE_FAILED_SHARDS, shards, allocator);
+}
+
+int Coordinator::forward(const std::string &path, uint64_t id,
+                         const std::string &body,
+                         rapidjson::Document *response) const {
+  size_t shard = shardOf(id);
+  ShardReply reply =
+      call(shard, path, body, RequestDeadline::current());
+  if (!reply.json.IsObject()) {
+    GlobalLogger->warn("Shard {} failed: {}", shardName(shard), reply.error);
+    setError(response, "Shard " + shardName(shard) +
+                           " is unavailable: " + reply.error);
+    return 503;
+  }
+  response->Swap(reply.json);
+  return reply.status;
+}
+
+int Coordinator::search(const rapidjson::Document &request,
+                        const std::string &body,
+                        rapidjson::Document *response) const {
+  std::vector<ShardReply> replies =
+      fanOut("/search", std::vector<std::string>(shardCount(), body));
+  std::vector<size_t> failed;
+  int status = collectFailures(replies, &failed, response);
+  if (status != 200) {
+    return status;
+  }
+
+  // fused hybrid scores grow with relevance, distances shrink
+  bool hybrid = request.HasMember(REQUEST_TEXT_QUERY);
+  const char *score_key = hybrid ? RESPONSE_SCORES : RESPONSE_DISTANCES;
+  size_t k = static_cast<size_t>(std::max(0, request[REQUEST_K].GetInt()));
+
+  // every shard's hits are already in order, a heap over the heads of the
+  // lists yields the merged order
+  struct Head {
+    float score;
+    size_t shard;
+    rapidjson::SizeType pos;
+  };
+  auto after = [hybrid](const Head &a, const Head &b) {
+    return hybrid ? a.score < b.score : a.score > b.score;
+  };
+  std::priority_queue<Head, std::vector<Head>, decltype(after)> heads(after);
+  bool stale = false;
+  for (size_t shard = 0; shard < replies.size(); ++shard) {
+    const rapidjson::Document &hits = replies[shard].json;
+    if (!replies[shard].ok) {
+      continue;
+    }
+    if (hits.HasMember(RESPONSE_STALE) && hits[RESPONSE_STALE].IsBool()) {
+      stale = stale || hits[RESPONSE_STALE].GetBool();
+    }
+    if (hits.HasMember(RESPONSE_VECTORS) && hits[RESPONSE_VECTORS].IsArray() &&
+        hits.HasMember(score_key) && hits[score_key].IsArray() &&
+        !hits[RESPONSE_VECTORS].Empty()) {
+      heads.push({hits[score_key][0].GetFloat(), shard, 0});
+    }
+  }
+
+  response->SetObject();
+  rapidjson::Document::AllocatorType &allocator = response->GetAllocator();
+  rapidjson::Value vectors(rapidjson::kArrayType);
+  rapidjson::Value scores(rapidjson::kArrayType);
+  rapidjson::Value records(rapidjson::kArrayType);
+  while (!heads.empty() && vectors.Size() < k) {
+    Head head = heads.top();
+    heads.pop();
+    const rapidjson::Document &hits = replies[head.shard].json;
+    vectors.PushBack(hits[RESPONSE_VECTORS][head.pos].GetInt64(), allocator);
+    scores.PushBack(head.score, allocator);
+    if (hits.HasMember(RESPONSE_RECORDS) && hits[RESPONSE_RECORDS].IsArray() &&
+        head.pos < hits[RESPONSE_RECORDS].Size()) {
+      rapidjson::Value record;
+      record.CopyFrom(hits[RESPONSE_RECORDS][head.pos], allocator);
+      records.PushBack(record, allocator);
+    }
+    if (head.pos + 1 < hits[RESPONSE_VECTORS].Size() &&
+        head.pos + 1 < hits[score_key].Size()) {
+      heads.push({hits[score_key][head.pos + 1].GetFloat(), head.shard,
+                  head.pos + 1});
+    }
+  }
+
+  if (!vectors.Empty()) {
+    response->AddMember(RESPONSE_VECTORS, vectors, allocator);
+    response->AddMember(rapidjson::StringRef(score_key), scores, allocator);
+    if (request.HasMember(REQUEST_FIELDS)) {
+      response->AddMember(RESPONSE_RECORDS, records, allocator);
+    }
+  }
+  if (stale) {
+    response->AddMember(RESPONSE_STALE, true, allocator);
+  }
+  if (!failed.empty()) {
+    response->AddMember(RESPONSE_PARTIAL, true, allocator);
+    addFailures(failed, response);
+  }
+  response->AddMember(RESPONSE_RETCODE, RESPONSE_RETCODE_SUCCESS, allocator);
+  return 200;
+}
+
+int Coordinator::query(const rapidjson::Document &request,
+                       const std::string &body,
+                       rapidjson::Document *response) const {
+  if (!request.HasMember(REQUEST_IDS)) {
+    return forward("/query", request[REQUEST_ID].GetUint64(), body,
+                   response);
+  }
+
+  const rapidjson::Value &ids = request[REQUEST_IDS];
+  // positions in the request of the ids each shard owns
+  std::vector<std::vector<size_t>> positions(shardCount());
+  for (rapidjson::SizeType i = 0; i < ids.Size(); ++i) {
+    if (!ids[i].IsUint64()) {
+      setError(response, "Invalid ids parameter in the request");
+      return 400;
+    }
+    positions[shardOf(ids[i].GetUint64())].push_back(i);
+  }
+
+  std::vector<std::string> bodies(shardCount());
+  for (size_t shard = 0; shard < shardCount(); ++shard) {
+    if (positions[shard].empty()) {
+      continue;
+    }
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key(REQUEST_IDS);
+    writer.StartArray();
+    for (size_t pos : positions[shard]) {
+      writer.Uint64(ids[static_cast<rapidjson::SizeType>(pos)].GetUint64());
+    }
+    writer.EndArray();
+    if (request.HasMember(REQUEST_FIELDS)) {
+      writer.Key(REQUEST_FIELDS);
+      request[REQUEST_FIELDS].Accept(writer);
+    }
+    writer.EndObject();
+    bodies[shard] = buffer.GetString();
+  }
+
+  std::vector<ShardReply> replies = fanOut("/query", bodies);
+  std::vector<size_t> failed;
+  int status = collectFailures(replies, &failed, response);
+  if (status != 200) {
+    return status;
+  }
+
+  // ids of a failed shard stay null like missing ones
+  response->SetObject();
+  rapidjson::Document::AllocatorType &allocator = response->GetAllocator();
+  rapidjson::Value records(rapidjson::kArrayType);
+  records.Reserve(ids.Size(), allocator);
+  for (rapidjson::SizeType i = 0; i < ids.Size(); ++i) {
+    records.PushBack(rapidjson::Value(), allocator);
+  }
+  for (size_t shard = 0; shard < shardCount(); ++shard) {
+    const rapidjson::Document &reply = replies[shard].json;
+    if (!replies[shard].ok || !reply.HasMember(RESPONSE_RECORDS) ||
+        !reply[RESPONSE_RECORDS].IsArray()) {
+      continue;
+    }
+    const rapidjson::Value &shard_records = reply[RESPONSE_RECORDS];
+    for (size_t j = 0;
+         j < positions[shard].size() && j < shard_records.Size(); ++j) {
+      records[static_cast<rapidjson::SizeType>(positions[shard][j])].CopyFrom(
+          shard_records[static_cast<rapidjson::SizeType>(j)], allocator);
+    }
+  }
+  response->AddMember(RESPONSE_RECORDS, records, allocator);
+  if (!failed.empty()) {
+    response->AddMember(RESPONSE_PARTIAL, true, allocator);
+    addFailures(failed, response);
+  }
+  response->AddMember(RESPONSE_RETCODE, RESPONSE_RETCODE_SUCCESS, allocator);
+  return 200;
+}
+
+int Coordinator::snapshot(rapidjson::Document *response) const {
+  std::vector<ShardReply> replies =
+      fanOut("/admin/snapshot", std::vector<std::string>(shardCount(), "{}"));
+  std::vector<size_t> failed;
+  for (size_t shard = 0; shard < replies.size(); ++shard) {
+    if (!replies[shard].ok) {
+      GlobalLogger->warn("Snapshot of shard {} failed: {}", shardName(shard),
+                         replies[shard].error);
+      failed.push_back(shard);
+    }
+  }
+  if (!failed.empty()) {
+    setError(response, std::to_string(failed.size()) + " of " +
+                           std::to_string(shardCount()) +
+                           " shards failed to snapshot");
+    addFailures(failed, response);
+    return 503;
+  }
+  response->SetObject();
+  response->AddMember(RESPONSE_RETCODE, RESPONSE_RETCODE_SUCCESS,
+                      response->GetAllocator());
+  return 200;
+}
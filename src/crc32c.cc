@@ -0,0 +1,43 @@
+#include "crc32c.h"
+#include <array>
+#include <cstring>
+
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+namespace {
+constexpr uint32_t kCastagnoliPoly = 0x82F63B78;
+
+constexpr std::array<uint32_t, 256> makeTable() {
+  std::array<uint32_t, 256> table{};
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int j = 0; j < 8; ++j) {
+      crc = (crc & 1) ? (crc >> 1) ^ kCastagnoliPoly : crc >> 1;
+    }
+    table[i] = crc;
+  }
+  return table;
+}
+
+constexpr std::array<uint32_t, 256> kTable = makeTable();
+} // namespace
+
+uint32_t crc32c_extend(uint32_t crc, const char *data, size_t size) {
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+  crc = ~crc;
+#ifdef __SSE4_2__
+  while (size >= sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, p, sizeof(uint64_t));
+    crc = static_cast<uint32_t>(_mm_crc32_u64(crc, word));
+    p += sizeof(uint64_t);
+    size -= sizeof(uint64_t);
+  }
+#endif
+  while (size-- > 0) {
+    crc = kTable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
@@ -1,6 +1,7 @@
 #include "faiss_index.h"
 #include "constants.h"
 #include "logger.h"
+#include <algorithm>
 #include <faiss/IndexFlat.h>
 #include <faiss/IndexIDMap.h>
 #include <faiss/index_io.h>
@@ -13,10 +14,28 @@ bool RoaringBitmapIDSelector::is_member(int64_t id) const {
 
 FaissIndex::FaissIndex(faiss::Index *index) : index(index) {}
 
+FaissIndex::~FaissIndex() { delete index; }
+
 void FaissIndex::insert_vectors(const std::vector<float> &data,
                                 uint64_t label) {
   long id = static_cast<long>(label);
   index->add_with_ids(1, data.data(), &id);
+  dirty_ids_.insert(id);
+  dirty_vectors_[id].assign(data.begin(), data.begin() + index->d);
+}
+
+void FaissIndex::insert_vectors(const std::vector<float> &data,
+                                const std::vector<long> &labels) {
+  if (labels.empty()) {
+    return;
+  }
+  index->add_with_ids(labels.size(), data.data(), labels.data());
+  dirty_ids_.insert(labels.begin(), labels.end());
+  size_t dim = index->d;
+  for (size_t i = 0; i < labels.size(); ++i) {
+    dirty_vectors_[labels[i]].assign(data.begin() + i * dim,
+                                     data.begin() + (i + 1) * dim);
+  }
 }
 
 void FaissIndex::remove_vectors(const std::vector<long> &ids) {
@@ -24,6 +43,10 @@ void FaissIndex::remove_vectors(const std::vector<long> &ids) {
   if (id_map) {
     faiss::IDSelectorBatch selector(ids.size(), ids.data());
     id_map->remove_ids(selector);
+    dirty_ids_.insert(ids.begin(), ids.end());
+    for (long id : ids) {
+      dirty_vectors_.erase(id);
+    }
   } else {
     throw std::runtime_error("Underlying Faiss index is not an IndexIDMap");
   }
@@ -46,13 +69,10 @@ FaissIndex::search_vectors(const std::vector<float> &query, int k,
   index->search(num_queries, query.data(), k, distances.data(), indices.data(),
                 &search_params);
 
-  GlobalLogger->debug("Retrieved values:");
-  for (size_t i = 0; i < indices.size(); ++i) {
-    if (indices[i] != -1) {
-      GlobalLogger->debug("ID: {}, Distance: {}", indices[i], distances[i]);
-    } else {
-      GlobalLogger->debug("No specific value found");
-    }
+  if (GlobalLogger->should_log(spdlog::level::trace)) {
+    size_t found = std::count_if(indices.begin(), indices.end(),
+                                 [](long id) { return id != -1; });
+    GlobalLogger->trace("Retrieved {} of {} results", found, indices.size());
   }
   return {indices, distances};
 }
@@ -73,3 +93,16 @@ void FaissIndex::loadIndex(const std::string &file_path) {
                        file_path);
   }
 }
+
+size_t FaissIndex::size() const { return index->ntotal; }
+
+std::vector<long> FaissIndex::takeDirtyIds(
+    std::unordered_map<long, std::vector<float>> *vectors) {
+  std::vector<long> ids(dirty_ids_.begin(), dirty_ids_.end());
+  dirty_ids_.clear();
+  if (vectors != nullptr) {
+    *vectors = std::move(dirty_vectors_);
+  }
+  dirty_vectors_.clear();
+  return ids;
+}
@@ -6,6 +6,14 @@
 
 FilterIndex::FilterIndex() {}
 
+FilterIndex::~FilterIndex() {
+  for (auto &field_entry : intFieldFilter) {
+    for (auto &value_entry : field_entry.second) {
+      roaring_bitmap_free(value_entry.second);
+    }
+  }
+}
+
 void FilterIndex::addIntFieldFilter(const std::string &fieldname, int64_t value,
                                     uint64_t id) {
   roaring_bitmap_t *bitmap = roaring_bitmap_create();
@@ -53,6 +61,30 @@ void FilterIndex::updateIntFieldFilter(const std::string &fieldname,
   }
 }
 
+void FilterIndex::removeIntFieldFilter(const std::string &fieldname,
+                                       int64_t value, uint64_t id) {
+  auto it = intFieldFilter.find(fieldname);
+  if (it == intFieldFilter.end()) {
+    return;
+  }
+  auto bitmap_it = it->second.find(value);
+  if (bitmap_it != it->second.end()) {
+    roaring_bitmap_remove(bitmap_it->second, id);
+  }
+  GlobalLogger->debug("Removed int field filter: fieldname={}, value={}, "
+                      "id={}",
+                      fieldname, value, id);
+}
+
+void FilterIndex::clear() {
+  for (auto &field_entry : intFieldFilter) {
+    for (auto &value_entry : field_entry.second) {
+      roaring_bitmap_free(value_entry.second);
+    }
+  }
+  intFieldFilter.clear();
+}
+
 void FilterIndex::getIntFieldFilterBitmap(const std::string &fieldname,
                                           Operation op, int64_t value,
                                           roaring_bitmap_t *result_bitmap) {
@@ -80,6 +112,43 @@ void FilterIndex::getIntFieldFilterBitmap(const std::string &fieldname,
   }
 }
 
+std::map<long, uint64_t>
+FilterIndex::getIntFieldFacetCounts(const std::string &fieldname,
+                                    const roaring_bitmap_t *base_bitmap) {
+  std::map<long, uint64_t> counts;
+  auto it = intFieldFilter.find(fieldname);
+  if (it == intFieldFilter.end()) {
+    return counts;
+  }
+
+  for (const auto &entry : it->second) {
+    uint64_t count =
+        (base_bitmap != nullptr)
+            ? roaring_bitmap_and_cardinality(entry.second, base_bitmap)
+            : roaring_bitmap_get_cardinality(entry.second);
+    if (count != 0) {
+      counts[entry.first] = count;
+    }
+  }
+  GlobalLogger->debug("Computed {} facet counts for fieldname={}",
+                      counts.size(), fieldname);
+  return counts;
+}
+
+void FilterIndex::serializeBitmap(std::ostringstream &oss,
+                                  const std::string &field_name, long value,
+                                  const roaring_bitmap_t *bitmap) {
+  uint32_t size = roaring_bitmap_portable_size_in_bytes(bitmap);
+  char *serialized_bitmap = new char[size];
+  roaring_bitmap_portable_serialize(bitmap, serialized_bitmap);
+
+  oss << field_name << "|" << value << "|";
+  oss.write(serialized_bitmap, size);
+  oss << std::endl;
+
+  delete[] serialized_bitmap;
+}
+
 std::string FilterIndex::serializeIntFieldFilter() {
   std::ostringstream oss;
 
@@ -88,22 +157,29 @@ std::string FilterIndex::serializeIntFieldFilter() {
     const std::map<long, roaring_bitmap_t *> &value_map = field_entry.second;
 
     for (const auto &value_entry : value_map) {
-      long value = value_entry.first;
-      const roaring_bitmap_t *bitmap = value_entry.second;
+      serializeBitmap(oss, field_name, value_entry.first, value_entry.second);
+    }
+  }
 
-      uint32_t size = roaring_bitmap_portable_size_in_bytes(bitmap);
-      char *serialized_bitmap = new char[size];
-      roaring_bitmap_portable_serialize(bitmap, serialized_bitmap);
+  return oss.str();
+}
 
-      oss << field_name << "|" << value << "|";
-      oss.write(serialized_bitmap, size);
-      oss << std::endl;
+size_t FilterIndex::bitmapCount() const {
+  size_t count = 0;
+  for (const auto &field : intFieldFilter) {
+    count += field.second.size();
+  }
+  return count;
+}
 
-      delete[] serialized_bitmap;
+size_t FilterIndex::bitmapBytes() const {
+  size_t bytes = 0;
+  for (const auto &field : intFieldFilter) {
+    for (const auto &value : field.second) {
+      bytes += roaring_bitmap_size_in_bytes(value.second);
     }
   }
-
-  return oss.str();
+  return bytes;
 }
 
 void FilterIndex::deserializeIntFieldFilter(
@@ -126,7 +202,11 @@ void FilterIndex::deserializeIntFieldFilter(
     roaring_bitmap_t *bitmap =
         roaring_bitmap_portable_deserialize(serialized_bitmap.data());
 
-    intFieldFilter[field_name][value] = bitmap;
+    roaring_bitmap_t *&slot = intFieldFilter[field_name][value];
+    if (slot != nullptr) {
+      roaring_bitmap_free(slot);
+    }
+    slot = bitmap;
   }
 }
 
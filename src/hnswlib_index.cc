@@ -1,9 +1,30 @@
 #include "hnswlib_index.h"
 #include "constants.h"
 #include "logger.h"
+#include "request_trace.h"
 #include <iostream>
 #include <vector>
 
+namespace {
+// counts the candidates hnswlib offers for the result set while a request
+// is traced. hnswlib leaves its bare search path whenever a filter is
+// given, so it is only used then.
+class CountingIDFilter : public hnswlib::BaseFilterFunctor {
+public:
+  explicit CountingIDFilter(const roaring_bitmap_t *bitmap) : bitmap_(bitmap) {}
+  bool operator()(hnswlib::labeltype label) override {
+    ++count_;
+    return bitmap_ == nullptr ||
+           roaring_bitmap_contains(bitmap_, static_cast<uint32_t>(label));
+  }
+  uint64_t count() const { return count_; }
+
+private:
+  const roaring_bitmap_t *bitmap_;
+  uint64_t count_ = 0;
+};
+} // namespace
+
 HNSWLibIndex::HNSWLibIndex(int dim, int num_data,
                            IndexFactory::MetricType metric, int M,
                            int ef_construction)
@@ -19,9 +40,39 @@ HNSWLibIndex::HNSWLibIndex(int dim, int num_data,
       new hnswlib::HierarchicalNSW<float>(space, num_data, M, ef_construction);
 }
 
+HNSWLibIndex::~HNSWLibIndex() {
+  delete index;
+  delete space;
+}
+
 void HNSWLibIndex::insert_vectors(const std::vector<float> &data,
                                   uint64_t label) {
   index->addPoint(data.data(), static_cast<hnswlib::labeltype>(label));
+  dirty_ids_.insert(static_cast<long>(label));
+}
+
+void HNSWLibIndex::insert_vectors(const std::vector<float> &data,
+                                  const std::vector<long> &labels) {
+  if (labels.empty()) {
+    return;
+  }
+  size_t dim = data.size() / labels.size();
+  for (size_t i = 0; i < labels.size(); ++i) {
+    index->addPoint(data.data() + i * dim,
+                    static_cast<hnswlib::labeltype>(labels[i]));
+  }
+  dirty_ids_.insert(labels.begin(), labels.end());
+}
+
+void HNSWLibIndex::remove_vectors(const std::vector<long> &ids) {
+  for (long id : ids) {
+    try {
+      index->markDelete(static_cast<hnswlib::labeltype>(id));
+    } catch (const std::exception &) {
+      // not in the index, nothing to remove
+    }
+    dirty_ids_.insert(id);
+  }
 }
 
 std::pair<std::vector<long>, std::vector<float>>
@@ -29,6 +80,15 @@ HNSWLibIndex::search_vectors(const std::vector<float> &query, int k,
                              const roaring_bitmap_t *bitmap, int ef_search) {
   index->setEf(ef_search);
 
+  RequestTrace *trace = RequestTrace::current();
+  if (trace != nullptr) {
+    CountingIDFilter counter(bitmap);
+    auto result = index->searchKnn(query.data(), k, &counter);
+    trace->annotate("candidates", counter.count());
+    trace->annotate("ef_search", static_cast<uint64_t>(ef_search));
+    return toResults(result);
+  }
+
   RoaringBitmapIDFilter *selector = nullptr;
   if (bitmap != nullptr) {
     selector = new RoaringBitmapIDFilter(bitmap);
@@ -36,6 +96,58 @@ HNSWLibIndex::search_vectors(const std::vector<float> &query, int k,
 
   auto result = index->searchKnn(query.data(), k, selector);
 
+  if (bitmap != nullptr) {
+    delete selector;
+  }
+
+  return toResults(result);
+}
+
+std::vector<long>
+HNSWLibIndex::exactSearch(const std::vector<float> &query, int k,
+                          const roaring_bitmap_t *bitmap, size_t block_size,
+                          const std::function<void()> &between_blocks) const {
+  // max-heap of the k nearest so far
+  std::priority_queue<std::pair<float, long>> nearest;
+  // the count is read again after every block, the index may have grown.
+  // an update rewrites its label's slot in place, so no label is seen twice.
+  for (size_t i = 0; i < index->cur_element_count; ++i) {
+    if (i != 0 && i % block_size == 0) {
+      between_blocks();
+      if (i >= index->cur_element_count) {
+        break;
+      }
+    }
+    hnswlib::tableint internal_id = static_cast<hnswlib::tableint>(i);
+    if (index->isMarkedDeleted(internal_id)) {
+      continue;
+    }
+    hnswlib::labeltype label = index->getExternalLabel(internal_id);
+    if (bitmap != nullptr &&
+        !roaring_bitmap_contains(bitmap, static_cast<uint32_t>(label))) {
+      continue;
+    }
+    float distance = index->fstdistfunc_(
+        query.data(), index->getDataByInternalId(internal_id),
+        index->dist_func_param_);
+    if (nearest.size() < static_cast<size_t>(k)) {
+      nearest.emplace(distance, static_cast<long>(label));
+    } else if (distance < nearest.top().first) {
+      nearest.pop();
+      nearest.emplace(distance, static_cast<long>(label));
+    }
+  }
+
+  std::vector<long> ids(nearest.size());
+  for (size_t i = ids.size(); i > 0; --i) {
+    ids[i - 1] = nearest.top().second;
+    nearest.pop();
+  }
+  return ids;
+}
+
+std::pair<std::vector<long>, std::vector<float>> HNSWLibIndex::toResults(
+    std::priority_queue<std::pair<float, hnswlib::labeltype>> &result) {
   std::vector<long> indices;
   std::vector<float> distances;
   while (!result.empty()) {
@@ -44,11 +156,6 @@ HNSWLibIndex::search_vectors(const std::vector<float> &query, int k,
     distances.push_back(item.first);
     result.pop();
   }
-
-  if (bitmap != nullptr) {
-    delete selector;
-  }
-
   return {indices, distances};
 }
 
@@ -65,4 +172,27 @@ void HNSWLibIndex::loadIndex(const std::string &file_path) {
     GlobalLogger->warn("File not found: {}. Skipping loading index.",
                        file_path);
   }
-}
\ No newline at end of file
+}
+size_t HNSWLibIndex::size() const {
+  return index->getCurrentElementCount() - index->getDeletedCount();
+}
+
+std::vector<long> HNSWLibIndex::takeDirtyIds() {
+  std::vector<long> ids(dirty_ids_.begin(), dirty_ids_.end());
+  dirty_ids_.clear();
+  return ids;
+}
+
+std::unordered_map<long, std::vector<float>>
+HNSWLibIndex::getVectors(const std::vector<long> &ids) const {
+  std::unordered_map<long, std::vector<float>> vectors;
+  for (long id : ids) {
+    try {
+      vectors[id] =
+          index->getDataByLabel<float>(static_cast<hnswlib::labeltype>(id));
+    } catch (const std::exception &) {
+      // deleted or never inserted
+    }
+  }
+  return vectors;
+}
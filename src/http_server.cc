@@ -1,45 +1,249 @@
 #include "http_server.h"
 #include "constants.h"
-#include "faiss_index.h"
-#include "hnswlib_index.h"
 #include "index_factory.h"
 #include "logger.h"
+#include "metrics.h"
+#include "request_trace.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <optional>
 #include <rapidjson/document.h>
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 
+namespace {
+// observes the latency of a handler, a 4xx or 5xx status counts as an
+// error. traces the request while the slow query log is on.
+class RequestTimer {
+public:
+  RequestTimer(Metrics::Handler handler, const httplib::Response &res)
+      : handler_(handler), res_(res),
+        start_(std::chrono::steady_clock::now()) {
+    if (RequestTrace::enabled()) {
+      trace_.emplace(Metrics::handlerToString(handler));
+      scope_.emplace(&*trace_);
+    }
+  }
+  ~RequestTimer() {
+    getGlobalMetrics()->observe(
+        handler_,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_)
+            .count(),
+        res_.status >= 400);
+    if (trace_) {
+      scope_.reset();
+      // httplib fills in 200 after the handler when it set no status
+      trace_->annotate("status",
+                       std::to_string(res_.status == -1 ? 200 : res_.status));
+      trace_->finish();
+    }
+  }
+
+private:
+  Metrics::Handler handler_;
+  const httplib::Response &res_;
+  std::chrono::steady_clock::time_point start_;
+  std::optional<RequestTrace> trace_;
+  std::optional<RequestTrace::Scope> scope_;
+};
+
+// request bodies can be tens of KB with large vectors, log a few of them
+LogLimiter search_log_limiter("search request", 10);
+LogLimiter insert_log_limiter("insert request", 10);
+
+void appendStorageGauge(
+    std::string *out, const std::string &name, const std::string &help,
+    const std::vector<std::pair<std::string, uint64_t>> &values) {
+  for (const auto &value : values) {
+    Metrics::appendGauge(out, name, help, value.second,
+                         "column_family=\"" + value.first + "\"");
+  }
+}
+} // namespace
+
 HttpServer::HttpServer(const std::string &host, int port,
-                       VectorDatabase *vector_database)
-    : host(host), port(port), vector_database_(vector_database) {
+                       VectorDatabase *vector_database,
+                       const AdmissionOptions &admission_options)
+    : host(host), port(port), vector_database_(vector_database),
+      admission_(admission_options) {
+  // a request waiting for admission holds its http worker, there are
+  // enough workers for every class to fill its slots and queue with some
+  // to spare for the cheap endpoints
+  size_t threads = admission_.httpThreads();
+  GlobalLogger->info("{} http workers, {} threads serving requests in all",
+                     threads, admission_.workerThreads());
+  server.new_task_queue = [threads] {
+    return new httplib::ThreadPool(threads);
+  };
+
   server.Post("/search",
               [this](const httplib::Request &req, httplib::Response &res) {
-                searchHandler(req, res);
+                RequestTimer timer(Metrics::Handler::SEARCH, res);
+                AdmissionController::Ticket ticket;
+                if (admit(AdmissionController::Class::READ, req, res,
+                          &ticket)) {
+                  searchHandler(req, res);
+                }
               });
 
   server.Post("/insert",
               [this](const httplib::Request &req, httplib::Response &res) {
-                insertHandler(req, res);
+                RequestTimer timer(Metrics::Handler::INSERT, res);
+                AdmissionController::Ticket ticket;
+                if (admit(AdmissionController::Class::WRITE, req, res,
+                          &ticket)) {
+                  insertHandler(req, res);
+                }
               });
 
   server.Post("/upsert",
               [this](const httplib::Request &req, httplib::Response &res) {
-                upsertHandler(req, res);
+                RequestTimer timer(Metrics::Handler::UPSERT, res);
+                AdmissionController::Ticket ticket;
+                if (admit(AdmissionController::Class::WRITE, req, res,
+                          &ticket)) {
+                  upsertHandler(req, res);
+                }
               });
 
   server.Post("/query",
               [this](const httplib::Request &req, httplib::Response &res) {
-                queryHandler(req, res);
+                RequestTimer timer(Metrics::Handler::QUERY, res);
+                AdmissionController::Ticket ticket;
+                if (admit(AdmissionController::Class::READ, req, res,
+                          &ticket)) {
+                  queryHandler(req, res);
+                }
               });
-  server.Post(
-      "/admin/snapshot",
-      [this](const httplib::Request &req,
-             httplib::Response &res) { 
-        snapshotHandler(req, res);
-      });
+  server.Post("/facet",
+              [this](const httplib::Request &req, httplib::Response &res) {
+                RequestTimer timer(Metrics::Handler::FACET, res);
+                AdmissionController::Ticket ticket;
+                if (admit(AdmissionController::Class::READ, req, res,
+                          &ticket)) {
+                  facetHandler(req, res);
+                }
+              });
+  // streams hold their slot and http worker until the response ends
+  server.Post("/scan",
+              [this](const httplib::Request &req, httplib::Response &res) {
+                auto ticket = std::make_shared<AdmissionController::Ticket>();
+                if (admit(AdmissionController::Class::STREAM, req, res,
+                          ticket.get())) {
+                  scanHandler(req, res, ticket);
+                }
+              });
+  server.Get("/admin/ready",
+             [this](const httplib::Request &req, httplib::Response &res) {
+               readyHandler(req, res);
+             });
+  server.Post("/admin/snapshot",
+              [this](const httplib::Request &req, httplib::Response &res) {
+                RequestTimer timer(Metrics::Handler::SNAPSHOT, res);
+                AdmissionController::Ticket ticket;
+                if (admit(AdmissionController::Class::SNAPSHOT, req, res,
+                          &ticket)) {
+                  snapshotHandler(req, res);
+                }
+              });
+  server.Get("/admin/log_level",
+             [this](const httplib::Request &req, httplib::Response &res) {
+               logLevelHandler(req, res);
+             });
+  server.Post("/admin/log_level",
+              [this](const httplib::Request &req, httplib::Response &res) {
+                logLevelHandler(req, res);
+              });
+  server.Get("/metrics",
+             [this](const httplib::Request &req, httplib::Response &res) {
+               metricsHandler(req, res);
+             });
+  server.Get("/replication/status",
+             [this](const httplib::Request &req, httplib::Response &res) {
+               replicationStatusHandler(req, res);
+             });
+  server.Get("/replication/wal",
+             [this](const httplib::Request &req, httplib::Response &res) {
+               auto ticket = std::make_shared<AdmissionController::Ticket>();
+               if (admit(AdmissionController::Class::STREAM, req, res,
+                         ticket.get())) {
+                 walStreamHandler(req, res, ticket);
+               }
+             });
+  server.Get("/admin/replication",
+             [this](const httplib::Request &req, httplib::Response &res) {
+               replicationHandler(req, res);
+             });
+}
+
+HttpServer::~HttpServer() {
+  if (timer_thread_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(timer_mutex_);
+      timer_stop_ = true;
+    }
+    timer_cv_.notify_one();
+    timer_thread_.join();
+  }
 }
 
 void HttpServer::start() { server.listen(host.c_str(), port); }
 
+void HttpServer::setReplica(Replica *replica) { replica_ = replica; }
+
+void HttpServer::setCoordinator(Coordinator *coordinator) {
+  coordinator_ = coordinator;
+}
+
+void HttpServer::startTimerThread(unsigned int interval_seconds,
+                                  uint64_t max_wal_records,
+                                  uint64_t max_wal_bytes) {
+  timer_thread_ = std::thread([this, interval_seconds, max_wal_records,
+                               max_wal_bytes]() {
+    // thresholds are polled every second, the interval counts from the
+    // last snapshot whatever triggered it
+    const auto poll = std::chrono::seconds(1);
+    const auto interval = std::chrono::seconds(interval_seconds);
+    auto last_snapshot = std::chrono::steady_clock::now();
+    // a failed snapshot is not retried every second while still due
+    auto retry_at = std::chrono::steady_clock::time_point::min();
+
+    std::unique_lock<std::mutex> lock(timer_mutex_);
+    while (!timer_cv_.wait_for(lock, poll, [this] { return timer_stop_; })) {
+      uint64_t records = vector_database_->walRecordsSinceSnapshot();
+      uint64_t bytes = vector_database_->walBytesSinceSnapshot();
+      bool due = (interval_seconds != 0 &&
+                  std::chrono::steady_clock::now() - last_snapshot >=
+                      interval) ||
+                 (max_wal_records != 0 && records >= max_wal_records) ||
+                 (max_wal_bytes != 0 && bytes >= max_wal_bytes);
+      if (!due || records == 0 ||
+          std::chrono::steady_clock::now() < retry_at) {
+        continue;
+      }
+
+      lock.unlock();
+      GlobalLogger->info("Starting scheduled snapshot: {} WAL records, {} "
+                         "bytes since the last one",
+                         records, bytes);
+      SnapshotResult result = vector_database_->takeSnapshot();
+      if (result == SnapshotResult::FAILED) {
+        GlobalLogger->error("Scheduled snapshot failed, retrying in {} s",
+                            SNAPSHOT_RETRY_SECONDS);
+        retry_at = std::chrono::steady_clock::now() +
+                   std::chrono::seconds(SNAPSHOT_RETRY_SECONDS);
+      } else {
+        last_snapshot = std::chrono::steady_clock::now();
+      }
+      lock.lock();
+    }
+  });
+}
+
 bool HttpServer::isRequestValid(const rapidjson::Document &json_request,
                                 CheckType check_type) {
   switch (check_type) {
@@ -47,7 +251,9 @@ bool HttpServer::isRequestValid(const rapidjson::Document &json_request,
     return json_request.HasMember(REQUEST_VECTORS) &&
            json_request.HasMember(REQUEST_K) &&
            (!json_request.HasMember(REQUEST_INDEX_TYPE) ||
-            json_request[REQUEST_INDEX_TYPE].IsString());
+            json_request[REQUEST_INDEX_TYPE].IsString()) &&
+           (!json_request.HasMember(REQUEST_TEXT_QUERY) ||
+            json_request[REQUEST_TEXT_QUERY].IsString());
   case CheckType::INSERT:
     return json_request.HasMember(REQUEST_VECTORS) &&
            json_request.HasMember(REQUEST_ID) &&
@@ -58,11 +264,142 @@ bool HttpServer::isRequestValid(const rapidjson::Document &json_request,
            json_request.HasMember(REQUEST_ID) &&
            (!json_request.HasMember(REQUEST_INDEX_TYPE) ||
             json_request[REQUEST_INDEX_TYPE].IsString());
+  case CheckType::QUERY:
+    return (json_request.HasMember(REQUEST_ID) &&
+            json_request[REQUEST_ID].IsUint64()) ||
+           (json_request.HasMember(REQUEST_IDS) &&
+            json_request[REQUEST_IDS].IsArray());
+  case CheckType::FACET:
+    return json_request.HasMember(REQUEST_FACET_FIELD) &&
+           json_request[REQUEST_FACET_FIELD].IsString() &&
+           (json_request.HasMember(REQUEST_VECTORS) ==
+            json_request.HasMember(REQUEST_K));
   default:
     return false;
   }
 }
 
+bool HttpServer::getFieldsFromRequest(const rapidjson::Document &json_request,
+                                      std::vector<std::string> *fields) {
+  if (!json_request.HasMember(REQUEST_FIELDS) ||
+      !json_request[REQUEST_FIELDS].IsArray()) {
+    return false;
+  }
+  for (const auto &field : json_request[REQUEST_FIELDS].GetArray()) {
+    if (field.IsString()) {
+      fields->push_back(field.GetString());
+    }
+  }
+  return true;
+}
+
+bool HttpServer::checkRecovery(const rapidjson::Document &json_request,
+                               bool read_only, httplib::Response &res,
+                               bool *stale) {
+  if (stale != nullptr) {
+    *stale = false;
+  }
+  if (!read_only && replica_ != nullptr) {
+    res.status = 403;
+    setErrorJsonResponse(res, RESPONSE_RETCODE_ERROR,
+                         "Read-only replica, send writes to the leader");
+    return false;
+  }
+
+  VectorDatabase::RecoveryPhase phase =
+      vector_database_->getRecoveryStatus().phase;
+  bool copied = replica_ == nullptr || replica_->bootstrapped();
+  if (phase == VectorDatabase::RecoveryPhase::READY && copied) {
+    return true;
+  }
+  if (read_only &&
+      (phase == VectorDatabase::RecoveryPhase::REPLAYING_WAL ||
+       phase == VectorDatabase::RecoveryPhase::READY) &&
+      json_request.HasMember(REQUEST_ALLOW_STALE) &&
+      json_request[REQUEST_ALLOW_STALE].IsBool() &&
+      json_request[REQUEST_ALLOW_STALE].GetBool()) {
+    if (stale != nullptr) {
+      *stale = true;
+    }
+    return true;
+  }
+
+  res.status = 503;
+  if (phase == VectorDatabase::RecoveryPhase::READY) {
+    setErrorJsonResponse(res, RESPONSE_RETCODE_ERROR,
+                         "Replica is copying the records of the leader");
+    return false;
+  }
+  GlobalLogger->warn("Rejecting request during recovery, phase: {}",
+                     VectorDatabase::recoveryPhaseToString(phase));
+  setErrorJsonResponse(res, RESPONSE_RETCODE_ERROR,
+                       "Database is recovering, phase: " +
+                           VectorDatabase::recoveryPhaseToString(phase));
+  return false;
+}
+
+bool HttpServer::admit(AdmissionController::Class request_class,
+                       const httplib::Request &req, httplib::Response &res,
+                       AdmissionController::Ticket *ticket) {
+  auto deadline = RequestDeadline::Clock::time_point::max();
+  if (req.has_header(REQUEST_HEADER_TIMEOUT_MS)) {
+    std::string value = req.get_header_value(REQUEST_HEADER_TIMEOUT_MS);
+    char *end = nullptr;
+    long long timeout_ms = std::strtoll(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0' || timeout_ms <= 0) {
+      res.status = 400;
+      setErrorJsonResponse(res, RESPONSE_RETCODE_ERROR,
+                           std::string("Invalid ") +
+                               REQUEST_HEADER_TIMEOUT_MS + " header");
+      return false;
+    }
+    deadline = RequestDeadline::Clock::now() +
+               std::chrono::milliseconds(timeout_ms);
+  }
+
+  AdmissionController::Result result =
+      admission_.admit(request_class, deadline, ticket);
+  if (result == AdmissionController::Result::ADMITTED) {
+    return true;
+  }
+
+  const char *class_name = AdmissionController::classToString(request_class);
+  GlobalLogger->warn("Rejecting {} request: {}", class_name,
+                     AdmissionController::resultToString(result));
+  if (RequestTrace *trace = RequestTrace::current()) {
+    trace->annotate("rejected", AdmissionController::resultToString(result));
+  }
+  // Retry-After counts whole seconds, the json carries the estimate
+  uint64_t retry_ms = admission_.retryAfter(request_class).count();
+  res.status = 503;
+  res.set_header(RESPONSE_HEADER_RETRY_AFTER,
+                 std::to_string((retry_ms + 999) / 1000));
+
+  rapidjson::Document json_response;
+  json_response.SetObject();
+  rapidjson::Document::AllocatorType &allocator = json_response.GetAllocator();
+  json_response.AddMember(RESPONSE_RETCODE, RESPONSE_RETCODE_ERROR, allocator);
+  std::string message = std::string("Too many ") + class_name +
+                        " requests: " +
+                        AdmissionController::resultToString(result);
+  json_response.AddMember(RESPONSE_ERROR_MSG,
+                          rapidjson::Value(message.c_str(), allocator),
+                          allocator);
+  json_response.AddMember(RESPONSE_RETRY_AFTER_MS, retry_ms, allocator);
+  setJsonResponse(json_response, res);
+  return false;
+}
+
+bool HttpServer::checkDeadline(httplib::Response &res) {
+  if (!RequestDeadline::exceeded()) {
+    return false;
+  }
+  GlobalLogger->warn("Request exceeded its deadline");
+  res.status = 504;
+  setErrorJsonResponse(res, RESPONSE_RETCODE_ERROR, "Deadline exceeded");
+  return true;
+}
+
 IndexFactory::IndexType
 HttpServer::getIndexTypeFromRequest(const rapidjson::Document &json_request) {
   if (json_request.HasMember(REQUEST_INDEX_TYPE) &&
@@ -82,9 +419,16 @@ void HttpServer::searchHandler(const httplib::Request &req,
   GlobalLogger->debug("Received search request");
 
   rapidjson::Document json_request;
-  json_request.Parse(req.body.c_str());
+  {
+    StageTimer timer(Metrics::Stage::JSON_PARSE);
+    json_request.Parse(req.body.c_str());
+  }
 
-  GlobalLogger->info("Search request parameters: {}", req.body);
+  if (GlobalLogger->should_log(spdlog::level::debug) &&
+      search_log_limiter.allow()) {
+    GlobalLogger->debug("Search request parameters: {}",
+                        truncate_for_log(req.body));
+  }
 
   if (!json_request.IsObject()) {
     GlobalLogger->error("Invalid JSON request");
@@ -119,8 +463,25 @@ void HttpServer::searchHandler(const httplib::Request &req,
     return;
   }
 
+  if (coordinator_ != nullptr) {
+    rapidjson::Document json_response;
+    int status = coordinator_->search(json_request, req.body, &json_response);
+    setCoordinatorResponse(status, json_response, res);
+    return;
+  }
+
+  bool stale;
+  if (!checkRecovery(json_request, true, res, &stale)) {
+    return;
+  }
+
+  bool hybrid = json_request.HasMember(REQUEST_TEXT_QUERY);
   std::pair<std::vector<long>, std::vector<float>> results =
-      vector_database_->search(json_request);
+      hybrid ? vector_database_->hybridSearch(json_request)
+             : vector_database_->search(json_request);
+  if (checkDeadline(res)) {
+    return;
+  }
 
   rapidjson::Document json_response;
   json_response.SetObject();
@@ -129,17 +490,38 @@ void HttpServer::searchHandler(const httplib::Request &req,
   bool valid_results = false;
   rapidjson::Value vectors(rapidjson::kArrayType);
   rapidjson::Value distances(rapidjson::kArrayType);
+  std::vector<uint64_t> hit_ids;
   for (size_t i = 0; i < results.first.size(); ++i) {
     if (results.first[i] != -1) {
       valid_results = true;
       vectors.PushBack(results.first[i], allocator);
       distances.PushBack(results.second[i], allocator);
+      hit_ids.push_back(static_cast<uint64_t>(results.first[i]));
     }
   }
 
   if (valid_results) {
     json_response.AddMember(RESPONSE_VECTORS, vectors, allocator);
-    json_response.AddMember(RESPONSE_DISTANCES, distances, allocator);
+    json_response.AddMember(
+        rapidjson::StringRef(hybrid ? RESPONSE_SCORES : RESPONSE_DISTANCES),
+        distances, allocator);
+
+    // the requested fields of the hits, in the order of the ids above
+    std::vector<std::string> fields;
+    if (getFieldsFromRequest(json_request, &fields)) {
+      std::vector<rapidjson::Document> hits =
+          vector_database_->query(hit_ids, &fields);
+      rapidjson::Value records(rapidjson::kArrayType);
+      for (auto &hit : hits) {
+        rapidjson::Value record;
+        record.CopyFrom(hit, allocator);
+        records.PushBack(record, allocator);
+      }
+      json_response.AddMember(RESPONSE_RECORDS, records, allocator);
+    }
+  }
+  if (stale) {
+    json_response.AddMember(RESPONSE_STALE, true, allocator);
   }
 
   json_response.AddMember(RESPONSE_RETCODE, RESPONSE_RETCODE_SUCCESS,
@@ -152,9 +534,16 @@ void HttpServer::insertHandler(const httplib::Request &req,
   GlobalLogger->debug("Received insert request");
 
   rapidjson::Document json_request;
-  json_request.Parse(req.body.c_str());
+  {
+    StageTimer timer(Metrics::Stage::JSON_PARSE);
+    json_request.Parse(req.body.c_str());
+  }
 
-  GlobalLogger->info("Insert request parameters: {}", req.body);
+  if (GlobalLogger->should_log(spdlog::level::debug) &&
+      insert_log_limiter.allow()) {
+    GlobalLogger->debug("Insert request parameters: {}",
+                        truncate_for_log(req.body));
+  }
 
   if (!json_request.IsObject()) {
     GlobalLogger->error("Invalid JSON request");
@@ -171,10 +560,6 @@ void HttpServer::insertHandler(const httplib::Request &req,
     return;
   }
 
-  std::vector<float> data;
-  for (const auto &d : json_request[REQUEST_VECTORS].GetArray()) {
-    data.push_back(d.GetFloat());
-  }
   uint64_t label = json_request[REQUEST_ID].GetUint64();
 
   GlobalLogger->debug("Insert parameters: label = {}", label);
@@ -189,24 +574,22 @@ void HttpServer::insertHandler(const httplib::Request &req,
     return;
   }
 
-  void *index = getGlobalIndexFactory()->getIndex(indexType);
-
-  switch (indexType) {
-  case IndexFactory::IndexType::FLAT: {
-    FaissIndex *faissIndex = static_cast<FaissIndex *>(index);
-    faissIndex->insert_vectors(data, label);
-    break;
-  }
-  case IndexFactory::IndexType::HNSW: {
-    HNSWLibIndex *hnswIndex = static_cast<HNSWLibIndex *>(index);
-    hnswIndex->insert_vectors(data, label);
-    break;
+  if (coordinator_ != nullptr) {
+    rapidjson::Document json_response;
+    int status =
+        coordinator_->forward("/insert", label, req.body, &json_response);
+    setCoordinatorResponse(status, json_response, res);
+    return;
   }
 
-  default:
-    break;
+  if (!checkRecovery(json_request, false, res, nullptr)) {
+    return;
   }
 
+  // logged and applied like an upsert, so the record survives a restart,
+  // lands in the filter and attributes and is ordered against snapshots
+  vector_database_->logAndUpsert(label, json_request, indexType);
+
   rapidjson::Document json_response;
   json_response.SetObject();
   rapidjson::Document::AllocatorType &allocator = json_response.GetAllocator();
@@ -222,7 +605,10 @@ void HttpServer::upsertHandler(const httplib::Request &req,
   GlobalLogger->debug("Received upsert request");
 
   rapidjson::Document json_request;
-  json_request.Parse(req.body.c_str());
+  {
+    StageTimer timer(Metrics::Stage::JSON_PARSE);
+    json_request.Parse(req.body.c_str());
+  }
 
   if (!json_request.IsObject()) {
     GlobalLogger->error("Invalid JSON request");
@@ -241,11 +627,20 @@ void HttpServer::upsertHandler(const httplib::Request &req,
 
   uint64_t label = json_request[REQUEST_ID].GetUint64();
 
-  IndexFactory::IndexType indexType = getIndexTypeFromRequest(json_request);
-  // wal
-  vector_database_->writeWALLog("upsert", json_request);
+  if (coordinator_ != nullptr) {
+    rapidjson::Document json_response;
+    int status =
+        coordinator_->forward("/upsert", label, req.body, &json_response);
+    setCoordinatorResponse(status, json_response, res);
+    return;
+  }
+
+  if (!checkRecovery(json_request, false, res, nullptr)) {
+    return;
+  }
 
-  vector_database_->upsert(label, json_request, indexType);
+  IndexFactory::IndexType indexType = getIndexTypeFromRequest(json_request);
+  vector_database_->logAndUpsert(label, json_request, indexType);
 
   rapidjson::Document json_response;
   json_response.SetObject();
@@ -262,7 +657,10 @@ void HttpServer::queryHandler(const httplib::Request &req,
   GlobalLogger->debug("Received query request");
 
   rapidjson::Document json_request;
-  json_request.Parse(req.body.c_str());
+  {
+    StageTimer timer(Metrics::Stage::JSON_PARSE);
+    json_request.Parse(req.body.c_str());
+  }
 
   if (!json_request.IsObject()) {
     GlobalLogger->error("Invalid JSON request");
@@ -271,14 +669,60 @@ void HttpServer::queryHandler(const httplib::Request &req,
     return;
   }
 
-  uint64_t id = json_request[REQUEST_ID].GetUint64();
+  if (!isRequestValid(json_request, CheckType::QUERY)) {
+    GlobalLogger->error("Missing id or ids parameter in the request");
+    res.status = 400;
+    setErrorJsonResponse(res, RESPONSE_RETCODE_ERROR,
+                         "Missing id or ids parameter in the request");
+    return;
+  }
 
-  rapidjson::Document json_data = vector_database_->query(id);
+  if (coordinator_ != nullptr) {
+    rapidjson::Document json_response;
+    int status = coordinator_->query(json_request, req.body, &json_response);
+    setCoordinatorResponse(status, json_response, res);
+    return;
+  }
+
+  std::vector<std::string> fields;
+  bool projected = getFieldsFromRequest(json_request, &fields);
 
   rapidjson::Document json_response;
   json_response.SetObject();
   rapidjson::Document::AllocatorType &allocator = json_response.GetAllocator();
 
+  if (json_request.HasMember(REQUEST_IDS)) {
+    std::vector<uint64_t> ids;
+    for (const auto &id : json_request[REQUEST_IDS].GetArray()) {
+      if (!id.IsUint64()) {
+        GlobalLogger->error("Invalid ids parameter in the request");
+        res.status = 400;
+        setErrorJsonResponse(res, RESPONSE_RETCODE_ERROR,
+                             "Invalid ids parameter in the request");
+        return;
+      }
+      ids.push_back(id.GetUint64());
+    }
+
+    std::vector<rapidjson::Document> json_data =
+        vector_database_->query(ids, projected ? &fields : nullptr);
+    rapidjson::Value records(rapidjson::kArrayType);
+    for (auto &data : json_data) {
+      rapidjson::Value record;
+      record.CopyFrom(data, allocator);
+      records.PushBack(record, allocator);
+    }
+    json_response.AddMember(RESPONSE_RECORDS, records, allocator);
+    json_response.AddMember(RESPONSE_RETCODE, RESPONSE_RETCODE_SUCCESS,
+                            allocator);
+    setJsonResponse(json_response, res);
+    return;
+  }
+
+  uint64_t id = json_request[REQUEST_ID].GetUint64();
+  rapidjson::Document json_data =
+      vector_database_->query(id, projected ? &fields : nullptr);
+
   if (!json_data.IsNull()) {
     for (auto it = json_data.MemberBegin(); it != json_data.MemberEnd(); ++it) {
       json_response.AddMember(it->name, it->value, allocator);
@@ -290,14 +734,179 @@ void HttpServer::queryHandler(const httplib::Request &req,
   setJsonResponse(json_response, res);
 }
 
+void HttpServer::facetHandler(const httplib::Request &req,
+                              httplib::Response &res) {
+  GlobalLogger->debug("Received facet request");
+
+  if (!checkCoordinator(res)) {
+    return;
+  }
+
+  rapidjson::Document json_request;
+  {
+    StageTimer timer(Metrics::Stage::JSON_PARSE);
+    json_request.Parse(req.body.c_str());
+  }
+
+  if (!json_request.IsObject()) {
+    GlobalLogger->error("Invalid JSON request");
+    res.status = 400;
+    setErrorJsonResponse(res, RESPONSE_RETCODE_ERROR, "Invalid JSON request");
+    return;
+  }
+
+  if (!isRequestValid(json_request, CheckType::FACET)) {
+    GlobalLogger->error("Missing facetField parameter in the request");
+    res.status = 400;
+    setErrorJsonResponse(res, RESPONSE_RETCODE_ERROR,
+                         "Missing facetField parameter in the request");
+    return;
+  }
+
+  if (json_request.HasMember(REQUEST_VECTORS) &&
+      getIndexTypeFromRequest(json_request) ==
+          IndexFactory::IndexType::UNKNOWN) {
+    GlobalLogger->error("Invalid indexType parameter in the request");
+    res.status = 400;
+    setErrorJsonResponse(res, RESPONSE_RETCODE_ERROR,
+                         "Invalid indexType parameter in the request");
+    return;
+  }
+
+  bool stale;
+  if (!checkRecovery(json_request, true, res, &stale)) {
+    return;
+  }
+
+  std::map<long, uint64_t> counts = vector_database_->facet(json_request);
+
+  rapidjson::Document json_response;
+  json_response.SetObject();
+  rapidjson::Document::AllocatorType &allocator = json_response.GetAllocator();
+
+  rapidjson::Value facets(rapidjson::kArrayType);
+  for (const auto &entry : counts) {
+    rapidjson::Value facet(rapidjson::kObjectType);
+    facet.AddMember(RESPONSE_FACET_VALUE, static_cast<int64_t>(entry.first),
+                    allocator);
+    facet.AddMember(RESPONSE_FACET_COUNT, entry.second, allocator);
+    facets.PushBack(facet, allocator);
+  }
+  json_response.AddMember(RESPONSE_FACETS, facets, allocator);
+  if (stale) {
+    json_response.AddMember(RESPONSE_STALE, true, allocator);
+  }
+
+  json_response.AddMember(RESPONSE_RETCODE, RESPONSE_RETCODE_SUCCESS,
+                          allocator);
+  setJsonResponse(json_response, res);
+}
+
+void HttpServer::scanHandler(
+    const httplib::Request &req, httplib::Response &res,
+    std::shared_ptr<AdmissionController::Ticket> ticket) {
+  GlobalLogger->debug("Received scan request");
+
+  if (!checkCoordinator(res)) {
+    return;
+  }
+
+  rapidjson::Document json_request;
+  {
+    StageTimer timer(Metrics::Stage::JSON_PARSE);
+    json_request.Parse(req.body.c_str());
+  }
+
+  if (!json_request.IsObject()) {
+    GlobalLogger->error("Invalid JSON request");
+    res.status = 400;
+    setErrorJsonResponse(res, RESPONSE_RETCODE_ERROR, "Invalid JSON request");
+    return;
+  }
+
+  struct ScanState {
+    // 0 means no limit
+    uint64_t remaining = 0;
+    std::unique_ptr<ScalarStorage::ScanCursor> cursor;
+  };
+  auto state = std::make_shared<ScanState>();
+  uint64_t start_id = 0;
+  if (json_request.HasMember(REQUEST_START_ID) &&
+      json_request[REQUEST_START_ID].IsUint64()) {
+    start_id = json_request[REQUEST_START_ID].GetUint64();
+  }
+  if (json_request.HasMember(REQUEST_LIMIT) &&
+      json_request[REQUEST_LIMIT].IsUint64()) {
+    state->remaining = json_request[REQUEST_LIMIT].GetUint64();
+  }
+  std::vector<std::string> fields;
+  bool projected = getFieldsFromRequest(json_request, &fields);
+  bool unlimited = state->remaining == 0;
+  // the whole stream reads one rocksdb snapshot, released with the state
+  // once the response is done or the client went away
+  state->cursor =
+      vector_database_->openScan(start_id, projected ? &fields : nullptr);
+
+  // one json record per line, streamed chunk by chunk so the whole
+  // collection never sits in memory
+  res.set_chunked_content_provider(
+      RESPONSE_CONTENT_TYPE_NDJSON,
+      [state, unlimited, ticket](size_t, httplib::DataSink &sink) {
+        size_t chunk = unlimited ? SCAN_CHUNK_SIZE
+                                 : std::min<uint64_t>(SCAN_CHUNK_SIZE,
+                                                      state->remaining);
+        rapidjson::StringBuffer buffer;
+        size_t visited = state->cursor->next(
+            chunk, [&buffer](uint64_t id, rapidjson::Document &record) {
+              if (record.IsObject() && !record.HasMember(REQUEST_ID)) {
+                record.AddMember(rapidjson::StringRef(REQUEST_ID), id,
+                                 record.GetAllocator());
+              }
+              rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+              record.Accept(writer);
+              buffer.Put('\n');
+              return true;
+            });
+
+        if (visited != 0 && !sink.write(buffer.GetString(), buffer.GetSize())) {
+          return false;
+        }
+        if (!unlimited) {
+          state->remaining -= visited;
+        }
+        if (visited < chunk || (!unlimited && state->remaining == 0)) {
+          sink.done();
+        }
+        return true;
+      });
+}
+
 void HttpServer::setJsonResponse(const rapidjson::Document &json_response,
                                  httplib::Response &res) {
+  StageTimer timer(Metrics::Stage::RESPONSE_SERIALIZE);
   rapidjson::StringBuffer buffer;
   rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
   json_response.Accept(writer);
   res.set_content(buffer.GetString(), RESPONSE_CONTENT_TYPE_JSON);
 }
 
+void HttpServer::setCoordinatorResponse(
+    int status, const rapidjson::Document &json_response,
+    httplib::Response &res) {
+  res.status = status;
+  setJsonResponse(json_response, res);
+}
+
+bool HttpServer::checkCoordinator(httplib::Response &res) {
+  if (coordinator_ == nullptr) {
+    return true;
+  }
+  res.status = 501;
+  setErrorJsonResponse(res, RESPONSE_RETCODE_ERROR,
+                       "Not supported by the coordinator, ask the shards");
+  return false;
+}
+
 void HttpServer::setErrorJsonResponse(httplib::Response &res, int error_code,
                                       const std::string &errorMsg) {
   rapidjson::Document json_response;
@@ -313,12 +922,377 @@ void HttpServer::snapshotHandler(const httplib::Request &req,
                                  httplib::Response &res) {
   GlobalLogger->debug("Received snapshot request");
 
-  vector_database_->takeSnapshot(); 
+  // a replica logs nothing to snapshot, it copies the leader again instead
+  if (replica_ != nullptr) {
+    res.status = 403;
+    setErrorJsonResponse(res, RESPONSE_RETCODE_ERROR,
+                         "Read-only replica, snapshots are taken by the "
+                         "leader");
+    return;
+  }
+
+  if (coordinator_ != nullptr) {
+    rapidjson::Document json_response;
+    int status = coordinator_->snapshot(&json_response);
+    setCoordinatorResponse(status, json_response, res);
+    return;
+  }
+
+  rapidjson::Document json_request;
+  json_request.SetObject();
+  if (!checkRecovery(json_request, false, res, nullptr)) {
+    return;
+  }
+
+  SnapshotResult result = vector_database_->takeSnapshot();
+  if (result == SnapshotResult::FAILED) {
+    res.status = 500;
+    setErrorJsonResponse(res, RESPONSE_RETCODE_ERROR,
+                         "Snapshot failed, the previous one is kept");
+    return;
+  }
+
+  rapidjson::Document json_response;
+  json_response.SetObject();
+  rapidjson::Document::AllocatorType &allocator = json_response.GetAllocator();
+
+  // nothing changed since the previous snapshot, which still covers all
+  if (result == SnapshotResult::SKIPPED) {
+    json_response.AddMember(RESPONSE_SKIPPED, true, allocator);
+  }
+  json_response.AddMember(RESPONSE_RETCODE, RESPONSE_RETCODE_SUCCESS,
+                          allocator);
+  setJsonResponse(json_response, res);
+}
+
+void HttpServer::readyHandler(const httplib::Request &req,
+                              httplib::Response &res) {
+  VectorDatabase::RecoveryStatus status =
+      vector_database_->getRecoveryStatus();
+  bool ready = status.phase == VectorDatabase::RecoveryPhase::READY;
 
   rapidjson::Document json_response;
   json_response.SetObject();
   rapidjson::Document::AllocatorType &allocator = json_response.GetAllocator();
 
+  rapidjson::Value phase;
+  phase.SetString(VectorDatabase::recoveryPhaseToString(status.phase).c_str(),
+                  allocator);
+  json_response.AddMember(RESPONSE_RECOVERY_PHASE, phase, allocator);
+  json_response.AddMember(RESPONSE_REPLAYED_RECORDS, status.replayed_records,
+                          allocator);
+  json_response.AddMember(RESPONSE_REPLAYED_BYTES, status.replayed_bytes,
+                          allocator);
+  json_response.AddMember(RESPONSE_WAL_BYTES, status.total_bytes, allocator);
+  double progress =
+      ready ? 1.0
+      : status.total_bytes == 0
+          ? 0.0
+          : std::min(1.0, static_cast<double>(status.replayed_bytes) /
+                              status.total_bytes);
+  json_response.AddMember(RESPONSE_RECOVERY_PROGRESS, progress, allocator);
+  json_response.AddMember(RESPONSE_ELAPSED_SECONDS, status.elapsed_seconds,
+                          allocator);
+
+  json_response.AddMember(RESPONSE_RETCODE,
+                          ready ? RESPONSE_RETCODE_SUCCESS
+                                : RESPONSE_RETCODE_ERROR,
+                          allocator);
+  res.status = ready ? 200 : 503;
+  setJsonResponse(json_response, res);
+}
+
+void HttpServer::metricsHandler(const httplib::Request &req,
+                                httplib::Response &res) {
+  std::string out;
+  getGlobalMetrics()->render(&out);
+
+  VectorDatabase::Stats stats = vector_database_->getStats();
+  Metrics::appendGauge(&out, "vdb_index_vectors", "Vectors in an index.",
+                       stats.flat_vectors, "index=\"flat\"");
+  Metrics::appendGauge(&out, "vdb_index_vectors", "Vectors in an index.",
+                       stats.hnsw_vectors, "index=\"hnsw\"");
+  Metrics::appendGauge(&out, "vdb_filter_bitmaps",
+                       "Bitmaps in the filter index, one per field value.",
+                       stats.filter_bitmaps);
+  Metrics::appendGauge(&out, "vdb_filter_bitmap_bytes",
+                       "Serialized size of the filter index bitmaps.",
+                       stats.filter_bitmap_bytes);
+  Metrics::appendGauge(&out, "vdb_attribute_rows",
+                       "Records in the in-memory attribute store.",
+                       stats.attribute_rows);
+  Metrics::appendGauge(&out, "vdb_wal_records_since_snapshot",
+                       "WAL records logged since the last snapshot.",
+                       stats.wal_records_since_snapshot);
+  Metrics::appendGauge(&out, "vdb_wal_bytes_since_snapshot",
+                       "WAL bytes written since the last snapshot.",
+                       stats.wal_bytes_since_snapshot);
+  Metrics::appendGauge(&out, "vdb_rocksdb_block_cache_bytes",
+                       "Memory used by the shared rocksdb block cache.",
+                       stats.block_cache_bytes);
+  appendStorageGauge(&out, "vdb_rocksdb_estimated_keys",
+                     "Estimated number of keys.", stats.storage_keys);
+  appendStorageGauge(&out, "vdb_rocksdb_live_data_bytes",
+                     "Estimated size of the live data.",
+                     stats.storage_live_bytes);
+  appendStorageGauge(&out, "vdb_rocksdb_sst_bytes",
+                     "Total size of the sst files.", stats.storage_sst_bytes);
+  appendStorageGauge(&out, "vdb_rocksdb_memtable_bytes",
+                     "Size of all memtables.", stats.storage_memtable_bytes);
+  appendStorageGauge(&out, "vdb_rocksdb_pending_compaction_bytes",
+                     "Estimated bytes compaction still has to rewrite.",
+                     stats.storage_pending_compaction_bytes);
+
+  for (const auto &entry : stats.recall) {
+    std::string labels =
+        entry.first == IndexFactory::IndexType::HNSW ? "index=\"hnsw\""
+                                                     : "index=\"flat\"";
+    Metrics::appendGauge(&out, "vdb_recall",
+                         "Rolling recall@k of sampled searches against an "
+                         "exact scan.",
+                         entry.second.recall, labels);
+    Metrics::appendGauge(&out, "vdb_recall_window_samples",
+                         "Samples behind vdb_recall.",
+                         entry.second.window_samples, labels);
+    Metrics::appendGauge(&out, "vdb_recall_samples",
+                         "Searches checked against an exact scan so far.",
+                         entry.second.total_samples, labels);
+  }
+
+  if (replica_ != nullptr) {
+    Replica::Status status = replica_->getStatus();
+    Metrics::appendGauge(&out, "vdb_replication_applied_log_id",
+                         "Last leader log ID applied by the replica.",
+                         status.applied_log_id);
+    Metrics::appendGauge(&out, "vdb_replication_leader_log_id",
+                         "Latest log ID the leader reported.",
+                         status.leader_log_id);
+    Metrics::appendGauge(
+        &out, "vdb_replication_lag_records",
+        "Leader records the replica has not applied yet.",
+        status.leader_log_id - std::min(status.leader_log_id,
+                                        status.applied_log_id));
+    Metrics::appendGauge(&out, "vdb_replication_lag_seconds",
+                         "Time since the replica last had every record of "
+                         "the leader.",
+                         status.lag_seconds);
+    Metrics::appendGauge(&out, "vdb_replication_connected",
+                         "1 while the replica follows the leader's WAL.",
+                         status.state == Replica::State::STREAMING ? 1 : 0);
+  }
+
+  for (auto request_class :
+       {AdmissionController::Class::READ, AdmissionController::Class::WRITE,
+        AdmissionController::Class::SNAPSHOT,
+        AdmissionController::Class::STREAM}) {
+    AdmissionController::ClassStats admission =
+        admission_.getStats(request_class);
+    std::string labels = std::string("class=\"") +
+                         AdmissionController::classToString(request_class) +
+                         "\"";
+    Metrics::appendGauge(&out, "vdb_admission_running",
+                         "Admitted requests running.", admission.running,
+                         labels);
+    Metrics::appendGauge(&out, "vdb_admission_queued",
+                         "Requests waiting for a slot.", admission.queued,
+                         labels);
+    Metrics::appendGauge(&out, "vdb_admission_rejected",
+                         "Requests rejected for capacity so far.",
+                         admission.rejected, labels);
+    Metrics::appendGauge(&out, "vdb_admission_service_seconds",
+                         "Moving average of the time a request holds its "
+                         "slot.",
+                         admission.service_seconds, labels);
+  }
+
+  res.set_content(out, RESPONSE_CONTENT_TYPE_PROMETHEUS);
+}
+
+void HttpServer::replicationStatusHandler(const httplib::Request &req,
+                                          httplib::Response &res) {
+  if (replica_ != nullptr) {
+    res.status = 403;
+    setErrorJsonResponse(res, RESPONSE_RETCODE_ERROR,
+                         "A replica cannot be followed, use the leader");
+    return;
+  }
+  rapidjson::Document json_request;
+  json_request.SetObject();
+  if (!checkRecovery(json_request, true, res, nullptr)) {
+    return;
+  }
+
+  rapidjson::Document json_response;
+  json_response.SetObject();
+  rapidjson::Document::AllocatorType &allocator = json_response.GetAllocator();
+  json_response.AddMember(RESPONSE_LOG_ID, vector_database_->appliedLogID(),
+                          allocator);
+  json_response.AddMember(RESPONSE_INCARNATION,
+                          vector_database_->incarnation(), allocator);
+  json_response.AddMember(RESPONSE_INCARNATION_LOG_ID,
+                          vector_database_->incarnationLogID(), allocator);
+  json_response.AddMember(RESPONSE_RETCODE, RESPONSE_RETCODE_SUCCESS,
+                          allocator);
+  setJsonResponse(json_response, res);
+}
+
+void HttpServer::walStreamHandler(
+    const httplib::Request &req, httplib::Response &res,
+    std::shared_ptr<AdmissionController::Ticket> ticket) {
+  if (replica_ != nullptr) {
+    res.status = 403;
+    setErrorJsonResponse(res, RESPONSE_RETCODE_ERROR,
+                         "A replica cannot be followed, use the leader");
+    return;
+  }
+  uint64_t from_id = 0;
+  if (req.has_param(REQUEST_FROM_LOG_ID)) {
+    from_id = std::strtoull(req.get_param_value(REQUEST_FROM_LOG_ID).c_str(),
+                            nullptr, 10);
+  }
+  if (from_id == 0) {
+    res.status = 400;
+    setErrorJsonResponse(res, RESPONSE_RETCODE_ERROR,
+                         "Missing fromLogId parameter in the request");
+    return;
+  }
+  rapidjson::Document json_request;
+  json_request.SetObject();
+  if (!checkRecovery(json_request, true, res, nullptr)) {
+    return;
+  }
+  // a snapshot removed the segments holding from_id
+  if (!vector_database_->hasWALFrom(from_id)) {
+    res.status = 410;
+    setErrorJsonResponse(res, RESPONSE_RETCODE_ERROR,
+                         "WAL from log ID " + std::to_string(from_id) +
+                             " is no longer kept, copy the records again");
+    return;
+  }
+  GlobalLogger->info("Streaming the WAL from log ID {} to {}", from_id,
+                     req.remote_addr);
+
+  struct StreamState {
+    WALCursor cursor;
+    uint64_t next_id = 0;
+    bool started = false;
+  };
+  auto state = std::make_shared<StreamState>();
+  state->next_id = from_id;
+
+  // sealed wal records as they are on disk, and a heartbeat with the
+  // latest log id when the stream starts or has been idle for a while. the
+  // first heartbeat tells the replica which incarnation the records are of.
+  auto heartbeat = [this]() {
+    return Persistence::encodeHeartbeat(vector_database_->latestLogID(),
+                                        vector_database_->incarnation(),
+                                        vector_database_->incarnationLogID());
+  };
+  res.set_chunked_content_provider(
+      RESPONSE_CONTENT_TYPE_WAL,
+      [this, state, heartbeat, ticket](size_t, httplib::DataSink &sink) {
+        std::string out;
+        if (!state->started) {
+          out = heartbeat();
+          state->started = true;
+        }
+        uint64_t last_id = vector_database_->readWAL(
+            &state->cursor, state->next_id, REPLICATION_CHUNK_BYTES, &out);
+        if (out.empty()) {
+          vector_database_->waitForWAL(
+              state->next_id - 1,
+              std::chrono::milliseconds(REPLICATION_HEARTBEAT_MS));
+          last_id = vector_database_->readWAL(
+              &state->cursor, state->next_id, REPLICATION_CHUNK_BYTES, &out);
+          if (out.empty()) {
+            out = heartbeat();
+          }
+        }
+        if (last_id != 0) {
+          state->next_id = last_id + 1;
+        }
+        return sink.write(out.data(), out.size());
+      });
+}
+
+void HttpServer::replicationHandler(const httplib::Request &req,
+                                    httplib::Response &res) {
+  rapidjson::Document json_response;
+  json_response.SetObject();
+  rapidjson::Document::AllocatorType &allocator = json_response.GetAllocator();
+
+  if (replica_ == nullptr) {
+    json_response.AddMember(RESPONSE_ROLE, rapidjson::StringRef(ROLE_LEADER),
+                            allocator);
+    json_response.AddMember(RESPONSE_LOG_ID, vector_database_->latestLogID(),
+                            allocator);
+  } else {
+    Replica::Status status = replica_->getStatus();
+    json_response.AddMember(RESPONSE_ROLE,
+                            rapidjson::StringRef(ROLE_REPLICA), allocator);
+    std::string leader = replica_->options().leader_host + ":" +
+                         std::to_string(replica_->options().leader_port);
+    rapidjson::Value leader_value;
+    leader_value.SetString(leader.c_str(), allocator);
+    json_response.AddMember(RESPONSE_LEADER, leader_value, allocator);
+    rapidjson::Value state;
+    state.SetString(Replica::stateToString(status.state).c_str(), allocator);
+    json_response.AddMember(RESPONSE_REPLICATION_STATE, state, allocator);
+    json_response.AddMember(RESPONSE_APPLIED_LOG_ID, status.applied_log_id,
+                            allocator);
+    json_response.AddMember(RESPONSE_LEADER_LOG_ID, status.leader_log_id,
+                            allocator);
+    json_response.AddMember(
+        RESPONSE_LAG_RECORDS,
+        status.leader_log_id -
+            std::min(status.leader_log_id, status.applied_log_id),
+        allocator);
+    json_response.AddMember(RESPONSE_LAG_SECONDS, status.lag_seconds,
+                            allocator);
+    json_response.AddMember(RESPONSE_BOOTSTRAPS, status.bootstraps,
+                            allocator);
+    json_response.AddMember(RESPONSE_RECONNECTS, status.reconnects,
+                            allocator);
+  }
+  json_response.AddMember(RESPONSE_RETCODE, RESPONSE_RETCODE_SUCCESS,
+                          allocator);
+  setJsonResponse(json_response, res);
+}
+
+void HttpServer::logLevelHandler(const httplib::Request &req,
+                                 httplib::Response &res) {
+  if (req.method == "POST") {
+    rapidjson::Document json_request;
+    json_request.Parse(req.body.c_str());
+    if (!json_request.IsObject() || !json_request.HasMember(REQUEST_LEVEL) ||
+        !json_request[REQUEST_LEVEL].IsString()) {
+      res.status = 400;
+      setErrorJsonResponse(res, RESPONSE_RETCODE_ERROR,
+                           "Missing level parameter in the request");
+      return;
+    }
+    std::string name = json_request[REQUEST_LEVEL].GetString();
+    spdlog::level::level_enum level = spdlog::level::from_str(name);
+    // from_str maps unknown names to off
+    if (level == spdlog::level::off && name != "off") {
+      res.status = 400;
+      setErrorJsonResponse(res, RESPONSE_RETCODE_ERROR,
+                           "Invalid level parameter in the request");
+      return;
+    }
+    set_log_level(level);
+    GlobalLogger->warn("Log level set to {}", name);
+  }
+
+  rapidjson::Document json_response;
+  json_response.SetObject();
+  rapidjson::Document::AllocatorType &allocator = json_response.GetAllocator();
+  auto level = spdlog::level::to_string_view(get_log_level());
+  rapidjson::Value level_value;
+  level_value.SetString(level.data(), static_cast<rapidjson::SizeType>(
+                                          level.size()),
+                        allocator);
+  json_response.AddMember(RESPONSE_LEVEL, level_value, allocator);
   json_response.AddMember(RESPONSE_RETCODE, RESPONSE_RETCODE_SUCCESS,
                           allocator);
   setJsonResponse(json_response, res);
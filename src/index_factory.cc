@@ -1,9 +1,15 @@
 #include "index_factory.h"
+#include "bm25_index.h"
 #include "filter_index.h"
 #include "hnswlib_index.h"
+#include "logger.h"
 
+#include <cstring>
 #include <faiss/IndexFlat.h>
 #include <faiss/IndexIDMap.h>
+#include <fstream>
+#include <sstream>
+#include <unordered_set>
 
 namespace {
 IndexFactory globalIndexFactory;
@@ -11,26 +17,56 @@ IndexFactory globalIndexFactory;
 
 IndexFactory *getGlobalIndexFactory() { return &globalIndexFactory; }
 
+IndexFactory::~IndexFactory() {
+  for (const auto &index_entry : index_map) {
+    switch (index_entry.first) {
+    case IndexType::FLAT:
+      delete static_cast<FaissIndex *>(index_entry.second);
+      break;
+    case IndexType::HNSW:
+      delete static_cast<HNSWLibIndex *>(index_entry.second);
+      break;
+    case IndexType::FILTER:
+      delete static_cast<FilterIndex *>(index_entry.second);
+      break;
+    case IndexType::BM25:
+      delete static_cast<BM25Index *>(index_entry.second);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
 void IndexFactory::init(IndexFactory::IndexType type, int dim, int num_data,
-                        IndexFactory::MetricType metric) {
+                        IndexFactory::MetricType metric, int hnsw_m,
+                        int hnsw_ef_construction) {
   faiss::MetricType faiss_metric = (metric == IndexFactory::MetricType::L2)
                                        ? faiss::METRIC_L2
                                        : faiss::METRIC_INNER_PRODUCT;
 
   switch (type) {
-  case IndexFactory::IndexType::FLAT:
-    index_map[type] = new FaissIndex(
-        new faiss::IndexIDMap(new faiss::IndexFlat(dim, faiss_metric)));
+  case IndexFactory::IndexType::FLAT: {
+    faiss::IndexIDMap *id_map =
+        new faiss::IndexIDMap(new faiss::IndexFlat(dim, faiss_metric));
+    id_map->own_fields = true;
+    index_map[type] = new FaissIndex(id_map);
     break;
+  }
   case IndexFactory::IndexType::HNSW:
-    index_map[type] = new HNSWLibIndex(dim, num_data, metric, 16, 200);
+    index_map[type] = new HNSWLibIndex(dim, num_data, metric, hnsw_m,
+                                       hnsw_ef_construction);
     break;
   case IndexFactory::IndexType::FILTER:
     index_map[type] = new FilterIndex();
     break;
+  case IndexFactory::IndexType::BM25:
+    index_map[type] = new BM25Index();
+    break;
   default:
     break;
   }
+  metric_map[type] = metric;
 }
 
 void *IndexFactory::getIndex(IndexType type) const {
@@ -41,30 +77,75 @@ void *IndexFactory::getIndex(IndexType type) const {
   return nullptr;
 }
 
-void IndexFactory::saveIndex(
-    const std::string &folder_path,
-    ScalarStorage &scalar_storage) { 
+IndexFactory::MetricType IndexFactory::getMetricType(IndexType type) const {
+  auto it = metric_map.find(type);
+  if (it != metric_map.end()) {
+    return it->second;
+  }
+  return MetricType::L2;
+}
+
+void IndexFactory::saveIndex(const std::string &folder_path,
+                             ScalarStorage &scalar_storage) {
+  saveIndexFiles(folder_path);
+  for (const auto &entry : serializeScalarIndexes(folder_path)) {
+    scalar_storage.put(entry.first, entry.second);
+  }
+}
 
+bool IndexFactory::saveIndexFiles(const std::string &folder_path,
+                                  const std::string &suffix) {
   for (const auto &index_entry : index_map) {
     IndexType index_type = index_entry.first;
     void *index = index_entry.second;
 
-    std::string file_path =
+    std::string file_path = folder_path +
+                            std::to_string(static_cast<int>(index_type)) +
+                            ".index" + suffix;
+    try {
+      if (index_type == IndexType::FLAT) {
+        static_cast<FaissIndex *>(index)->saveIndex(file_path);
+      } else if (index_type == IndexType::HNSW) {
+        static_cast<HNSWLibIndex *>(index)->saveIndex(file_path);
+      }
+    } catch (const std::exception &) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::map<std::string, std::string>
+IndexFactory::serializeScalarIndexes(const std::string &folder_path) {
+  std::map<std::string, std::string> serialized;
+  for (const auto &index_entry : index_map) {
+    IndexType index_type = index_entry.first;
+    void *index = index_entry.second;
+
+    std::string key =
         folder_path + std::to_string(static_cast<int>(index_type)) + ".index";
+    if (index_type == IndexType::BM25) {
+      serialized[key] = static_cast<BM25Index *>(index)->serialize();
+    }
+  }
+  return serialized;
+}
 
-    if (index_type == IndexType::FLAT) {
-      static_cast<FaissIndex *>(index)->saveIndex(file_path);
-    } else if (index_type == IndexType::HNSW) {
-      static_cast<HNSWLibIndex *>(index)->saveIndex(file_path);
-    } else if (index_type == IndexType::FILTER) { 
-      static_cast<FilterIndex *>(index)->saveIndex(scalar_storage, file_path);
+std::vector<std::string>
+IndexFactory::indexFilePaths(const std::string &folder_path) const {
+  std::vector<std::string> paths;
+  for (const auto &index_entry : index_map) {
+    IndexType index_type = index_entry.first;
+    if (index_type == IndexType::FLAT || index_type == IndexType::HNSW) {
+      paths.push_back(folder_path +
+                      std::to_string(static_cast<int>(index_type)) + ".index");
     }
   }
+  return paths;
 }
 
-void IndexFactory::loadIndex(
-    const std::string &folder_path,
-    ScalarStorage &scalar_storage) { 
+void IndexFactory::loadIndex(const std::string &folder_path,
+                             ScalarStorage &scalar_storage) {
   for (const auto &index_entry : index_map) {
     IndexType index_type = index_entry.first;
     void *index = index_entry.second;
@@ -76,8 +157,159 @@ void IndexFactory::loadIndex(
       static_cast<FaissIndex *>(index)->loadIndex(file_path);
     } else if (index_type == IndexType::HNSW) {
       static_cast<HNSWLibIndex *>(index)->loadIndex(file_path);
-    } else if (index_type == IndexType::FILTER) { 
-      static_cast<FilterIndex *>(index)->loadIndex(scalar_storage, file_path);
+    } else if (index_type == IndexType::BM25) {
+      static_cast<BM25Index *>(index)->loadIndex(scalar_storage, file_path);
+    }
+  }
+}
+std::string IndexFactory::deltaPath(const std::string &folder_path,
+                                    IndexType type, uint32_t sequence) {
+  return folder_path + std::to_string(static_cast<int>(type)) + ".index" +
+         ".delta." + std::to_string(sequence);
+}
+
+// a vector delta is a run of records: int64 id | uint32 dim | float32 * dim,
+// dim 0 meaning the id was removed
+std::string IndexFactory::serializeVectorDelta(IndexType type, void *index) {
+  std::vector<long> ids;
+  std::unordered_map<long, std::vector<float>> vectors;
+  if (type == IndexType::FLAT) {
+    FaissIndex *faiss_index = static_cast<FaissIndex *>(index);
+    ids = faiss_index->takeDirtyIds(&vectors);
+  } else {
+    HNSWLibIndex *hnsw_index = static_cast<HNSWLibIndex *>(index);
+    ids = hnsw_index->takeDirtyIds();
+    vectors = hnsw_index->getVectors(ids);
+  }
+
+  std::string delta;
+  for (long id : ids) {
+    int64_t label = id;
+    auto it = vectors.find(id);
+    uint32_t dim = (it != vectors.end()) ? it->second.size() : 0;
+    delta.append(reinterpret_cast<const char *>(&label), sizeof(label));
+    delta.append(reinterpret_cast<const char *>(&dim), sizeof(dim));
+    if (dim != 0) {
+      delta.append(reinterpret_cast<const char *>(it->second.data()),
+                   dim * sizeof(float));
+    }
+  }
+  return delta;
+}
+
+void IndexFactory::applyVectorDelta(IndexType type, void *index,
+                                    const std::string &delta) {
+  std::vector<long> removed;
+  std::vector<long> labels;
+  std::vector<float> data;
+  size_t offset = 0;
+  while (offset + sizeof(int64_t) + sizeof(uint32_t) <= delta.size()) {
+    int64_t label;
+    uint32_t dim;
+    std::memcpy(&label, delta.data() + offset, sizeof(label));
+    offset += sizeof(label);
+    std::memcpy(&dim, delta.data() + offset, sizeof(dim));
+    offset += sizeof(dim);
+    if (offset + dim * sizeof(float) > delta.size()) {
+      break;
+    }
+    removed.push_back(label);
+    if (dim != 0) {
+      labels.push_back(label);
+      const float *vector =
+          reinterpret_cast<const float *>(delta.data() + offset);
+      data.insert(data.end(), vector, vector + dim);
+      offset += dim * sizeof(float);
+    }
+  }
+
+  if (type == IndexType::FLAT) {
+    // faiss keeps duplicate ids, drop the base copy before re-adding
+    FaissIndex *faiss_index = static_cast<FaissIndex *>(index);
+    if (!removed.empty()) {
+      faiss_index->remove_vectors(removed);
+    }
+    faiss_index->insert_vectors(data, labels);
+  } else {
+    // hnswlib updates an existing label in place
+    std::unordered_set<long> kept(labels.begin(), labels.end());
+    std::vector<long> deleted;
+    for (long id : removed) {
+      if (kept.count(id) == 0) {
+        deleted.push_back(id);
+      }
+    }
+    HNSWLibIndex *hnsw_index = static_cast<HNSWLibIndex *>(index);
+    hnsw_index->insert_vectors(data, labels);
+    hnsw_index->remove_vectors(deleted);
+  }
+}
+
+IndexFactory::IndexDelta
+IndexFactory::serializeDeltas(const std::string &folder_path,
+                              uint32_t sequence) {
+  IndexDelta delta;
+  for (const auto &index_entry : index_map) {
+    IndexType index_type = index_entry.first;
+    void *index = index_entry.second;
+
+    std::string key = deltaPath(folder_path, index_type, sequence);
+    if (index_type == IndexType::FLAT || index_type == IndexType::HNSW) {
+      delta.files[key] = serializeVectorDelta(index_type, index);
+    } else if (index_type == IndexType::BM25) {
+      delta.scalars[key] = static_cast<BM25Index *>(index)->serializeDelta();
     }
   }
-}
\ No newline at end of file
+  return delta;
+}
+
+void IndexFactory::clearDirty() {
+  for (const auto &index_entry : index_map) {
+    IndexType index_type = index_entry.first;
+    void *index = index_entry.second;
+
+    if (index_type == IndexType::FLAT) {
+      static_cast<FaissIndex *>(index)->takeDirtyIds();
+    } else if (index_type == IndexType::HNSW) {
+      static_cast<HNSWLibIndex *>(index)->takeDirtyIds();
+    } else if (index_type == IndexType::BM25) {
+      static_cast<BM25Index *>(index)->clearDirty();
+    }
+  }
+}
+
+std::vector<std::string>
+IndexFactory::deltaFilePaths(const std::string &folder_path,
+                             uint32_t sequence) const {
+  std::vector<std::string> paths;
+  for (const auto &index_entry : index_map) {
+    IndexType index_type = index_entry.first;
+    if (index_type == IndexType::FLAT || index_type == IndexType::HNSW) {
+      paths.push_back(deltaPath(folder_path, index_type, sequence));
+    }
+  }
+  return paths;
+}
+
+void IndexFactory::loadDelta(const std::string &folder_path,
+                             uint32_t sequence,
+                             ScalarStorage &scalar_storage) {
+  for (const auto &index_entry : index_map) {
+    IndexType index_type = index_entry.first;
+    void *index = index_entry.second;
+
+    std::string key = deltaPath(folder_path, index_type, sequence);
+    if (index_type == IndexType::FLAT || index_type == IndexType::HNSW) {
+      std::ifstream file(key, std::ios::binary);
+      if (!file.is_open()) {
+        GlobalLogger->warn("Delta snapshot file not found: {}", key);
+        continue;
+      }
+      std::ostringstream oss;
+      oss << file.rdbuf();
+      applyVectorDelta(index_type, index, oss.str());
+    } else if (index_type == IndexType::BM25) {
+      static_cast<BM25Index *>(index)->deserialize(scalar_storage.get(key));
+    }
+  }
+}
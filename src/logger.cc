@@ -1,12 +1,61 @@
 #include "logger.h"
+#include "spdlog/async.h"
 #include "spdlog/sinks/stdout_color_sinks.h"
+#include <chrono>
 
 std::shared_ptr<spdlog::logger> GlobalLogger;
 
-void init_global_logger() {
-  GlobalLogger = spdlog::stdout_color_mt("GlobalLogger");
+void init_global_logger(size_t queue_size) {
+  spdlog::init_thread_pool(queue_size, 1);
+  GlobalLogger =
+      spdlog::create_async_nb<spdlog::sinks::stdout_color_sink_mt>(
+          "GlobalLogger");
+  // errors usually come right before trouble, get them out at once
+  GlobalLogger->flush_on(spdlog::level::err);
 }
 
 void set_log_level(spdlog::level::level_enum log_level) {
   GlobalLogger->set_level(log_level);
-}
\ No newline at end of file
+}
+
+spdlog::level::level_enum get_log_level() { return GlobalLogger->level(); }
+
+std::string truncate_for_log(const std::string &payload, size_t max_bytes) {
+  if (payload.size() <= max_bytes) {
+    return payload;
+  }
+  return payload.substr(0, max_bytes) + "...(" +
+         std::to_string(payload.size()) + " bytes)";
+}
+
+LogLimiter::LogLimiter(const char *name, uint32_t max_per_second,
+                       uint32_t sample_every)
+    : name_(name), max_per_second_(max_per_second),
+      sample_every_(sample_every == 0 ? 1 : sample_every) {}
+
+bool LogLimiter::allow() {
+  if (calls_.fetch_add(1, std::memory_order_relaxed) % sample_every_ != 0) {
+    return false;
+  }
+
+  int64_t second = std::chrono::duration_cast<std::chrono::seconds>(
+                       std::chrono::steady_clock::now().time_since_epoch())
+                       .count();
+  int64_t window = window_.load(std::memory_order_relaxed);
+  if (window != second &&
+      window_.compare_exchange_strong(window, second,
+                                      std::memory_order_relaxed)) {
+    // the thread that opens the new second reports the previous one
+    allowed_.store(0, std::memory_order_relaxed);
+    uint64_t suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+    if (suppressed != 0) {
+      GlobalLogger->info("Suppressed {} '{}' log messages", suppressed,
+                         name_);
+    }
+  }
+  if (allowed_.fetch_add(1, std::memory_order_relaxed) >= max_per_second_) {
+    suppressed_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
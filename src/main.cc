@@ -1,31 +1,154 @@
+#include "admission.h"
+#include "bm25_index.h"
+#include "constants.h"
+#include "coordinator.h"
 #include "http_server.h"
 #include "index_factory.h"
 #include "logger.h"
+#include "replica.h"
+#include "request_trace.h"
 #include "vector_database.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
 
-int main() {
+// simple_vector [--port=8080] [--leader=host:port | --shards=host:port,...]
+// with --leader the process is a read-only replica of that leader, with
+// --shards a coordinator spreading the collection over those processes.
+// paths are relative, so more processes on the same machine run in their
+// own directories.
+int main(int argc, char *argv[]) {
   init_global_logger();
-  set_log_level(spdlog::level::debug);
+  // can be changed at runtime through /admin/log_level
+  set_log_level(spdlog::level::info);
 
   GlobalLogger->info("Global logger initialized");
 
+  int port = 8080;
+  std::unique_ptr<ReplicaOptions> replica_options;
+  std::unique_ptr<CoordinatorOptions> coordinator_options;
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    if (std::strncmp(arg, "--port=", 7) == 0) {
+      port = std::atoi(arg + 7);
+    } else if (std::strncmp(arg, "--leader=", 9) == 0) {
+      std::string leader = arg + 9;
+      size_t colon = leader.rfind(':');
+      replica_options = std::make_unique<ReplicaOptions>();
+      if (colon != std::string::npos) {
+        replica_options->leader_host = leader.substr(0, colon);
+        replica_options->leader_port = std::atoi(leader.c_str() + colon + 1);
+      } else {
+        replica_options->leader_host = leader;
+      }
+    } else if (std::strncmp(arg, "--shards=", 9) == 0) {
+      coordinator_options = std::make_unique<CoordinatorOptions>();
+      std::string shards = arg + 9;
+      size_t begin = 0;
+      while (begin < shards.size()) {
+        size_t end = shards.find(',', begin);
+        if (end == std::string::npos) {
+          end = shards.size();
+        }
+        std::string shard = shards.substr(begin, end - begin);
+        size_t colon = shard.rfind(':');
+        if (colon == std::string::npos) {
+          GlobalLogger->error("Shard {} is not host:port", shard);
+          return 1;
+        }
+        coordinator_options->shards.emplace_back(
+            shard.substr(0, colon), std::atoi(shard.c_str() + colon + 1));
+        begin = end + 1;
+      }
+    } else {
+      GlobalLogger->error("Unknown argument {}", arg);
+      return 1;
+    }
+  }
+  if (replica_options && coordinator_options) {
+    GlobalLogger->error("--leader and --shards exclude each other");
+    return 1;
+  }
+  if (coordinator_options && coordinator_options->shards.empty()) {
+    GlobalLogger->error("--shards needs at least one shard");
+    return 1;
+  }
+
   int dim = 1;
   int num_data = 1000;
   IndexFactory *globalIndexFactory = getGlobalIndexFactory();
   globalIndexFactory->init(IndexFactory::IndexType::FLAT, dim);
   globalIndexFactory->init(IndexFactory::IndexType::HNSW, dim, num_data);
   globalIndexFactory->init(IndexFactory::IndexType::FILTER);
+  globalIndexFactory->init(IndexFactory::IndexType::BM25);
+  static_cast<BM25Index *>(
+      globalIndexFactory->getIndex(IndexFactory::IndexType::BM25))
+      ->addTextField("text");
   GlobalLogger->info("Global IndexFactory initialized");
 
   std::string db_path = "ScalarStorage";
   std::string wal_path = "WalStore";
-  VectorDatabase vector_database(db_path, wal_path);
-  vector_database.reloadDatabase();
+  WALOptions wal_options;
+  wal_options.durability = WALDurability::INTERVAL;
+  wal_options.sync_interval_ms = 100;
+  RecallMonitorOptions recall_options;
+  recall_options.sample_rate = 0.01;
+  VectorDatabase vector_database(db_path, wal_path, wal_options,
+                                 ScalarStorageOptions(), recall_options);
   GlobalLogger->info("VectorDatabase initialized");
 
-  HttpServer server("localhost", 8080, &vector_database);
+  std::unique_ptr<Replica> replica;
+  if (replica_options) {
+    replica = std::make_unique<Replica>(&vector_database, *replica_options);
+    GlobalLogger->info("Replica of leader {}:{}",
+                       replica_options->leader_host,
+                       replica_options->leader_port);
+  }
+
+  std::unique_ptr<Coordinator> coordinator;
+  if (coordinator_options) {
+    coordinator = std::make_unique<Coordinator>(*coordinator_options);
+    GlobalLogger->info("Coordinator of {} shards",
+                       coordinator_options->shards.size());
+  }
+
+  // recovery runs behind the server, /admin/ready reports its progress
+  std::thread recovery_thread([&vector_database, &replica]() {
+    vector_database.reloadDatabase();
+    if (replica) {
+      replica->start();
+    }
+  });
+
+  // requests slower than this are logged with their stage breakdown
+  RequestTrace::setSlowThreshold(std::chrono::milliseconds(100));
+
+  // searches are cpu bound, more of them than cores only share the cores
+  // and all get slower. a coordinator mostly waits on its shards. the
+  // helper pools are counted in the thread budget.
+  AdmissionOptions admission_options;
+  if (!coordinator) {
+    size_t cores = std::max(std::thread::hardware_concurrency(), 4u);
+    admission_options.read = {cores, 2 * cores};
+    admission_options.helper_threads = HYBRID_SEARCH_THREADS;
+  } else {
+    admission_options.helper_threads = coordinator_options->fanout_threads;
+  }
+  HttpServer server("localhost", port, &vector_database, admission_options);
   GlobalLogger->info("HttpServer created");
+  if (replica) {
+    server.setReplica(replica.get());
+  } else if (coordinator) {
+    server.setCoordinator(coordinator.get());
+  } else {
+    server.startTimerThread(300, 100000, 256 * 1024 * 1024);
+  }
   server.start();
+  recovery_thread.join();
 
   return 0;
 }
@@ -0,0 +1,181 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iterator>
+
+namespace {
+Metrics globalMetrics;
+
+constexpr uint64_t kBucketBounds[] = {
+    10000,       25000,      50000,      100000,     250000,
+    500000,      1000000,    2500000,    5000000,    10000000,
+    25000000,    50000000,   100000000,  250000000,  500000000,
+    1000000000,  2500000000, 5000000000, 10000000000};
+
+std::string formatSeconds(uint64_t nanos) {
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "%g", nanos / 1e9);
+  return buf;
+}
+} // namespace
+
+Metrics *getGlobalMetrics() { return &globalMetrics; }
+
+const char *Metrics::handlerToString(Handler handler) {
+  switch (handler) {
+  case Handler::SEARCH:
+    return "search";
+  case Handler::INSERT:
+    return "insert";
+  case Handler::UPSERT:
+    return "upsert";
+  case Handler::QUERY:
+    return "query";
+  case Handler::FACET:
+    return "facet";
+  case Handler::SNAPSHOT:
+    return "snapshot";
+  default:
+    return "unknown";
+  }
+}
+
+const char *Metrics::stageToString(Stage stage) {
+  switch (stage) {
+  case Stage::JSON_PARSE:
+    return "json_parse";
+  case Stage::FILTER_BITMAP:
+    return "filter_bitmap";
+  case Stage::INDEX_SEARCH:
+    return "index_search";
+  case Stage::SCALAR_IO:
+    return "scalar_io";
+  case Stage::WAL_WRITE:
+    return "wal_write";
+  case Stage::WAL_SYNC:
+    return "wal_sync";
+  case Stage::RESPONSE_SERIALIZE:
+    return "response_serialize";
+  default:
+    return "unknown";
+  }
+}
+
+Metrics::Shard *Metrics::localShard() {
+  thread_local const Metrics *owner = nullptr;
+  thread_local Shard *shard = nullptr;
+  if (owner != this) {
+    std::lock_guard<std::mutex> lock(shards_mutex_);
+    shards_.push_back(std::make_unique<Shard>());
+    shard = shards_.back().get();
+    owner = this;
+  }
+  return shard;
+}
+
+// a shard has a single writer, so a plain load and store is enough and
+// avoids the locked read-modify-write of fetch_add
+void Metrics::record(size_t series, uint64_t nanos) {
+  static_assert(std::size(kBucketBounds) + 1 == kNumBuckets);
+  Shard *shard = localShard();
+  size_t bucket = std::lower_bound(std::begin(kBucketBounds),
+                                   std::end(kBucketBounds), nanos) -
+                  std::begin(kBucketBounds);
+  auto &count = shard->buckets[series][bucket];
+  count.store(count.load(std::memory_order_relaxed) + 1,
+              std::memory_order_relaxed);
+  auto &sum = shard->sum_nanos[series];
+  sum.store(sum.load(std::memory_order_relaxed) + nanos,
+            std::memory_order_relaxed);
+}
+
+void Metrics::observe(Handler handler, uint64_t nanos, bool error) {
+  size_t index = static_cast<size_t>(handler);
+  record(index, nanos);
+  if (error) {
+    auto &errors = localShard()->errors[index];
+    errors.store(errors.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_relaxed);
+  }
+}
+
+void Metrics::observe(Stage stage, uint64_t nanos) {
+  record(kNumHandlers + static_cast<size_t>(stage), nanos);
+}
+
+void Metrics::renderHistogram(std::string *out, const std::string &name,
+                              const std::string &label, size_t first,
+                              size_t count) const {
+  for (size_t series = first; series < first + count; ++series) {
+    std::string value = series < kNumHandlers
+                            ? handlerToString(static_cast<Handler>(series))
+                            : stageToString(static_cast<Stage>(
+                                  series - kNumHandlers));
+    std::string labels = label + "=\"" + value + "\"";
+
+    uint64_t buckets[kNumBuckets] = {};
+    uint64_t sum_nanos = 0;
+    for (const auto &shard : shards_) {
+      for (size_t b = 0; b < kNumBuckets; ++b) {
+        buckets[b] += shard->buckets[series][b].load(std::memory_order_relaxed);
+      }
+      sum_nanos += shard->sum_nanos[series].load(std::memory_order_relaxed);
+    }
+
+    uint64_t cumulative = 0;
+    for (size_t b = 0; b < kNumBuckets; ++b) {
+      cumulative += buckets[b];
+      std::string le =
+          b < kNumBuckets - 1 ? formatSeconds(kBucketBounds[b]) : "+Inf";
+      *out += name + "_bucket{" + labels + ",le=\"" + le + "\"} " +
+              std::to_string(cumulative) + "\n";
+    }
+    *out += name + "_sum{" + labels + "} " + formatSeconds(sum_nanos) + "\n";
+    *out += name + "_count{" + labels + "} " + std::to_string(cumulative) +
+            "\n";
+  }
+}
+
+void Metrics::render(std::string *out) const {
+  std::lock_guard<std::mutex> lock(shards_mutex_);
+
+  *out += "# HELP vdb_request_duration_seconds Time spent in a request "
+          "handler.\n"
+          "# TYPE vdb_request_duration_seconds histogram\n";
+  renderHistogram(out, "vdb_request_duration_seconds", "handler", 0,
+                  kNumHandlers);
+
+  *out += "# HELP vdb_request_errors_total Requests answered with a 4xx or "
+          "5xx status.\n"
+          "# TYPE vdb_request_errors_total counter\n";
+  for (size_t handler = 0; handler < kNumHandlers; ++handler) {
+    uint64_t errors = 0;
+    for (const auto &shard : shards_) {
+      errors += shard->errors[handler].load(std::memory_order_relaxed);
+    }
+    *out += std::string("vdb_request_errors_total{handler=\"") +
+            handlerToString(static_cast<Handler>(handler)) + "\"} " +
+            std::to_string(errors) + "\n";
+  }
+
+  *out += "# HELP vdb_stage_duration_seconds Time spent in one stage of "
+          "request processing.\n"
+          "# TYPE vdb_stage_duration_seconds histogram\n";
+  renderHistogram(out, "vdb_stage_duration_seconds", "stage", kNumHandlers,
+                  kNumSeries - kNumHandlers);
+}
+
+void Metrics::appendGauge(std::string *out, const std::string &name,
+                          const std::string &help, double value,
+                          const std::string &labels) {
+  // HELP and TYPE go before the first sample of a name only
+  std::string header = "# TYPE " + name + " gauge\n";
+  if (out->find(header) == std::string::npos) {
+    *out += "# HELP " + name + " " + help + "\n" + header;
+  }
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "%.17g", value);
+  *out += name + (labels.empty() ? "" : "{" + labels + "}") + " " + buf +
+          "\n";
+}
@@ -1,43 +1,216 @@
 #include "persistence.h"
+#include "constants.h"
+#include "crc32c.h"
 #include "index_factory.h"
 #include "logger.h"
+#include "metrics.h"
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
+#include <climits>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <rapidjson/document.h>
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+namespace {
+constexpr uint32_t kWALMagic = 0x4C575653; // "SVWL"
+constexpr uint16_t kWALFormatVersion = 1;
+
+uint32_t recordCRC(const WALRecordHeader &header, const char *payload) {
+  uint32_t crc = crc32c(reinterpret_cast<const char *>(&header.log_id),
+                        sizeof(header.log_id));
+  crc = crc32c_extend(crc, reinterpret_cast<const char *>(&header.op_code),
+                      sizeof(header.op_code));
+  return crc32c_extend(crc, payload, header.payload_size);
+}
+
+// snapshot files and the marker sit in the working directory
+constexpr char kSnapshotDirectory[] = ".";
+
+// fsyncs a file written through a stream or a library, or a directory so
+// the renames in it survive a crash. open/fsync/close only, so a forked
+// child may call it.
+bool syncPath(const char *path) {
+  int fd = ::open(path, O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  bool synced = ::fsync(fd) == 0;
+  ::close(fd);
+  return synced;
+}
+
+Persistence::OpCode opCodeFromString(const std::string &operation_type) {
+  if (operation_type == "upsert") {
+    return Persistence::OpCode::UPSERT;
+  }
+  return Persistence::OpCode::UNKNOWN;
+}
+} // namespace
+
+std::string Persistence::opCodeToString(OpCode op_code) {
+  switch (op_code) {
+  case OpCode::UPSERT:
+    return "upsert";
+  default:
+    return "";
+  }
+}
+
 Persistence::Persistence() : increaseID_(1), lastSnapshotID_(0) {}
 
 Persistence::~Persistence() {
+  if (writer_thread_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex_);
+      stop_ = true;
+    }
+    queue_cv_.notify_one();
+    writer_thread_.join();
+  }
+  unmapWAL();
+  finishReplay();
+  if (read_fd_ != -1) {
+    ::close(read_fd_);
+  }
   if (wal_fd_ != -1) {
     fsync(wal_fd_);
     ::close(wal_fd_);
   }
 }
 
-void Persistence::init(const std::string &local_path, bool flush) {
-  need_flush_ = flush;
-  wal_fd_ = ::open(local_path.c_str(), O_RDWR | O_APPEND | O_CREAT,
-                   S_IRUSR | S_IWUSR);
-  if (wal_fd_ == -1) {
-    GlobalLogger->error(
-        "an error occurred while writing the wal log entry. reason: {}",
-        std::strerror(errno));
-    exit(-1);
+void Persistence::init(const std::string &local_path,
+                       const WALOptions &options) {
+  options_ = options;
+  wal_path_ = local_path;
+
+  // a single wal file from before segmentation becomes segment 0
+  std::error_code ec;
+  if (std::filesystem::is_regular_file(wal_path_, ec)) {
+    std::filesystem::rename(wal_path_, segmentPath(0), ec);
+    if (ec) {
+      GlobalLogger->error("Failed to migrate WAL file {}: {}", wal_path_,
+                          ec.message());
+      exit(-1);
+    }
+    GlobalLogger->info("Migrated WAL file {} to {}", wal_path_,
+                       segmentPath(0));
   }
+
   loadLastSnapshotID();
+
+  std::vector<uint64_t> segments = listSegments();
+  for (uint64_t segment : segments) {
+    if (segment < snapshot_segment_) {
+      continue;
+    }
+    uint64_t size = std::filesystem::file_size(segmentPath(segment), ec);
+    if (!ec) {
+      replay_bytes_total_ += size;
+    }
+  }
+  replay_bytes_total_ -= std::min(replay_bytes_total_, snapshot_offset_);
+  openSegment(segments.empty() ? snapshot_segment_ : segments.back());
+
+  last_sync_ = std::chrono::steady_clock::now();
+  writer_thread_ = std::thread(&Persistence::writerLoop, this);
+}
+
+std::string Persistence::segmentPath(uint64_t segment) const {
+  char suffix[32];
+  std::snprintf(suffix, sizeof(suffix), ".%06lu",
+                static_cast<unsigned long>(segment));
+  return wal_path_ + suffix;
+}
+
+std::vector<uint64_t> Persistence::listSegments() const {
+  std::filesystem::path prefix(wal_path_);
+  std::filesystem::path dir = prefix.parent_path();
+  if (dir.empty()) {
+    dir = ".";
+  }
+  std::string name_prefix = prefix.filename().string() + ".";
+
+  std::vector<uint64_t> segments;
+  std::error_code ec;
+  for (const auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+    std::string name = entry.path().filename().string();
+    if (name.size() <= name_prefix.size() ||
+        name.compare(0, name_prefix.size(), name_prefix) != 0) {
+      continue;
+    }
+    std::string number = name.substr(name_prefix.size());
+    if (number.find_first_not_of("0123456789") != std::string::npos) {
+      continue;
+    }
+    segments.push_back(std::stoull(number));
+  }
+  std::sort(segments.begin(), segments.end());
+  return segments;
+}
+
+void Persistence::openSegment(uint64_t segment) {
+  std::string path = segmentPath(segment);
+  int fd =
+      ::open(path.c_str(), O_RDWR | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    GlobalLogger->error("Failed to open WAL segment {}. Reason: {}", path,
+                        std::strerror(errno));
+    exit(-1);
+  }
+  struct stat st;
+  ::fstat(fd, &st);
+
+  if (wal_fd_ != -1) {
+    ::fsync(wal_fd_);
+    ::close(wal_fd_);
+  }
+  wal_fd_ = fd;
+  current_segment_ = segment;
+  current_segment_bytes_ = static_cast<uint64_t>(st.st_size);
+  GlobalLogger->debug("Opened WAL segment {} ({} bytes)", path,
+                      current_segment_bytes_);
+}
+
+void Persistence::rotateSegment() {
+  openSegment(current_segment_ + 1);
+  unsynced_bytes_ = 0;
+}
+
+void Persistence::removeSegmentsBefore(uint64_t segment) {
+  for (uint64_t old_segment : listSegments()) {
+    if (old_segment >= segment) {
+      break;
+    }
+    std::error_code ec;
+    std::filesystem::remove(segmentPath(old_segment), ec);
+    if (ec) {
+      GlobalLogger->warn("Failed to remove WAL segment {}: {}",
+                         segmentPath(old_segment), ec.message());
+    } else {
+      GlobalLogger->info("Removed obsolete WAL segment {}",
+                         segmentPath(old_segment));
+    }
+  }
 }
 
 uint64_t Persistence::increaseID() {
@@ -45,132 +218,982 @@ uint64_t Persistence::increaseID() {
   return increaseID_;
 }
 
-uint64_t Persistence::getID() const { return increaseID_; }
+uint64_t Persistence::getID() const {
+  std::lock_guard<std::mutex> lock(queue_mutex_);
+  return increaseID_;
+}
 
-void Persistence::writeWALLog(const std::string &operation_type,
-                              const rapidjson::Document &json_data,
-                              const std::string &version) {
-  uint64_t log_id = increaseID();
+uint64_t Persistence::getLastSnapshotID() const {
+  std::lock_guard<std::mutex> lock(queue_mutex_);
+  return lastSnapshotID_;
+}
+
+uint64_t Persistence::getWALBytesSinceSnapshot() const {
+  return wal_bytes_since_snapshot_.load();
+}
+
+uint64_t Persistence::getReplayBytesTotal() const {
+  return replay_bytes_total_;
+}
+
+std::string Persistence::encodeWALRecord(uint64_t log_id, OpCode op_code,
+                                         const rapidjson::Document &json_data) {
+  // payload: uint32 dim | float32 * dim | scalar fields as json
+  uint32_t dim = 0;
+  if (json_data.HasMember(REQUEST_VECTORS) &&
+      json_data[REQUEST_VECTORS].IsArray()) {
+    dim = json_data[REQUEST_VECTORS].Size();
+  }
 
   rapidjson::StringBuffer buffer;
   rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
-  json_data.Accept(writer);
-
-  auto log = std::to_string(log_id) + "|" + version + "|" + operation_type +
-             "|" + buffer.GetString() + "\n";
-  uint64_t log_size = log.size();
-  auto write_size = ::write(wal_fd_, &log_size, sizeof(uint64_t));
-  if (write_size == -1) {
-    GlobalLogger->error(
-        "An error occurred while writing the WAL log entry. Reason: {}",
-        std::strerror(errno));
-  }
-  write_size = ::write(wal_fd_, log.c_str(), log.size());
-
-  if (write_size == -1) {
-    GlobalLogger->error(
-        "An error occurred while writing the WAL log entry. Reason: {}",
-        std::strerror(errno));
-  } else {
-    GlobalLogger->debug("Wrote WAL log entry: log_id={}, version={}, "
-                        "operation_type={}, json_data_str={}",
-                        log_id, version, operation_type, buffer.GetString());
-    if (need_flush_) {
-      ::fsync(wal_fd_);
+  writer.StartObject();
+  for (auto it = json_data.MemberBegin(); it != json_data.MemberEnd(); ++it) {
+    if (std::strcmp(it->name.GetString(), REQUEST_VECTORS) == 0) {
+      continue;
     }
+    writer.Key(it->name.GetString(), it->name.GetStringLength());
+    it->value.Accept(writer);
+  }
+  writer.EndObject();
+
+  uint32_t payload_size =
+      sizeof(uint32_t) + dim * sizeof(float) + buffer.GetSize();
+  std::string record(sizeof(WALRecordHeader) + payload_size, '\0');
+  char *payload = record.data() + sizeof(WALRecordHeader);
+
+  char *p = payload;
+  std::memcpy(p, &dim, sizeof(uint32_t));
+  p += sizeof(uint32_t);
+  for (uint32_t i = 0; i < dim; ++i) {
+    float value = json_data[REQUEST_VECTORS][i].GetFloat();
+    std::memcpy(p, &value, sizeof(float));
+    p += sizeof(float);
   }
+  std::memcpy(p, buffer.GetString(), buffer.GetSize());
+
+  WALRecordHeader header;
+  header.magic = kWALMagic;
+  header.format_version = kWALFormatVersion;
+  header.op_code = static_cast<uint16_t>(op_code);
+  header.log_id = 0;
+  header.payload_size = payload_size;
+  header.crc = 0;
+  std::memcpy(record.data(), &header, sizeof(WALRecordHeader));
+  sealWALRecord(&record, log_id);
+  return record;
 }
 
-void Persistence::readNextWALLog(std::string *operation_type,
-                                 rapidjson::Document *json_data) {
-  GlobalLogger->debug("Reading next WAL log entry");
+void Persistence::sealWALRecord(std::string *record, uint64_t log_id) {
+  WALRecordHeader header;
+  std::memcpy(&header, record->data(), sizeof(WALRecordHeader));
+  header.log_id = log_id;
+  header.crc = recordCRC(header, record->data() + sizeof(WALRecordHeader));
+  std::memcpy(record->data(), &header, sizeof(WALRecordHeader));
+}
+
+bool Persistence::decodeWALPayload(OpCode op_code, const char *payload,
+                                   uint32_t payload_size,
+                                   rapidjson::Document *json_data) {
+  if (op_code != OpCode::UPSERT || payload_size < sizeof(uint32_t)) {
+    return false;
+  }
+  uint32_t dim;
+  std::memcpy(&dim, payload, sizeof(uint32_t));
+  size_t vector_bytes = static_cast<size_t>(dim) * sizeof(float);
+  if (payload_size - sizeof(uint32_t) < vector_bytes) {
+    return false;
+  }
+  const char *vector_data = payload + sizeof(uint32_t);
+  const char *scalar_data = vector_data + vector_bytes;
+  size_t scalar_size = payload_size - sizeof(uint32_t) - vector_bytes;
+
+  json_data->Parse(scalar_data, scalar_size);
+  if (json_data->HasParseError() || !json_data->IsObject()) {
+    return false;
+  }
 
-  char buf[sizeof(uint64_t)];
-  ::lseek(wal_fd_, read_offset_, SEEK_SET);
+  auto &allocator = json_data->GetAllocator();
+  rapidjson::Value vectors(rapidjson::kArrayType);
+  vectors.Reserve(dim, allocator);
+  for (uint32_t i = 0; i < dim; ++i) {
+    float value;
+    std::memcpy(&value, vector_data + i * sizeof(float), sizeof(float));
+    vectors.PushBack(value, allocator);
+  }
+  json_data->AddMember(REQUEST_VECTORS, vectors, allocator);
+  return true;
+}
+
+uint64_t Persistence::writeWALLog(const std::string &operation_type,
+                                  const rapidjson::Document &json_data) {
+  // the expensive part of encoding happens outside the queue lock, only the
+  // log id and crc are filled in once the record's position is fixed
+  return appendWALRecord(
+      encodeWALRecord(0, opCodeFromString(operation_type), json_data));
+}
+
+uint64_t Persistence::appendWALRecord(std::string record) {
+  std::unique_lock<std::mutex> lock(queue_mutex_);
+  uint64_t log_id = increaseID();
+  sealWALRecord(&record, log_id);
+  pending_.push_back({log_id, std::move(record), false});
+  queue_cv_.notify_one();
+
+  GlobalLogger->debug("Queued WAL log entry: log_id={}", log_id);
+  return log_id;
+}
+
+void Persistence::waitDurable(uint64_t log_id) {
+  if (options_.durability != WALDurability::SYNC) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(queue_mutex_);
+  durable_cv_.wait(lock,
+                   [this, log_id] { return durable_id_ >= log_id || stop_; });
+}
+
+void Persistence::writerLoop() {
+  std::vector<PendingRecord> batch;
+  std::vector<struct iovec> iov;
+  auto interval = std::chrono::milliseconds(options_.sync_interval_ms);
+
+  std::unique_lock<std::mutex> lock(queue_mutex_);
   while (true) {
-    auto read_size = read(wal_fd_, buf, sizeof(uint64_t));
-    assert(read_size == sizeof(uint64_t));
-    if(read_size != 0 && read_size != -1){
+    auto ready = [this] { return stop_ || !pending_.empty(); };
+    if (options_.durability == WALDurability::INTERVAL) {
+      queue_cv_.wait_for(lock, interval, ready);
+    } else {
+      queue_cv_.wait(lock, ready);
+    }
+    if (stop_ && pending_.empty()) {
       break;
     }
-    read_offset_ += read_size;
-    uint64_t log_size;
-    memcpy(&log_size, buf, sizeof(uint64_t));
-    auto log_buf = std::unique_ptr<char>(new char[log_size + 1]);
-    read_size = read(wal_fd_, log_buf.get(), log_size);
-    assert(read_size == log_size);
-    log_buf.get()[log_size] = '\0';
-    if (read_size == -1) {
+    batch.swap(pending_);
+    bool resync = resync_segment_bytes_;
+    resync_segment_bytes_ = false;
+    lock.unlock();
+
+    if (resync) {
+      struct stat st;
+      if (::fstat(wal_fd_, &st) == 0) {
+        current_segment_bytes_ = static_cast<uint64_t>(st.st_size);
+      }
+    }
+
+    uint64_t last_id = 0;
+    bool rotated = false;
+    uint64_t rotated_segment = 0;
+    iov.clear();
+    for (auto &record : batch) {
+      if (record.rotate) {
+        writeRecords(iov);
+        iov.clear();
+        if (current_segment_bytes_ != 0) {
+          rotateSegment();
+        }
+        wal_bytes_since_snapshot_ = 0;
+        rotated = true;
+        rotated_segment = current_segment_;
+        continue;
+      }
+      iov.push_back({record.data.data(), record.data.size()});
+      last_id = record.log_id;
+    }
+    writeRecords(iov);
+
+    bool synced = false;
+    if (options_.durability == WALDurability::SYNC ||
+        (options_.durability == WALDurability::INTERVAL &&
+         unsynced_bytes_ != 0 &&
+         (unsynced_bytes_ >= options_.sync_bytes ||
+          std::chrono::steady_clock::now() - last_sync_ >= interval))) {
+      syncWAL();
+      synced = true;
+    }
+    if (current_segment_bytes_ >= options_.segment_size) {
+      rotateSegment();
+    }
+    if (!batch.empty()) {
+      GlobalLogger->debug("Group committed {} WAL records, synced={}",
+                          batch.size(), synced);
+    }
+    batch.clear();
+
+    lock.lock();
+    if (last_id != 0) {
+      written_id_ = last_id;
+    }
+    if (synced) {
+      durable_id_ = written_id_;
+    }
+    if (rotated) {
+      rotated_segment_ = rotated_segment;
+      rotations_done_++;
+    }
+    durable_cv_.notify_all();
+  }
+}
+
+void Persistence::writeRecords(std::vector<struct iovec> &iov) {
+  if (iov.empty()) {
+    return;
+  }
+  StageTimer timer(Metrics::Stage::WAL_WRITE);
+  size_t index = 0;
+  while (index < iov.size()) {
+    int count =
+        static_cast<int>(std::min<size_t>(iov.size() - index, IOV_MAX));
+    ssize_t written = ::writev(wal_fd_, iov.data() + index, count);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
       GlobalLogger->error(
-          "An error occurred while reading the WAL log entry. Reason: {}",
+          "An error occurred while writing the WAL log entry. Reason: {}",
           std::strerror(errno));
-      ::lseek(wal_fd_, 0, SEEK_END);
       return;
     }
+    current_segment_bytes_ += written;
+    unsynced_bytes_ += written;
+    wal_bytes_since_snapshot_ += written;
+    // skip fully written buffers and resume inside a partially written one
+    while (index < iov.size() &&
+           static_cast<size_t>(written) >= iov[index].iov_len) {
+      written -= iov[index].iov_len;
+      index++;
+    }
+    if (index < iov.size()) {
+      iov[index].iov_base = static_cast<char *>(iov[index].iov_base) + written;
+      iov[index].iov_len -= written;
+    }
+  }
+}
+
+void Persistence::syncWAL() {
+  if (unsynced_bytes_ == 0) {
+    return;
+  }
+  StageTimer timer(Metrics::Stage::WAL_SYNC);
+  if (::fdatasync(wal_fd_) == -1) {
+    GlobalLogger->error("Failed to sync WAL file. Reason: {}",
+                        std::strerror(errno));
+  }
+  unsynced_bytes_ = 0;
+  last_sync_ = std::chrono::steady_clock::now();
+}
+
+bool Persistence::mapWAL() {
+  struct stat st;
+  if (::fstat(read_fd_, &st) == -1) {
+    GlobalLogger->error("Failed to stat WAL file. Reason: {}",
+                        std::strerror(errno));
+    return false;
+  }
+  wal_map_size_ = static_cast<size_t>(st.st_size);
+  if (wal_map_size_ == 0) {
+    return false;
+  }
+  void *addr =
+      ::mmap(nullptr, wal_map_size_, PROT_READ, MAP_PRIVATE, read_fd_, 0);
+  if (addr == MAP_FAILED) {
+    GlobalLogger->error("Failed to mmap WAL file. Reason: {}",
+                        std::strerror(errno));
+    wal_map_size_ = 0;
+    return false;
+  }
+  ::madvise(addr, wal_map_size_, MADV_SEQUENTIAL);
+  wal_map_ = static_cast<const char *>(addr);
+  return true;
+}
+
+void Persistence::unmapWAL() {
+  if (wal_map_ != nullptr) {
+    ::munmap(const_cast<char *>(wal_map_), wal_map_size_);
+    wal_map_ = nullptr;
+  }
+  wal_map_size_ = 0;
+}
+
+// text records written before the binary format: uint64 size | "id|ver|op|json"
+bool Persistence::readLegacyWALLog(WALRecordView *record) {
+  uint64_t log_size;
+  if (wal_map_size_ - read_offset_ < sizeof(uint64_t)) {
+    return false;
+  }
+  std::memcpy(&log_size, wal_map_ + read_offset_, sizeof(uint64_t));
+  if (wal_map_size_ - read_offset_ - sizeof(uint64_t) < log_size) {
+    return false;
+  }
+  std::string_view log(wal_map_ + read_offset_ + sizeof(uint64_t), log_size);
+
+  size_t first = log.find('|');
+  size_t second = log.find('|', first + 1);
+  size_t third = log.find('|', second + 1);
+  if (first == std::string_view::npos || second == std::string_view::npos ||
+      third == std::string_view::npos) {
+    return false;
+  }
+  std::string log_id_str(log.substr(0, first));
+  char *end = nullptr;
+  record->log_id = std::strtoull(log_id_str.c_str(), &end, 10);
+  if (end == log_id_str.c_str()) {
+    return false;
+  }
+  std::string operation_type(log.substr(second + 1, third - second - 1));
+  record->format_version = 0;
+  record->op_code = static_cast<uint16_t>(opCodeFromString(operation_type));
+  record->payload = log.data() + third + 1;
+  record->payload_size = static_cast<uint32_t>(log.size() - third - 1);
+  // the old writer terminated every record with a newline
+  if (record->payload_size > 0 &&
+      record->payload[record->payload_size - 1] == '\n') {
+    record->payload_size--;
+  }
+  read_offset_ += sizeof(uint64_t) + log_size;
+  return true;
+}
+
+Persistence::ParseResult Persistence::parseWALRecord(const char *data,
+                                                    size_t size,
+                                                    WALRecordView *record) {
+  if (size < sizeof(WALRecordHeader)) {
+    return ParseResult::INCOMPLETE;
+  }
+  WALRecordHeader header;
+  std::memcpy(&header, data, sizeof(WALRecordHeader));
+  if (header.magic != kWALMagic || header.format_version == 0 ||
+      header.format_version > kWALFormatVersion) {
+    return ParseResult::CORRUPT;
+  }
+  if (size - sizeof(WALRecordHeader) < header.payload_size) {
+    return ParseResult::INCOMPLETE;
+  }
+  const char *payload = data + sizeof(WALRecordHeader);
+  if (recordCRC(header, payload) != header.crc) {
+    return ParseResult::CORRUPT;
+  }
+  record->log_id = header.log_id;
+  record->format_version = header.format_version;
+  record->op_code = header.op_code;
+  record->payload = payload;
+  record->payload_size = header.payload_size;
+  return ParseResult::OK;
+}
+
+std::string Persistence::encodeHeartbeat(uint64_t log_id,
+                                         uint64_t incarnation,
+                                         uint64_t incarnation_log_id) {
+  WALRecordHeader header;
+  header.magic = kWALMagic;
+  header.format_version = kWALFormatVersion;
+  header.op_code = static_cast<uint16_t>(OpCode::HEARTBEAT);
+  header.log_id = 0;
+  header.payload_size = 2 * sizeof(uint64_t);
+  header.crc = 0;
+  std::string record(reinterpret_cast<const char *>(&header),
+                     sizeof(WALRecordHeader));
+  record.append(reinterpret_cast<const char *>(&incarnation),
+                sizeof(uint64_t));
+  record.append(reinterpret_cast<const char *>(&incarnation_log_id),
+                sizeof(uint64_t));
+  sealWALRecord(&record, log_id);
+  return record;
+}
+
+bool Persistence::decodeHeartbeat(const WALRecordView &record,
+                                  uint64_t *incarnation,
+                                  uint64_t *incarnation_log_id) {
+  // leaders from before the incarnation sent no payload
+  if (record.payload_size < 2 * sizeof(uint64_t)) {
+    return false;
+  }
+  std::memcpy(incarnation, record.payload, sizeof(uint64_t));
+  std::memcpy(incarnation_log_id, record.payload + sizeof(uint64_t),
+              sizeof(uint64_t));
+  return true;
+}
+
+bool Persistence::decodeWALRecord(const WALRecordView &record,
+                                  rapidjson::Document *json_data) {
+  if (record.format_version == 0) {
+    json_data->Parse(record.payload, record.payload_size);
+    return !json_data->HasParseError() && json_data->IsObject();
+  }
+  return decodeWALPayload(static_cast<OpCode>(record.op_code), record.payload,
+                          record.payload_size, json_data);
+}
+
+bool Persistence::openNextReadSegment() {
+  while (read_segment_index_ < read_segments_.size()) {
+    uint64_t segment = read_segments_[read_segment_index_];
+    std::string path = segmentPath(segment);
+    read_fd_ = ::open(path.c_str(), O_RDONLY);
+    if (read_fd_ == -1) {
+      GlobalLogger->error("Failed to open WAL segment {}. Reason: {}", path,
+                          std::strerror(errno));
+    } else if (mapWAL()) {
+      read_offset_ = (segment == snapshot_segment_) ? snapshot_offset_ : 0;
+      GlobalLogger->info("Replaying WAL segment {} from offset {}", path,
+                         read_offset_);
+      return true;
+    } else {
+      ::close(read_fd_);
+      read_fd_ = -1;
+    }
+    read_segment_index_++;
+  }
+  return false;
+}
 
-    read_offset_ += read_size;
-    std::istringstream iss(log_buf.get());
-    std::string log_id_str, version, json_data_str;
+void Persistence::finishReadSegment() {
+  uint64_t segment = read_segments_[read_segment_index_];
+  if (read_offset_ < wal_map_size_) {
+    if (read_segment_index_ + 1 == read_segments_.size()) {
+      // a crash in the middle of an append leaves a partial record behind,
+      // cut it off so new records are not appended after garbage
+      GlobalLogger->warn("Truncating torn WAL tail of {} at offset {} ({} "
+                         "bytes)",
+                         segmentPath(segment), read_offset_,
+                         wal_map_size_ - read_offset_);
+      if (::truncate(segmentPath(segment).c_str(),
+                     static_cast<off_t>(read_offset_)) == -1) {
+        GlobalLogger->error("Failed to truncate WAL file. Reason: {}",
+                            std::strerror(errno));
+      } else {
+        // the segment size belongs to the writer thread, it reads it again
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        resync_segment_bytes_ = true;
+      }
+    } else {
+      GlobalLogger->error("Corrupted record in WAL segment {} at offset {}, "
+                          "skipping the rest of the segment",
+                          segmentPath(segment), read_offset_);
+    }
+  }
+  // views handed out by nextWALRecord may still point into this segment
+  retired_maps_.emplace_back(wal_map_, wal_map_size_);
+  wal_map_ = nullptr;
+  wal_map_size_ = 0;
+  ::close(read_fd_);
+  read_fd_ = -1;
+  read_offset_ = 0;
+  read_segment_index_++;
+}
 
-    std::getline(iss, log_id_str, '|');
-    std::getline(iss, version, '|');
-    std::getline(iss, *operation_type, '|');
-    std::getline(iss, json_data_str, '|');
+void Persistence::finishReplay() {
+  for (const auto &map : retired_maps_) {
+    ::munmap(const_cast<char *>(map.first), map.second);
+  }
+  retired_maps_.clear();
+}
 
-    uint64_t log_id = std::stoull(log_id_str);
-    if (log_id > increaseID_) {
-      increaseID_ = log_id;
+bool Persistence::nextWALRecord(WALRecordView *record) {
+  if (!read_started_) {
+    read_started_ = true;
+    // segments before the snapshot one are fully covered by the snapshot
+    for (uint64_t segment : listSegments()) {
+      if (segment >= snapshot_segment_) {
+        read_segments_.push_back(segment);
+      }
     }
+  }
 
-    if (log_id > lastSnapshotID_) {
-      json_data->Parse(json_data_str.c_str());
-      GlobalLogger->debug(
-          "Read WAL log entry: log_id={}, operation_type={}, json_data_str={}",
-          log_id_str, *operation_type, json_data_str);
-      return;
+  while (wal_map_ != nullptr || openNextReadSegment()) {
+    while (read_offset_ < wal_map_size_) {
+      size_t remaining = wal_map_size_ - read_offset_;
+      uint32_t magic = 0;
+      if (remaining >= sizeof(uint32_t)) {
+        std::memcpy(&magic, wal_map_ + read_offset_, sizeof(uint32_t));
+      }
+
+      if (magic != kWALMagic) {
+        if (!readLegacyWALLog(record)) {
+          break;
+        }
+      } else {
+        if (parseWALRecord(wal_map_ + read_offset_, remaining, record) !=
+            ParseResult::OK) {
+          break;
+        }
+        read_offset_ += sizeof(WALRecordHeader) + record->payload_size;
+      }
+
+      bool replay;
+      {
+        // request threads read the id while replay runs
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        increaseID_ = std::max(increaseID_, record->log_id);
+        replay = record->log_id > lastSnapshotID_;
+      }
+      if (replay) {
+        return true;
+      }
+    }
+    finishReadSegment();
+  }
+  return false;
+}
+
+void Persistence::readNextWALLog(std::string *operation_type,
+                                 rapidjson::Document *json_data) {
+  GlobalLogger->debug("Reading next WAL log entry");
+
+  WALRecordView record;
+  while (nextWALRecord(&record)) {
+    if (!decodeWALRecord(record, json_data)) {
+      GlobalLogger->error("Skipping undecodable WAL log entry: log_id={}",
+                          record.log_id);
+      continue;
     }
+    *operation_type = opCodeToString(static_cast<OpCode>(record.op_code));
+    GlobalLogger->debug("Read WAL log entry: log_id={}, operation_type={}",
+                        record.log_id, *operation_type);
+    return;
   }
-  ::lseek(wal_fd_, 0, SEEK_END);
+  finishReplay();
   GlobalLogger->debug("No more WAL log entries to read");
 }
 
-void Persistence::takeSnapshot(ScalarStorage &scalar_storage) {
-  GlobalLogger->debug("Taking snapshot");
+WALCursor::~WALCursor() {
+  if (fd != -1) {
+    ::close(fd);
+  }
+}
+
+uint64_t Persistence::firstLogID(uint64_t segment) const {
+  int fd = ::open(segmentPath(segment).c_str(), O_RDONLY);
+  if (fd == -1) {
+    return 0;
+  }
+  WALRecordHeader header;
+  ssize_t n = ::pread(fd, &header, sizeof(WALRecordHeader), 0);
+  ::close(fd);
+  if (n != sizeof(WALRecordHeader) || header.magic != kWALMagic) {
+    return 0;
+  }
+  return header.log_id;
+}
+
+bool Persistence::openCursor(WALCursor *cursor, uint64_t segment) const {
+  int fd = ::open(segmentPath(segment).c_str(), O_RDONLY);
+  if (fd == -1) {
+    GlobalLogger->error("Failed to open WAL segment {}. Reason: {}",
+                        segmentPath(segment), std::strerror(errno));
+    return false;
+  }
+  if (cursor->fd != -1) {
+    ::close(cursor->fd);
+  }
+  cursor->fd = fd;
+  cursor->segment = segment;
+  cursor->offset = 0;
+  return true;
+}
+
+bool Persistence::advanceCursor(WALCursor *cursor) const {
+  for (uint64_t segment : listSegments()) {
+    if (segment > cursor->segment) {
+      return openCursor(cursor, segment);
+    }
+  }
+  return false;
+}
+
+bool Persistence::hasWALFrom(uint64_t log_id) const {
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    // a log id past the next one was never written here
+    if (log_id > increaseID_ + 1) {
+      return false;
+    }
+    // the segments after the snapshot one are kept until the next snapshot
+    if (log_id > lastSnapshotID_) {
+      return true;
+    }
+  }
+  std::vector<uint64_t> segments = listSegments();
+  if (segments.empty()) {
+    return false;
+  }
+  uint64_t first_id = firstLogID(segments.front());
+  return first_id != 0 && first_id <= log_id;
+}
+
+uint64_t Persistence::readWAL(WALCursor *cursor, uint64_t from_id,
+                              size_t max_bytes, std::string *out) const {
+  if (cursor->fd == -1) {
+    // start in the last segment whose first record is not after from_id,
+    // the records before from_id in it are skipped below
+    std::vector<uint64_t> segments = listSegments();
+    if (segments.empty()) {
+      return 0;
+    }
+    uint64_t start = segments.front();
+    for (uint64_t segment : segments) {
+      uint64_t first_id = firstLogID(segment);
+      if (first_id != 0 && first_id > from_id) {
+        break;
+      }
+      start = segment;
+    }
+    if (!openCursor(cursor, start)) {
+      return 0;
+    }
+  }
+
+  uint64_t last_id = 0;
+  bool retried = false;
+  while (out->size() < max_bytes) {
+    struct stat st;
+    if (::fstat(cursor->fd, &st) == -1) {
+      break;
+    }
+    uint64_t size = static_cast<uint64_t>(st.st_size);
+
+    WALRecordHeader header;
+    bool complete = false;
+    if (size - cursor->offset >= sizeof(WALRecordHeader) &&
+        ::pread(cursor->fd, &header, sizeof(WALRecordHeader),
+                cursor->offset) == sizeof(WALRecordHeader)) {
+      uint64_t record_size = sizeof(WALRecordHeader) + header.payload_size;
+      if (header.magic != kWALMagic) {
+        // legacy text records predate every log id a follower asks for,
+        // they are stepped over: uint64 size | text
+        uint64_t log_size;
+        std::memcpy(&log_size, &header, sizeof(uint64_t));
+        if (size - cursor->offset - sizeof(uint64_t) >= log_size) {
+          cursor->offset += sizeof(uint64_t) + log_size;
+          continue;
+        }
+      } else if (size - cursor->offset >= record_size) {
+        size_t begin = out->size();
+        out->resize(begin + record_size);
+        char *record = out->data() + begin;
+        ssize_t n = ::pread(cursor->fd, record, record_size, cursor->offset);
+        complete = n == static_cast<ssize_t>(record_size) &&
+                   recordCRC(header, record + sizeof(WALRecordHeader)) ==
+                       header.crc;
+        if (complete && header.log_id >= from_id) {
+          last_id = header.log_id;
+        } else {
+          out->resize(begin);
+        }
+        if (complete) {
+          cursor->offset += record_size;
+        }
+      }
+    }
+    if (complete) {
+      retried = false;
+      continue;
+    }
 
-  lastSnapshotID_ = increaseID_;
-  std::string snapshot_folder_path = "snapshots_";
+    // the writer may still be appending to the newest segment. it finishes
+    // a segment before it creates the next one, so once there is a next
+    // one a second look sees the whole tail.
+    if (!retried) {
+      std::vector<uint64_t> segments = listSegments();
+      if (segments.empty() || segments.back() <= cursor->segment) {
+        break;
+      }
+      retried = true;
+      continue;
+    }
+    if (cursor->offset < size) {
+      GlobalLogger->error("Corrupted record in WAL segment {} at offset {}, "
+                          "streaming the next segment",
+                          segmentPath(cursor->segment), cursor->offset);
+    }
+    retried = false;
+    if (!advanceCursor(cursor)) {
+      break;
+    }
+  }
+  return last_id;
+}
+
+void Persistence::waitWritten(uint64_t log_id,
+                              std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(queue_mutex_);
+  durable_cv_.wait_for(lock, timeout, [this, log_id] {
+    return written_id_ > log_id || stop_;
+  });
+}
+
+SnapshotResult Persistence::takeSnapshot(ScalarStorage &scalar_storage,
+                                         std::shared_mutex &write_gate,
+                                         std::shared_mutex &index_lock) {
+  std::lock_guard<std::mutex> snapshot_lock(snapshot_mutex_);
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    if (increaseID_ == lastSnapshotID_) {
+      GlobalLogger->info("Skipping snapshot, nothing changed since log ID {}",
+                         lastSnapshotID_);
+      return SnapshotResult::SKIPPED;
+    }
+  }
+  // a delta needs a full snapshot underneath it
+  bool full = lastSnapshotID_ == 0 || force_full_snapshot_ ||
+              delta_chain_length_ >= options_.max_delta_snapshots;
+  uint32_t sequence = full ? 0 : delta_chain_length_ + 1;
+  GlobalLogger->debug("Taking {} snapshot", full ? "full" : "delta");
+
+  const std::string snapshot_folder_path = "snapshots_";
+  const std::string tmp_suffix = ".tmp";
   IndexFactory *index_factory = getGlobalIndexFactory();
-  index_factory->saveIndex(snapshot_folder_path, scalar_storage);
+  auto start_time = std::chrono::steady_clock::now();
+
+  uint64_t snapshot_id;
+  uint64_t rotation;
+  std::map<std::string, std::string> scalar_indexes;
+  IndexFactory::IndexDelta delta;
+  pid_t pid = 0;
+  {
+    // with the gate held no update sits between its wal write and the end
+    // of its rocksdb write, so the state captured below is exactly
+    // snapshot_id. waiting for it does not hold up searches, only the
+    // capture itself keeps them out.
+    std::unique_lock<std::shared_mutex> gate(write_gate);
+    std::unique_lock<std::shared_mutex> index(index_lock);
+    {
+      // the writer thread switches to a new segment right after the last
+      // record queued before this point
+      std::lock_guard<std::mutex> lock(queue_mutex_);
+      snapshot_id = increaseID_;
+      pending_.push_back({snapshot_id, std::string(), true});
+      rotation = ++rotations_requested_;
+    }
+    queue_cv_.notify_one();
+
+    if (full) {
+      scalar_indexes =
+          index_factory->serializeScalarIndexes(snapshot_folder_path);
+      index_factory->clearDirty();
+      std::vector<std::string> tmp_files;
+      for (const auto &file :
+           index_factory->indexFilePaths(snapshot_folder_path)) {
+        tmp_files.push_back(file + tmp_suffix);
+      }
+      // the child writes the vector indexes from its copy-on-write view
+      // while this process keeps serving. it must not log or run
+      // destructors. a rename only installs files whose data is on disk.
+      pid = ::fork();
+      if (pid == 0) {
+        bool saved =
+            index_factory->saveIndexFiles(snapshot_folder_path, tmp_suffix);
+        for (const auto &file : tmp_files) {
+          saved = saved && syncPath(file.c_str());
+        }
+        ::_exit(saved ? 0 : 1);
+      }
+    } else {
+      // proportional to what changed, cheap enough to do under the gate
+      delta = index_factory->serializeDeltas(snapshot_folder_path, sequence);
+    }
+  }
+  GlobalLogger->debug(
+      "Snapshot state captured at log ID {} in {} ms", snapshot_id,
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - start_time)
+          .count());
+
+  {
+    std::unique_lock<std::mutex> lock(queue_mutex_);
+    durable_cv_.wait(lock,
+                     [this, rotation] { return rotations_done_ >= rotation; });
+  }
+
+  bool saved = false;
+  if (!full) {
+    saved = writeDeltaFiles(delta.files);
+  } else if (pid == -1) {
+    GlobalLogger->error("Failed to fork snapshot writer. Reason: {}",
+                        std::strerror(errno));
+  } else {
+    int status = 0;
+    while (::waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+    }
+    saved = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  }
 
-  saveLastSnapshotID();
-  // todo: switch log file 
+  std::vector<std::string> index_files =
+      full ? index_factory->indexFilePaths(snapshot_folder_path)
+           : index_factory->deltaFilePaths(snapshot_folder_path, sequence);
+  for (const auto &file : index_files) {
+    if (!saved) {
+      break;
+    }
+    // the log id is not advanced on a failure, replaying the wal from the
+    // previous snapshot on top of files already renamed is still correct
+    std::error_code ec;
+    std::filesystem::rename(file + tmp_suffix, file, ec);
+    if (ec) {
+      GlobalLogger->error("Failed to install snapshot file {}: {}", file,
+                          ec.message());
+      saved = false;
+    }
+  }
+  if (saved && !syncPath(kSnapshotDirectory)) {
+    GlobalLogger->error("Failed to sync the snapshot directory. Reason: {}",
+                        std::strerror(errno));
+    saved = false;
+  }
+  // the text index goes in one synced write, which also makes every record
+  // the snapshot covers durable in rocksdb
+  if (saved && !scalar_storage.putSynced(full ? scalar_indexes
+                                              : delta.scalars)) {
+    saved = false;
+  }
+  if (!saved) {
+    GlobalLogger->error("Snapshot at log ID {} failed, keeping the previous "
+                        "one",
+                        snapshot_id);
+    for (const auto &file : index_files) {
+      std::error_code ec;
+      std::filesystem::remove(file + tmp_suffix, ec);
+    }
+    // the dirty state went into the failed snapshot, only a full one can
+    // cover it now
+    force_full_snapshot_ = true;
+    return SnapshotResult::FAILED;
+  }
+  uint32_t previous_chain_length = delta_chain_length_;
+  uint64_t previous_id = lastSnapshotID_;
+  uint64_t previous_segment = snapshot_segment_;
+  uint64_t previous_offset = snapshot_offset_;
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    lastSnapshotID_ = snapshot_id;
+    snapshot_segment_ = rotated_segment_;
+    snapshot_offset_ = 0;
+  }
+  delta_chain_length_ = sequence;
+  force_full_snapshot_ = false;
+  // the wal is only dropped once the marker pointing past it is on disk
+  if (!saveLastSnapshotID()) {
+    GlobalLogger->error("Snapshot at log ID {} is not recorded, keeping the "
+                        "WAL",
+                        snapshot_id);
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex_);
+      lastSnapshotID_ = previous_id;
+      snapshot_segment_ = previous_segment;
+      snapshot_offset_ = previous_offset;
+    }
+    delta_chain_length_ = previous_chain_length;
+    force_full_snapshot_ = true;
+    return SnapshotResult::FAILED;
+  }
+  removeSegmentsBefore(snapshot_segment_);
+  if (full) {
+    // the new full snapshot replaces the whole chain
+    for (uint32_t i = 1; i <= previous_chain_length; ++i) {
+      for (const auto &file :
+           index_factory->deltaFilePaths(snapshot_folder_path, i)) {
+        std::error_code ec;
+        std::filesystem::remove(file, ec);
+      }
+    }
+  }
+  GlobalLogger->info(
+      "{} snapshot at log ID {} finished in {} ms",
+      full ? "Full" : "Delta " + std::to_string(sequence), snapshot_id,
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - start_time)
+          .count());
+  return SnapshotResult::TAKEN;
+}
+
+bool Persistence::writeDeltaFiles(
+    const std::map<std::string, std::string> &files) {
+  for (const auto &entry : files) {
+    std::string tmp_path = entry.first + ".tmp";
+    std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+      GlobalLogger->error("Failed to open delta snapshot file {}", tmp_path);
+      return false;
+    }
+    file.write(entry.second.data(), entry.second.size());
+    file.close();
+    if (!file || !syncPath(tmp_path.c_str())) {
+      GlobalLogger->error("Failed to write delta snapshot file {}", tmp_path);
+      return false;
+    }
+  }
+  return true;
 }
 
 void Persistence::loadSnapshot(ScalarStorage &scalar_storage) {
   GlobalLogger->debug("Loading snapshot");
   IndexFactory *index_factory = getGlobalIndexFactory();
   index_factory->loadIndex("snapshots_", scalar_storage);
+  for (uint32_t i = 1; i <= delta_chain_length_; ++i) {
+    GlobalLogger->debug("Applying delta snapshot {}", i);
+    index_factory->loadDelta("snapshots_", i, scalar_storage);
+  }
+  // loading counts as clean, the next delta starts from here
+  index_factory->clearDirty();
 }
 
-void Persistence::saveLastSnapshotID() {
-  std::ofstream file("snapshots_MaxLogID");
-  if (file.is_open()) {
-    file << lastSnapshotID_;
-    file.close();
-  } else {
-    GlobalLogger->error("Failed to open file snapshots_MaxID for writing");
+bool Persistence::saveLastSnapshotID() {
+  // written aside, synced and renamed so a crash leaves either the old or
+  // the new marker, never a partial or empty one
+  std::ofstream file("snapshots_MaxLogID.tmp", std::ios::trunc);
+  if (!file.is_open()) {
+    GlobalLogger->error("Failed to open file snapshots_MaxLogID.tmp for "
+                        "writing");
+    return false;
+  }
+  file << lastSnapshotID_ << " " << snapshot_segment_ << " "
+       << snapshot_offset_ << " " << delta_chain_length_;
+  file.close();
+  if (!file || !syncPath("snapshots_MaxLogID.tmp")) {
+    GlobalLogger->error("Failed to write snapshots_MaxLogID.tmp");
+    return false;
+  }
+  std::error_code ec;
+  std::filesystem::rename("snapshots_MaxLogID.tmp", "snapshots_MaxLogID", ec);
+  if (ec) {
+    GlobalLogger->error("Failed to install snapshots_MaxLogID: {}",
+                        ec.message());
+    return false;
+  }
+  if (!syncPath(kSnapshotDirectory)) {
+    GlobalLogger->error("Failed to sync the snapshot directory. Reason: {}",
+                        std::strerror(errno));
+    return false;
   }
-  GlobalLogger->debug("save snapshot Max log ID {}", lastSnapshotID_);
+  GlobalLogger->debug("save snapshot Max log ID {}, WAL segment {}, offset "
+                      "{}, delta chain {}",
+                      lastSnapshotID_, snapshot_segment_, snapshot_offset_,
+                      delta_chain_length_);
+  return true;
 }
 
 void Persistence::loadLastSnapshotID() {
   std::ifstream file("snapshots_MaxLogID");
   if (file.is_open()) {
     file >> lastSnapshotID_;
+    // files written before wal segmentation only hold the log id
+    if (!(file >> snapshot_segment_ >> snapshot_offset_)) {
+      snapshot_segment_ = 0;
+      snapshot_offset_ = 0;
+    }
+    // nor does a file from before delta snapshots have a chain
+    if (!(file >> delta_chain_length_)) {
+      delta_chain_length_ = 0;
+    }
     file.close();
+    // the segments holding ids up to the snapshot may be gone, new ids
+    // must still be larger or replay would skip them
+    increaseID_ = std::max(increaseID_, lastSnapshotID_);
   } else {
     GlobalLogger->warn("Failed to open file snapshots_MaxID for reading");
   }
 
-  GlobalLogger->debug("Loading snapshot Max log ID {}", lastSnapshotID_);
-}
\ No newline at end of file
+  GlobalLogger->debug("Loading snapshot Max log ID {}, WAL segment {}, "
+                      "offset {}, delta chain {}",
+                      lastSnapshotID_, snapshot_segment_, snapshot_offset_,
+                      delta_chain_length_);
+}
@@ -0,0 +1,121 @@
+#include "recall_monitor.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_set>
+
+RecallMonitor::RecallMonitor(const RecallMonitorOptions &options,
+                             ExactSearch exact_search)
+    : options_(options), exact_search_(std::move(exact_search)),
+      sample_every_(options.sample_rate <= 0
+                        ? 0
+                        : std::max<uint64_t>(
+                              1, std::llround(1.0 / options.sample_rate))) {
+  if (sample_every_ != 0) {
+    worker_ = std::thread(&RecallMonitor::run, this);
+    GlobalLogger->info("Recall monitor checks 1 in {} searches",
+                       sample_every_);
+  }
+}
+
+RecallMonitor::~RecallMonitor() {
+  if (worker_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex_);
+      stop_ = true;
+    }
+    queue_cv_.notify_one();
+    worker_.join();
+  }
+  for (Sample &sample : pending_) {
+    if (sample.bitmap != nullptr) {
+      roaring_bitmap_free(sample.bitmap);
+    }
+  }
+}
+
+bool RecallMonitor::shouldSample() {
+  return sample_every_ != 0 &&
+         searches_.fetch_add(1, std::memory_order_relaxed) % sample_every_ ==
+             0;
+}
+
+void RecallMonitor::submit(IndexFactory::IndexType index_type,
+                           const std::vector<float> &query, int k,
+                           const roaring_bitmap_t *bitmap,
+                           const std::vector<long> &approximate) {
+  Sample sample{index_type, query, k,
+                bitmap != nullptr ? roaring_bitmap_copy(bitmap) : nullptr,
+                {}};
+  for (long id : approximate) {
+    if (id != -1) {
+      sample.approximate.push_back(id);
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    if (pending_.size() < options_.max_pending) {
+      pending_.push_back(std::move(sample));
+      queue_cv_.notify_one();
+      return;
+    }
+  }
+  // the exact scans fall behind, skip rather than queue without bound
+  if (sample.bitmap != nullptr) {
+    roaring_bitmap_free(sample.bitmap);
+  }
+}
+
+void RecallMonitor::run() {
+  std::unique_lock<std::mutex> lock(queue_mutex_);
+  while (true) {
+    queue_cv_.wait(lock, [this] { return stop_ || !pending_.empty(); });
+    if (stop_) {
+      break;
+    }
+    Sample sample = std::move(pending_.front());
+    pending_.pop_front();
+    lock.unlock();
+
+    std::vector<long> exact = exact_search_(sample);
+    std::unordered_set<long> found(sample.approximate.begin(),
+                                   sample.approximate.end());
+    size_t hits = std::count_if(exact.begin(), exact.end(),
+                                [&found](long id) { return found.count(id); });
+    // an empty exact answer means nothing matched, nothing was missed
+    record(sample.index_type,
+           exact.empty() ? 1.0 : static_cast<double>(hits) / exact.size());
+    if (sample.bitmap != nullptr) {
+      roaring_bitmap_free(sample.bitmap);
+    }
+
+    lock.lock();
+  }
+}
+
+void RecallMonitor::record(IndexFactory::IndexType index_type,
+                           double recall) {
+  std::lock_guard<std::mutex> lock(recall_mutex_);
+  Window &window = windows_[index_type];
+  window.recalls.push_back(recall);
+  window.sum += recall;
+  window.total++;
+  if (window.recalls.size() > options_.window) {
+    window.sum -= window.recalls.front();
+    window.recalls.pop_front();
+  }
+}
+
+std::map<IndexFactory::IndexType, RecallMonitor::IndexRecall>
+RecallMonitor::getRecall() const {
+  std::lock_guard<std::mutex> lock(recall_mutex_);
+  std::map<IndexFactory::IndexType, IndexRecall> result;
+  for (const auto &entry : windows_) {
+    const Window &window = entry.second;
+    result[entry.first] = {window.sum / window.recalls.size(),
+                           window.recalls.size(), window.total};
+  }
+  return result;
+}
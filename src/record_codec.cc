@@ -0,0 +1,214 @@
+#include "record_codec.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+namespace {
+enum Tag : uint8_t {
+  kNull = 0,
+  kFalse = 1,
+  kTrue = 2,
+  kInt = 3,
+  kUint = 4,
+  kDouble = 5,
+  kString = 6,
+  kJson = 7,
+};
+
+void putVarint(std::string *out, uint64_t value) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+bool getVarint(const char *&p, const char *end, uint64_t *value) {
+  uint64_t result = 0;
+  for (int shift = 0; shift < 64 && p < end; shift += 7) {
+    uint8_t byte = static_cast<uint8_t>(*p++);
+    result |= static_cast<uint64_t>(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+void putBytes(std::string *out, const char *data, size_t size) {
+  putVarint(out, size);
+  out->append(data, size);
+}
+
+bool getBytes(const char *&p, const char *end, const char **data,
+              size_t *size) {
+  uint64_t length;
+  if (!getVarint(p, end, &length) ||
+      length > static_cast<uint64_t>(end - p)) {
+    return false;
+  }
+  *data = p;
+  *size = length;
+  p += length;
+  return true;
+}
+
+bool wanted(const std::vector<std::string> *fields, const char *name,
+            size_t size) {
+  if (fields == nullptr) {
+    return true;
+  }
+  return std::any_of(fields->begin(), fields->end(),
+                     [name, size](const std::string &field) {
+                       return field.size() == size &&
+                              std::memcmp(field.data(), name, size) == 0;
+                     });
+}
+} // namespace
+
+std::string encodeRecord(const rapidjson::Value &record,
+                         const char *skip_field) {
+  std::string out(1, kRecordFormat);
+  if (!record.IsObject()) {
+    putVarint(&out, 0);
+    return out;
+  }
+
+  uint64_t count = 0;
+  for (auto it = record.MemberBegin(); it != record.MemberEnd(); ++it) {
+    if (skip_field == nullptr || std::strcmp(it->name.GetString(),
+                                             skip_field) != 0) {
+      count++;
+    }
+  }
+  putVarint(&out, count);
+
+  for (auto it = record.MemberBegin(); it != record.MemberEnd(); ++it) {
+    if (skip_field != nullptr &&
+        std::strcmp(it->name.GetString(), skip_field) == 0) {
+      continue;
+    }
+    putBytes(&out, it->name.GetString(), it->name.GetStringLength());
+
+    const rapidjson::Value &value = it->value;
+    if (value.IsNull()) {
+      out.push_back(kNull);
+    } else if (value.IsBool()) {
+      out.push_back(value.GetBool() ? kTrue : kFalse);
+    } else if (value.IsInt64()) {
+      int64_t v = value.GetInt64();
+      out.push_back(kInt);
+      putVarint(&out, (static_cast<uint64_t>(v) << 1) ^
+                          static_cast<uint64_t>(v >> 63));
+    } else if (value.IsUint64()) {
+      out.push_back(kUint);
+      putVarint(&out, value.GetUint64());
+    } else if (value.IsDouble()) {
+      double v = value.GetDouble();
+      out.push_back(kDouble);
+      out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+    } else if (value.IsString()) {
+      out.push_back(kString);
+      putBytes(&out, value.GetString(), value.GetStringLength());
+    } else {
+      rapidjson::StringBuffer buffer;
+      rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+      value.Accept(writer);
+      out.push_back(kJson);
+      putBytes(&out, buffer.GetString(), buffer.GetSize());
+    }
+  }
+  return out;
+}
+
+bool decodeRecord(const char *data, size_t size,
+                  const std::vector<std::string> *fields,
+                  rapidjson::Document *record) {
+  record->SetObject();
+  if (!isEncodedRecord(data, size)) {
+    return false;
+  }
+  rapidjson::Document::AllocatorType &allocator = record->GetAllocator();
+  const char *p = data + 1;
+  const char *end = data + size;
+
+  uint64_t count;
+  if (!getVarint(p, end, &count)) {
+    return false;
+  }
+  for (uint64_t i = 0; i < count; ++i) {
+    const char *name;
+    size_t name_size;
+    if (!getBytes(p, end, &name, &name_size) || p >= end) {
+      return false;
+    }
+    uint8_t tag = static_cast<uint8_t>(*p++);
+    bool keep = wanted(fields, name, name_size);
+
+    rapidjson::Value value;
+    switch (tag) {
+    case kNull:
+      break;
+    case kFalse:
+    case kTrue:
+      value.SetBool(tag == kTrue);
+      break;
+    case kInt:
+    case kUint: {
+      uint64_t v;
+      if (!getVarint(p, end, &v)) {
+        return false;
+      }
+      if (tag == kInt) {
+        value.SetInt64(static_cast<int64_t>((v >> 1) ^ (~(v & 1) + 1)));
+      } else {
+        value.SetUint64(v);
+      }
+      break;
+    }
+    case kDouble: {
+      double v;
+      if (end - p < static_cast<ptrdiff_t>(sizeof(v))) {
+        return false;
+      }
+      std::memcpy(&v, p, sizeof(v));
+      p += sizeof(v);
+      value.SetDouble(v);
+      break;
+    }
+    case kString:
+    case kJson: {
+      const char *bytes;
+      size_t bytes_size;
+      if (!getBytes(p, end, &bytes, &bytes_size)) {
+        return false;
+      }
+      if (!keep) {
+        break;
+      }
+      if (tag == kString) {
+        value.SetString(bytes, bytes_size, allocator);
+      } else {
+        rapidjson::Document nested(&allocator);
+        nested.Parse(bytes, bytes_size);
+        if (nested.HasParseError()) {
+          return false;
+        }
+        value.CopyFrom(nested, allocator);
+      }
+      break;
+    }
+    default:
+      return false;
+    }
+
+    if (keep) {
+      rapidjson::Value key(name, name_size, allocator);
+      record->AddMember(key, value, allocator);
+    }
+  }
+  return true;
+}
@@ -0,0 +1,398 @@
+#include "replica.h"
+#include "constants.h"
+#include "logger.h"
+#include "persistence.h"
+#include <map>
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+#include <sstream>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace {
+int64_t steadyMillis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+} // namespace
+
+Replica::Replica(VectorDatabase *vector_database,
+                 const ReplicaOptions &options)
+    : vector_database_(vector_database), options_(options) {}
+
+Replica::~Replica() {
+  if (thread_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(stop_mutex_);
+      stop_ = true;
+    }
+    stop_cv_.notify_all();
+    thread_.join();
+  }
+}
+
+void Replica::start() {
+  caught_up_millis_ = steadyMillis();
+  thread_ = std::thread(&Replica::run, this);
+}
+
+std::string Replica::stateToString(State state) {
+  switch (state) {
+  case State::STOPPED:
+    return "stopped";
+  case State::BOOTSTRAPPING:
+    return "bootstrapping";
+  case State::STREAMING:
+    return "streaming";
+  case State::DISCONNECTED:
+    return "disconnected";
+  default:
+    return "";
+  }
+}
+
+Replica::Status Replica::getStatus() const {
+  Status status;
+  status.state = state_;
+  status.applied_log_id = applied_log_id_;
+  status.leader_log_id = leader_log_id_;
+  bool caught_up = status.state == State::STREAMING &&
+                   status.applied_log_id >= status.leader_log_id;
+  status.lag_seconds =
+      caught_up ? 0.0 : (steadyMillis() - caught_up_millis_) / 1000.0;
+  status.bootstraps = bootstraps_;
+  status.reconnects = reconnects_;
+  return status;
+}
+
+void Replica::run() {
+  httplib::Client client(options_.leader_host, options_.leader_port);
+  client.set_read_timeout(options_.read_timeout_seconds, 0);
+
+  bool need_bootstrap = !resume();
+  while (!stop_) {
+    if (need_bootstrap) {
+      if (!bootstrap(client)) {
+        state_ = State::DISCONNECTED;
+        if (!sleepBeforeRetry()) {
+          break;
+        }
+        continue;
+      }
+      need_bootstrap = false;
+    }
+
+    bool gone = false;
+    stream(client, &gone);
+    if (stop_) {
+      break;
+    }
+    state_ = State::DISCONNECTED;
+    reconnects_++;
+    if (gone) {
+      GlobalLogger->warn("Leader cannot continue the WAL after log ID {}, "
+                         "copying its records again",
+                         applied_log_id_.load());
+      need_bootstrap = true;
+    }
+    if (!sleepBeforeRetry()) {
+      break;
+    }
+  }
+  state_ = State::STOPPED;
+}
+
+bool Replica::sleepBeforeRetry() {
+  std::unique_lock<std::mutex> lock(stop_mutex_);
+  return !stop_cv_.wait_for(lock,
+                            std::chrono::milliseconds(
+                                options_.retry_interval_ms),
+                            [this] { return stop_.load(); });
+}
+
+bool Replica::resume() {
+  std::istringstream saved(vector_database_->getMetadata(REPLICA_STATE_KEY));
+  uint64_t incarnation = 0;
+  uint64_t log_id = 0;
+  if (!(saved >> incarnation >> log_id)) {
+    return false;
+  }
+  // the replica takes no snapshots, its indexes come from its records
+  state_ = State::BOOTSTRAPPING;
+  GlobalLogger->info("Resuming replication at log ID {}, indexing the "
+                     "local records",
+                     log_id);
+  vector_database_->reindexFromStorage();
+  leader_incarnation_ = incarnation;
+  applied_log_id_ = log_id;
+  setLeaderLogID(log_id);
+  bootstrapped_ = true;
+  return true;
+}
+
+bool Replica::bootstrap(httplib::Client &client) {
+  state_ = State::BOOTSTRAPPING;
+  bootstraps_++;
+  // a restart during the copy starts it over
+  vector_database_->putMetadata(REPLICA_STATE_KEY, "");
+
+  auto status = client.Get("/replication/status");
+  if (!status || status->status != 200) {
+    GlobalLogger->warn("Failed to get the replication status of leader "
+                       "{}:{}",
+                       options_.leader_host, options_.leader_port);
+    return false;
+  }
+  rapidjson::Document json_status;
+  json_status.Parse(status->body.c_str());
+  if (!json_status.IsObject() || !json_status.HasMember(RESPONSE_LOG_ID) ||
+      !json_status[RESPONSE_LOG_ID].IsUint64()) {
+    GlobalLogger->error("Invalid replication status from the leader");
+    return false;
+  }
+  // every update up to log_id is in the leader's records, the pages read
+  // below may hold later ones too. the wal stream starts after log_id and
+  // applies those again, which leaves the same records.
+  uint64_t log_id = json_status[RESPONSE_LOG_ID].GetUint64();
+  uint64_t incarnation = 0;
+  if (json_status.HasMember(RESPONSE_INCARNATION) &&
+      json_status[RESPONSE_INCARNATION].IsUint64()) {
+    incarnation = json_status[RESPONSE_INCARNATION].GetUint64();
+  }
+  GlobalLogger->info("Copying the records of leader {}:{} as of log ID {}",
+                     options_.leader_host, options_.leader_port, log_id);
+
+  auto start_time = std::chrono::steady_clock::now();
+  uint64_t start_id = 0;
+  size_t copied = 0;
+  size_t removed = 0;
+  while (!stop_) {
+    rapidjson::StringBuffer request;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(request);
+    writer.StartObject();
+    writer.Key(REQUEST_START_ID);
+    writer.Uint64(start_id);
+    writer.Key(REQUEST_LIMIT);
+    writer.Uint64(options_.bootstrap_page_size);
+    writer.EndObject();
+
+    auto page =
+        client.Post("/scan", request.GetString(), RESPONSE_CONTENT_TYPE_JSON);
+    if (!page || page->status != 200) {
+      GlobalLogger->warn("Failed to copy the records from ID {} of the "
+                         "leader",
+                         start_id);
+      return false;
+    }
+
+    std::vector<rapidjson::Document> records;
+    std::string_view body(page->body);
+    size_t pos = 0;
+    while (pos < body.size()) {
+      size_t end = body.find('\n', pos);
+      if (end == std::string_view::npos) {
+        end = body.size();
+      }
+      if (end > pos) {
+        rapidjson::Document record;
+        record.Parse(body.data() + pos, end - pos);
+        if (!record.IsObject() || !record.HasMember(REQUEST_ID) ||
+            !record[REQUEST_ID].IsUint64()) {
+          GlobalLogger->error("Invalid record in the leader's scan");
+          return false;
+        }
+        records.push_back(std::move(record));
+      }
+      pos = end + 1;
+    }
+
+    // a scan returns every id once, so a page goes in as one batch per
+    // index type
+    std::map<IndexFactory::IndexType,
+             std::pair<std::vector<uint64_t>,
+                       std::vector<const rapidjson::Document *>>>
+        batches;
+    for (const auto &record : records) {
+      auto &batch =
+          batches[vector_database_->getIndexTypeFromRequest(record)];
+      batch.first.push_back(record[REQUEST_ID].GetUint64());
+      batch.second.push_back(&record);
+    }
+    for (const auto &batch : batches) {
+      vector_database_->upsertBatch(batch.second.first, batch.second.second,
+                                    batch.first);
+    }
+    copied += records.size();
+
+    // records kept from an earlier copy that the leader no longer has, e.g.
+    // ones it lost in a restart, go away. the last page covers every id
+    // after it.
+    bool last_page = records.size() < options_.bootstrap_page_size;
+    uint64_t last_id =
+        last_page ? UINT64_MAX : records.back()[REQUEST_ID].GetUint64();
+    std::unordered_set<uint64_t> page_ids;
+    for (const auto &record : records) {
+      page_ids.insert(record[REQUEST_ID].GetUint64());
+    }
+    removed +=
+        vector_database_->removeRecordsExcept(start_id, last_id, page_ids);
+
+    if (last_page) {
+      leader_incarnation_ = incarnation;
+      applied_log_id_ = log_id;
+      saveState();
+      setLeaderLogID(log_id);
+      bootstrapped_ = true;
+      GlobalLogger->info(
+          "Copied {} records of the leader in {} ms, removed {} it does not "
+          "have",
+          copied,
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              std::chrono::steady_clock::now() - start_time)
+              .count(),
+          removed);
+      return true;
+    }
+    start_id = records.back()[REQUEST_ID].GetUint64() + 1;
+  }
+  return false;
+}
+
+void Replica::stream(httplib::Client &client, bool *gone) {
+  uint64_t from_id = applied_log_id_ + 1;
+  std::string path = std::string("/replication/wal?") + REQUEST_FROM_LOG_ID +
+                     "=" + std::to_string(from_id);
+  std::string buffer;
+  auto res = client.Get(
+      path,
+      [this, gone, from_id](const httplib::Response &response) {
+        if (response.status != 200) {
+          GlobalLogger->warn("Leader refused the WAL stream from log ID {}, "
+                             "status {}",
+                             from_id, response.status);
+          *gone = response.status == 410;
+          return false;
+        }
+        state_ = State::STREAMING;
+        GlobalLogger->info("Following the WAL of leader {}:{} from log ID {}",
+                           options_.leader_host, options_.leader_port,
+                           from_id);
+        return true;
+      },
+      [this, &buffer, gone](const char *data, size_t length) {
+        buffer.append(data, length);
+        return applyRecords(&buffer, gone) && !stop_;
+      });
+  if (!res && !stop_ && state_ == State::STREAMING) {
+    GlobalLogger->warn("WAL stream of leader {}:{} broke at log ID {}: {}",
+                       options_.leader_host, options_.leader_port,
+                       applied_log_id_.load(),
+                       httplib::to_string(res.error()));
+  }
+}
+
+bool Replica::applyRecords(std::string *buffer, bool *gone) {
+  uint64_t applied_before = applied_log_id_;
+  size_t offset = 0;
+  WALRecordView record;
+  Persistence::ParseResult result;
+  while ((result = Persistence::parseWALRecord(
+              buffer->data() + offset, buffer->size() - offset, &record)) ==
+         Persistence::ParseResult::OK) {
+    offset += sizeof(WALRecordHeader) + record.payload_size;
+    auto op_code = static_cast<Persistence::OpCode>(record.op_code);
+    if (op_code == Persistence::OpCode::HEARTBEAT) {
+      uint64_t incarnation;
+      uint64_t incarnation_log_id;
+      if (Persistence::decodeHeartbeat(record, &incarnation,
+                                       &incarnation_log_id) &&
+          !followIncarnation(incarnation, incarnation_log_id)) {
+        *gone = true;
+        return false;
+      }
+      setLeaderLogID(record.log_id);
+      continue;
+    }
+
+    uint64_t applied = applied_log_id_;
+    if (record.log_id <= applied) {
+      continue;
+    }
+    // log ids have no holes, a missing one cannot be applied later
+    if (record.log_id != applied + 1) {
+      GlobalLogger->error("Gap in the WAL stream: expected log ID {}, got {}",
+                          applied + 1, record.log_id);
+      *gone = true;
+      return false;
+    }
+
+    rapidjson::Document json_data;
+    if (op_code != Persistence::OpCode::UPSERT ||
+        !Persistence::decodeWALRecord(record, &json_data) ||
+        !json_data.HasMember(REQUEST_ID) || !json_data[REQUEST_ID].IsUint64()) {
+      GlobalLogger->error("Skipping undecodable WAL log entry: log_id={}",
+                          record.log_id);
+    } else {
+      vector_database_->upsert(json_data[REQUEST_ID].GetUint64(), json_data,
+                               vector_database_->getIndexTypeFromRequest(
+                                   json_data));
+    }
+    applied_log_id_ = record.log_id;
+    setLeaderLogID(record.log_id);
+  }
+  buffer->erase(0, offset);
+  if (applied_log_id_ != applied_before) {
+    saveState();
+  }
+
+  if (result == Persistence::ParseResult::CORRUPT) {
+    GlobalLogger->error("Corrupted record in the WAL stream after log ID {}",
+                        applied_log_id_.load());
+    return false;
+  }
+  return true;
+}
+
+bool Replica::followIncarnation(uint64_t incarnation,
+                                uint64_t incarnation_log_id) {
+  if (incarnation == leader_incarnation_) {
+    return true;
+  }
+  // the restarted leader kept the log ids up to incarnation_log_id, the
+  // ones after that it may hand out again for other updates
+  uint64_t applied = applied_log_id_;
+  if (applied > incarnation_log_id) {
+    GlobalLogger->warn("Leader restarted without log IDs {} to {} that were "
+                       "applied here",
+                       incarnation_log_id + 1, applied);
+    return false;
+  }
+  GlobalLogger->info("Leader restarted at log ID {}, following it from log "
+                     "ID {}",
+                     incarnation_log_id, applied);
+  leader_incarnation_ = incarnation;
+  saveState();
+  return true;
+}
+
+void Replica::saveState() {
+  // upsert returns once the records are in rocksdb, so the position written
+  // after them never runs ahead of them. replaying a few records again
+  // after a crash leaves the same records.
+  vector_database_->putMetadata(REPLICA_STATE_KEY,
+                                std::to_string(leader_incarnation_) + " " +
+                                    std::to_string(applied_log_id_));
+}
+
+void Replica::setLeaderLogID(uint64_t log_id) {
+  if (log_id > leader_log_id_) {
+    leader_log_id_ = log_id;
+  }
+  if (applied_log_id_ >= leader_log_id_) {
+    caught_up_millis_ = steadyMillis();
+  }
+}
@@ -0,0 +1,79 @@
+#include "request_trace.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <cstdio>
+
+std::atomic<int64_t> RequestTrace::slow_threshold_micros_{0};
+std::atomic<uint64_t> RequestTrace::next_id_{1};
+
+RequestTrace::RequestTrace(const char *name)
+    : id_(next_id_.fetch_add(1, std::memory_order_relaxed)), name_(name),
+      start_(Clock::now()) {}
+
+void RequestTrace::setSlowThreshold(std::chrono::microseconds threshold) {
+  slow_threshold_micros_.store(threshold.count(), std::memory_order_relaxed);
+}
+
+std::chrono::microseconds RequestTrace::slowThreshold() {
+  return std::chrono::microseconds(
+      slow_threshold_micros_.load(std::memory_order_relaxed));
+}
+
+bool RequestTrace::enabled() {
+  return slow_threshold_micros_.load(std::memory_order_relaxed) > 0;
+}
+
+void RequestTrace::addSpan(const char *name, Clock::time_point start,
+                           Clock::time_point end) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  spans_.push_back({name, start, end});
+}
+
+void RequestTrace::annotate(const char *key, std::string value) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  annotations_.emplace_back(key, std::move(value));
+}
+
+void RequestTrace::annotate(const char *key, uint64_t value) {
+  annotate(key, std::to_string(value));
+}
+
+void RequestTrace::finish() {
+  auto elapsed = Clock::now() - start_;
+  std::chrono::microseconds threshold = slowThreshold();
+  if (threshold.count() <= 0 || elapsed < threshold) {
+    return;
+  }
+
+  auto millis = [](Clock::duration d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+  };
+  std::lock_guard<std::mutex> lock(mutex_);
+  // spans end in completion order, list them by start offset
+  std::sort(spans_.begin(), spans_.end(),
+            [](const Span &a, const Span &b) { return a.start < b.start; });
+  std::string breakdown;
+  char buf[96];
+  for (const Span &span : spans_) {
+    std::snprintf(buf, sizeof(buf), " %s@%.3fms=%.3fms", span.name,
+                  millis(span.start - start_), millis(span.end - span.start));
+    breakdown += buf;
+  }
+  std::string shape;
+  for (const auto &annotation : annotations_) {
+    shape += " ";
+    shape += annotation.first;
+    shape += "=";
+    shape += annotation.second;
+  }
+  GlobalLogger->warn("Slow request id={} {} took {:.3f}ms, stages:{}, "
+                     "shape:{}",
+                     id_, name_, millis(elapsed), breakdown, shape);
+}
+
+RequestTrace::Scope::Scope(RequestTrace *trace) : previous_(current_) {
+  current_ = trace;
+}
+
+RequestTrace::Scope::~Scope() { current_ = previous_; }
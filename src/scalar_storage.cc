@@ -1,71 +1,437 @@
 #include "scalar_storage.h"
+#include "constants.h"
 #include "logger.h"
+#include "metrics.h"
+#include "record_codec.h"
+#include <algorithm>
+#include <cstring>
+#include <memory>
 #include <rapidjson/document.h>
-#include <rapidjson/stringbuffer.h>
-#include <rapidjson/writer.h>
 #include <rocksdb/db.h>
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/table.h>
+#include <rocksdb/write_batch.h>
 #include <vector>
 
-ScalarStorage::ScalarStorage(const std::string &db_path) {
-  rocksdb::Options options;
-  options.create_if_missing = true;
-  rocksdb::Status status = rocksdb::DB::Open(options, db_path, &db_);
+namespace {
+constexpr char kVectorsColumnFamily[] = "vectors";
+constexpr char kIndexColumnFamily[] = "index_meta";
+// present once keys are fixed width
+constexpr char kKeyFormatKey[] = "__key_format";
+constexpr int kMigrationBatchSize = 10000;
+
+rocksdb::ColumnFamilyOptions
+columnFamilyOptions(const ScalarStorageOptions &options,
+                    const std::shared_ptr<rocksdb::Cache> &block_cache,
+                    rocksdb::CompressionType compression, bool bloom) {
+  rocksdb::BlockBasedTableOptions table_options;
+  table_options.block_cache = block_cache;
+  // index and filter blocks count against the cache limit too
+  table_options.cache_index_and_filter_blocks = true;
+  if (bloom && options.bloom_bits_per_key > 0) {
+    table_options.filter_policy.reset(
+        rocksdb::NewBloomFilterPolicy(options.bloom_bits_per_key));
+    table_options.whole_key_filtering = true;
+  }
+
+  rocksdb::ColumnFamilyOptions cf_options;
+  cf_options.table_factory.reset(
+      rocksdb::NewBlockBasedTableFactory(table_options));
+  cf_options.compression = compression;
+  cf_options.write_buffer_size = options.write_buffer_size;
+  return cf_options;
+}
+
+// records written before the binary encoding are json text that still
+// holds the vectors, they are rewritten on their next upsert
+void decodeValue(const char *data, size_t size,
+                 const std::vector<std::string> *fields,
+                 rapidjson::Document *record) {
+  if (isEncodedRecord(data, size)) {
+    if (!decodeRecord(data, size, fields, record)) {
+      GlobalLogger->error("Failed to decode scalar record");
+    }
+    return;
+  }
+
+  record->Parse(data, size);
+  if (fields == nullptr || !record->IsObject()) {
+    return;
+  }
+  for (auto it = record->MemberBegin(); it != record->MemberEnd();) {
+    if (std::find(fields->begin(), fields->end(), it->name.GetString()) ==
+        fields->end()) {
+      it = record->EraseMember(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void attachVector(const char *data, size_t size,
+                  rapidjson::Document *record) {
+  if (!record->IsObject() || record->HasMember(REQUEST_VECTORS)) {
+    return;
+  }
+  rapidjson::Document::AllocatorType &allocator = record->GetAllocator();
+  size_t dim = size / sizeof(float);
+  rapidjson::Value array(rapidjson::kArrayType);
+  array.Reserve(dim, allocator);
+  for (size_t j = 0; j < dim; ++j) {
+    float v;
+    std::memcpy(&v, data + j * sizeof(float), sizeof(float));
+    array.PushBack(v, allocator);
+  }
+  record->AddMember(rapidjson::StringRef(REQUEST_VECTORS), array, allocator);
+}
+
+bool wantsVectors(const std::vector<std::string> *fields) {
+  return fields == nullptr || std::find(fields->begin(), fields->end(),
+                                        REQUEST_VECTORS) != fields->end();
+}
+} // namespace
+
+ScalarStorage::ScalarStorage(const std::string &db_path,
+                             const ScalarStorageOptions &options)
+    : block_cache_(rocksdb::NewLRUCache(options.block_cache_size)) {
+  rocksdb::DBOptions db_options;
+  db_options.create_if_missing = true;
+  db_options.create_missing_column_families = true;
+  std::vector<rocksdb::ColumnFamilyDescriptor> column_families = {
+      rocksdb::ColumnFamilyDescriptor(
+          rocksdb::kDefaultColumnFamilyName,
+          columnFamilyOptions(options, block_cache_,
+                              options.records_compression, true)),
+      rocksdb::ColumnFamilyDescriptor(
+          kVectorsColumnFamily,
+          columnFamilyOptions(options, block_cache_,
+                              options.vectors_compression, true)),
+      // a handful of large blobs read once at startup
+      rocksdb::ColumnFamilyDescriptor(
+          kIndexColumnFamily,
+          columnFamilyOptions(options, block_cache_,
+                              options.index_compression, false))};
+  std::vector<rocksdb::ColumnFamilyHandle *> handles;
+  rocksdb::Status status =
+      rocksdb::DB::Open(db_options, db_path, column_families, &handles, &db_);
   if (!status.ok()) {
     GlobalLogger->error("Failed to open RocksDB: {}", status.ToString());
     throw std::runtime_error("Failed to open RocksDB: " + status.ToString());
   }
+  records_cf_ = handles[0];
+  vectors_cf_ = handles[1];
+  index_cf_ = handles[2];
+  migrateKeys();
+}
+ScalarStorage::~ScalarStorage() {
+  db_->DestroyColumnFamilyHandle(records_cf_);
+  db_->DestroyColumnFamilyHandle(vectors_cf_);
+  db_->DestroyColumnFamilyHandle(index_cf_);
+  delete db_;
 }
-ScalarStorage::~ScalarStorage() { delete db_; }
 
 void ScalarStorage::insert_scalar(uint64_t id,
                                   const rapidjson::Document &data) {
-  rapidjson::StringBuffer buffer;
-  rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
-  data.Accept(writer);
-  std::string value = buffer.GetString();
+  insert_scalars({id}, {&data});
+}
 
-  rocksdb::Status status =
-      db_->Put(rocksdb::WriteOptions(), std::to_string(id), value);
+void ScalarStorage::insert_scalars(
+    const std::vector<uint64_t> &ids,
+    const std::vector<const rapidjson::Document *> &data) {
+  StageTimer timer(Metrics::Stage::SCALAR_IO);
+  rocksdb::WriteBatch batch;
+  std::vector<float> vector;
+  for (size_t i = 0; i < ids.size(); ++i) {
+    std::string key = encodeKey(ids[i]);
+    batch.Put(records_cf_, key, encodeRecord(*data[i], REQUEST_VECTORS));
+
+    if (data[i]->HasMember(REQUEST_VECTORS) &&
+        (*data[i])[REQUEST_VECTORS].IsArray()) {
+      vector.clear();
+      for (const auto &v : (*data[i])[REQUEST_VECTORS].GetArray()) {
+        vector.push_back(v.GetFloat());
+      }
+      batch.Put(vectors_cf_, key,
+                rocksdb::Slice(reinterpret_cast<const char *>(vector.data()),
+                               vector.size() * sizeof(float)));
+    }
+  }
+
+  rocksdb::Status status = db_->Write(rocksdb::WriteOptions(), &batch);
   if (!status.ok()) {
-    GlobalLogger->error("Failed to insert scalar: {}", status.ToString());
+    GlobalLogger->error("Failed to insert scalars: {}", status.ToString());
   }
 }
 
-rapidjson::Document ScalarStorage::get_scalar(uint64_t id) {
-  std::string value;
-  rocksdb::Status status =
-      db_->Get(rocksdb::ReadOptions(), std::to_string(id), &value);
+void ScalarStorage::remove_scalars(const std::vector<uint64_t> &ids) {
+  StageTimer timer(Metrics::Stage::SCALAR_IO);
+  rocksdb::WriteBatch batch;
+  for (uint64_t id : ids) {
+    std::string key = encodeKey(id);
+    batch.Delete(records_cf_, key);
+    batch.Delete(vectors_cf_, key);
+  }
+
+  rocksdb::Status status = db_->Write(rocksdb::WriteOptions(), &batch);
   if (!status.ok()) {
-    return rapidjson::Document();
+    GlobalLogger->error("Failed to remove scalars: {}", status.ToString());
+  }
+}
+
+std::vector<rapidjson::Document>
+ScalarStorage::get_scalars(const std::vector<uint64_t> &ids,
+                           const std::vector<std::string> *fields) {
+  StageTimer timer(Metrics::Stage::SCALAR_IO);
+  std::vector<std::string> keys;
+  std::vector<rocksdb::Slice> key_slices;
+  keys.reserve(ids.size());
+  key_slices.reserve(ids.size());
+  for (uint64_t id : ids) {
+    keys.push_back(encodeKey(id));
+    key_slices.emplace_back(keys.back());
+  }
+
+  std::vector<std::string> values;
+  std::vector<rocksdb::Status> statuses = db_->MultiGet(
+      rocksdb::ReadOptions(),
+      std::vector<rocksdb::ColumnFamilyHandle *>(ids.size(), records_cf_),
+      key_slices, &values);
+
+  bool with_vectors = wantsVectors(fields);
+  std::vector<std::string> vectors;
+  std::vector<rocksdb::Status> vector_statuses;
+  if (with_vectors) {
+    vector_statuses = db_->MultiGet(
+        rocksdb::ReadOptions(),
+        std::vector<rocksdb::ColumnFamilyHandle *>(ids.size(), vectors_cf_),
+        key_slices, &vectors);
+  }
+
+  std::vector<rapidjson::Document> result(ids.size());
+  for (size_t i = 0; i < ids.size(); ++i) {
+    if (!statuses[i].ok()) {
+      continue;
+    }
+    decodeValue(values[i].data(), values[i].size(), fields, &result[i]);
+    if (with_vectors && vector_statuses[i].ok()) {
+      attachVector(vectors[i].data(), vectors[i].size(), &result[i]);
+    }
+  }
+  return result;
+}
+
+rapidjson::Document
+ScalarStorage::get_scalar(uint64_t id,
+                          const std::vector<std::string> *fields) {
+  std::vector<rapidjson::Document> result = get_scalars({id}, fields);
+  return std::move(result[0]);
+}
+
+ScalarStorage::ScanCursor::ScanCursor(ScalarStorage *storage,
+                                      uint64_t start_id,
+                                      const std::vector<std::string> *fields,
+                                      bool include_vectors)
+    : db_(storage->db_), snapshot_(db_->GetSnapshot()),
+      projected_(fields != nullptr) {
+  if (projected_) {
+    fields_ = *fields;
+  }
+  // records and vectors are read from the same point in time. a bulk scan
+  // would only evict the hot blocks from the cache.
+  rocksdb::ReadOptions read_options;
+  read_options.snapshot = snapshot_;
+  read_options.fill_cache = false;
+
+  std::string start_key = encodeKey(start_id);
+  records_.reset(db_->NewIterator(read_options, storage->records_cf_));
+  records_->Seek(start_key);
+  if (include_vectors && wantsVectors(fields)) {
+    vectors_.reset(db_->NewIterator(read_options, storage->vectors_cf_));
+    vectors_->Seek(start_key);
+  }
+}
+
+ScalarStorage::ScanCursor::~ScanCursor() {
+  // the iterators pin the snapshot
+  vectors_.reset();
+  records_.reset();
+  db_->ReleaseSnapshot(snapshot_);
+}
+
+size_t ScalarStorage::ScanCursor::next(
+    size_t limit,
+    const std::function<bool(uint64_t, rapidjson::Document &)> &visit) {
+  const std::vector<std::string> *fields = projected_ ? &fields_ : nullptr;
+  size_t visited = 0;
+  while (records_->Valid() && visited < limit) {
+    rocksdb::Slice key = records_->key();
+    if (key.size() != sizeof(uint64_t)) {
+      records_->Next();
+      continue;
+    }
+    rapidjson::Document record;
+    rocksdb::Slice value = records_->value();
+    decodeValue(value.data(), value.size(), fields, &record);
+
+    // both column families hold the same keys, merge them in order
+    if (vectors_) {
+      while (vectors_->Valid() && vectors_->key().compare(key) < 0) {
+        vectors_->Next();
+      }
+      if (vectors_->Valid() && vectors_->key().compare(key) == 0) {
+        rocksdb::Slice vector = vectors_->value();
+        attachVector(vector.data(), vector.size(), &record);
+      }
+    }
+
+    uint64_t id = decodeKey(key);
+    records_->Next();
+    visited++;
+    if (!visit(id, record)) {
+      break;
+    }
+  }
+  if (!records_->status().ok()) {
+    GlobalLogger->error("Scan stopped early: {}",
+                        records_->status().ToString());
+  }
+  return visited;
+}
+
+std::unique_ptr<ScalarStorage::ScanCursor>
+ScalarStorage::openScan(uint64_t start_id,
+                        const std::vector<std::string> *fields,
+                        bool include_vectors) {
+  return std::unique_ptr<ScanCursor>(
+      new ScanCursor(this, start_id, fields, include_vectors));
+}
+
+size_t ScalarStorage::scan(
+    uint64_t start_id, size_t limit, const std::vector<std::string> *fields,
+    const std::function<bool(uint64_t, rapidjson::Document &)> &visit,
+    bool include_vectors) {
+  return openScan(start_id, fields, include_vectors)->next(limit, visit);
+}
+
+std::string ScalarStorage::encodeKey(uint64_t id) {
+  std::string key(sizeof(uint64_t), '\0');
+  for (int i = sizeof(uint64_t) - 1; i >= 0; --i) {
+    key[i] = static_cast<char>(id & 0xFF);
+    id >>= 8;
+  }
+  return key;
+}
+
+uint64_t ScalarStorage::decodeKey(const rocksdb::Slice &key) {
+  uint64_t id = 0;
+  for (size_t i = 0; i < sizeof(uint64_t) && i < key.size(); ++i) {
+    id = (id << 8) | static_cast<uint8_t>(key.data()[i]);
   }
+  return id;
+}
 
-  rapidjson::Document data;
-  data.Parse(value.c_str());
+void ScalarStorage::migrateKeys() {
+  std::string format;
+  if (db_->Get(rocksdb::ReadOptions(), index_cf_, kKeyFormatKey, &format)
+          .ok()) {
+    return;
+  }
 
-  rapidjson::StringBuffer buffer;
-  rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
-  data.Accept(writer);
-  GlobalLogger->debug(
-      "Data retrieved from ScalarStorage: {}, RocksDB status: {}",
-      buffer.GetString(), status.ToString());
+  uint64_t migrated = 0;
+  for (rocksdb::ColumnFamilyHandle *cf : {records_cf_, vectors_cf_}) {
+    // the iterator does not see the keys written behind it
+    std::unique_ptr<rocksdb::Iterator> it(
+        db_->NewIterator(rocksdb::ReadOptions(), cf));
+    rocksdb::WriteBatch batch;
+    auto flush = [this, &batch]() {
+      rocksdb::Status status = db_->Write(rocksdb::WriteOptions(), &batch);
+      if (!status.ok()) {
+        GlobalLogger->error("Failed to migrate keys: {}", status.ToString());
+        throw std::runtime_error("Failed to migrate keys: " +
+                                 status.ToString());
+      }
+      batch.Clear();
+    };
+
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+      std::string key = it->key().ToString();
+      // index blobs of older versions share the default column family
+      if (key.empty() || key.size() > 20 ||
+          key.find_first_not_of("0123456789") != std::string::npos) {
+        continue;
+      }
+      batch.Put(cf, encodeKey(std::stoull(key)), it->value());
+      batch.Delete(cf, key);
+      migrated++;
+      if (batch.Count() >= 2 * kMigrationBatchSize) {
+        flush();
+      }
+    }
+    flush();
+  }
 
-  return data;
+  put(kKeyFormatKey, "1");
+  if (migrated != 0) {
+    GlobalLogger->info("Migrated {} scalar keys to fixed-width keys",
+                       migrated);
+  }
 }
 
 void ScalarStorage::put(const std::string &key, const std::string &value) {
-  rocksdb::Status status = db_->Put(rocksdb::WriteOptions(), key, value);
+  rocksdb::Status status =
+      db_->Put(rocksdb::WriteOptions(), index_cf_, key, value);
   if (!status.ok()) {
     GlobalLogger->error("Failed to put key-value pair: {}", status.ToString());
   }
 }
 
+bool ScalarStorage::putSynced(
+    const std::map<std::string, std::string> &entries) {
+  rocksdb::WriteBatch batch;
+  for (const auto &entry : entries) {
+    batch.Put(index_cf_, entry.first, entry.second);
+  }
+  rocksdb::WriteOptions write_options;
+  write_options.sync = true;
+  rocksdb::Status status = entries.empty() ? db_->SyncWAL()
+                                           : db_->Write(write_options, &batch);
+  if (!status.ok()) {
+    GlobalLogger->error("Failed to write index metadata: {}",
+                        status.ToString());
+    return false;
+  }
+  return true;
+}
+
 std::string ScalarStorage::get(const std::string &key) {
   std::string value;
-  rocksdb::Status status = db_->Get(rocksdb::ReadOptions(), key, &value);
+  rocksdb::Status status =
+      db_->Get(rocksdb::ReadOptions(), index_cf_, key, &value);
+  if (status.IsNotFound()) {
+    // written to the default column family before index_meta existed
+    status = db_->Get(rocksdb::ReadOptions(), key, &value);
+  }
   if (!status.ok()) {
     // GlobalLogger->error("Failed to get value for key {}: {}", key,
     // status.ToString());
     return "";
   }
   return value;
-}
\ No newline at end of file
+}
+
+std::vector<std::pair<std::string, uint64_t>>
+ScalarStorage::getIntProperty(const std::string &property) {
+  std::vector<std::pair<std::string, uint64_t>> values;
+  for (rocksdb::ColumnFamilyHandle *cf :
+       {records_cf_, vectors_cf_, index_cf_}) {
+    uint64_t value = 0;
+    if (db_->GetIntProperty(cf, property, &value)) {
+      values.emplace_back(cf->GetName(), value);
+    }
+  }
+  return values;
+}
+
+size_t ScalarStorage::blockCacheUsage() const {
+  return block_cache_->GetUsage();
+}
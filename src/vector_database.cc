@@ -1,87 +1,463 @@
 #include "vector_database.h"
+#include "admission.h"
+#include "bm25_index.h"
 #include "constants.h"
 #include "faiss_index.h"
 #include "filter_index.h"
 #include "hnswlib_index.h"
 #include "index_factory.h"
 #include "logger.h"
+#include "metrics.h"
 #include "persistence.h"
+#include "request_trace.h"
 #include "scalar_storage.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <faiss/Index.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <rapidjson/document.h>
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
+#include <set>
+#include <thread>
 #include <vector>
 
 VectorDatabase::VectorDatabase(const std::string &db_path,
-                               const std::string &wal_path)
-    : scalar_storage_(db_path) {
-  persistence_.init(wal_path);
+                               const std::string &wal_path,
+                               const WALOptions &wal_options,
+                               const ScalarStorageOptions &storage_options,
+                               const RecallMonitorOptions &recall_options)
+    : scalar_storage_(db_path, storage_options),
+      recovery_start_(std::chrono::steady_clock::now()),
+      incarnation_(std::mt19937_64(std::random_device()())()),
+      search_pool_(HYBRID_SEARCH_THREADS),
+      recall_monitor_(recall_options,
+                      [this](const RecallMonitor::Sample &sample) {
+                        return exactSearch(sample);
+                      }) {
+  persistence_.init(wal_path, wal_options);
 }
+namespace {
+// records read and decoded ahead of the apply stage in one step
+constexpr size_t kReplayChunkSize = 4096;
+// chunks read and decoded before the apply stage takes them
+constexpr size_t kReplayChunksAhead = 2;
+constexpr auto kReplayProgressInterval = std::chrono::seconds(5);
+// vectors the recall check compares per hold of the index read lock
+constexpr size_t kExactSearchBlock = 4096;
+
+struct ReplayRecord {
+  uint64_t log_id;
+  Persistence::OpCode op_code;
+  bool decoded;
+  rapidjson::Document json_data;
+};
+
+// reads the wal on one thread and decodes it on a fixed set of workers.
+// chunks come out in log order while the next ones are read and decoded.
+class ReplayPipeline {
+public:
+  ReplayPipeline(std::function<bool(WALRecordView *)> read,
+                 unsigned num_workers)
+      : read_(std::move(read)) {
+    reader_ = std::thread(&ReplayPipeline::readLoop, this);
+    for (unsigned i = 0; i < num_workers; ++i) {
+      workers_.emplace_back(&ReplayPipeline::decodeLoop, this);
+    }
+  }
+
+  ~ReplayPipeline() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    reader_.join();
+    for (auto &worker : workers_) {
+      worker.join();
+    }
+  }
+
+  ReplayPipeline(const ReplayPipeline &) = delete;
+  ReplayPipeline &operator=(const ReplayPipeline &) = delete;
+
+  // the next chunk in log order, empty once the wal is exhausted
+  std::vector<ReplayRecord> next() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] {
+      return chunks_.empty() ? read_done_ : chunks_.front()->pending == 0;
+    });
+    if (chunks_.empty()) {
+      return {};
+    }
+    std::vector<ReplayRecord> records = std::move(chunks_.front()->records);
+    chunks_.pop_front();
+    cv_.notify_all();
+    return records;
+  }
+
+private:
+  struct Chunk {
+    std::vector<WALRecordView> views;
+    std::vector<ReplayRecord> records;
+    // ranges not decoded yet
+    size_t pending = 0;
+  };
+  struct Range {
+    std::shared_ptr<Chunk> chunk;
+    size_t begin;
+    size_t end;
+  };
+
+  void readLoop() {
+    while (true) {
+      auto chunk = std::make_shared<Chunk>();
+      WALRecordView view;
+      while (chunk->views.size() < kReplayChunkSize && read_(&view)) {
+        chunk->views.push_back(view);
+      }
+
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (chunk->views.empty()) {
+        read_done_ = true;
+        cv_.notify_all();
+        return;
+      }
+      cv_.wait(lock, [this] {
+        return stop_ || chunks_.size() < kReplayChunksAhead;
+      });
+      if (stop_) {
+        return;
+      }
+      chunk->records.resize(chunk->views.size());
+      size_t per_worker = (chunk->views.size() + workers_.size() - 1) /
+                          workers_.size();
+      for (size_t begin = 0; begin < chunk->views.size();
+           begin += per_worker) {
+        ranges_.push_back(
+            {chunk, begin, std::min(begin + per_worker, chunk->views.size())});
+        chunk->pending++;
+      }
+      chunks_.push_back(std::move(chunk));
+      cv_.notify_all();
+    }
+  }
+
+  void decodeLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this] { return stop_ || !ranges_.empty(); });
+      if (stop_) {
+        return;
+      }
+      Range range = std::move(ranges_.front());
+      ranges_.pop_front();
+      lock.unlock();
+
+      Chunk &chunk = *range.chunk;
+      for (size_t i = range.begin; i < range.end; ++i) {
+        const WALRecordView &view = chunk.views[i];
+        ReplayRecord &record = chunk.records[i];
+        record.log_id = view.log_id;
+        record.op_code = static_cast<Persistence::OpCode>(view.op_code);
+        record.decoded = Persistence::decodeWALRecord(view, &record.json_data);
+      }
+
+      lock.lock();
+      if (--chunk.pending == 0) {
+        cv_.notify_all();
+      }
+    }
+  }
+
+  std::function<bool(WALRecordView *)> read_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // read chunks in log order, the front one is handed out once decoded
+  std::deque<std::shared_ptr<Chunk>> chunks_;
+  std::deque<Range> ranges_;
+  bool read_done_ = false;
+  bool stop_ = false;
+  std::thread reader_;
+  std::vector<std::thread> workers_;
+};
+} // namespace
+
 void VectorDatabase::reloadDatabase() {
   GlobalLogger->info("Entering VectorDatabase::reloadDatabase()");
 
+  // every record the snapshot covers was synced to rocksdb before its
+  // marker was written, so an id in the loaded indexes always has its
+  // attributes here and replay removes its old vector. later records may be
+  // missing or stale, replay stores them again.
+  recovery_phase_ = RecoveryPhase::LOADING_ATTRIBUTES;
+  auto attributes_start = std::chrono::steady_clock::now();
+  scalar_storage_.scan(
+      0, SIZE_MAX, nullptr,
+      [this](uint64_t id, rapidjson::Document &record) {
+        attributes_.upsert(id, record);
+        return true;
+      },
+      false);
+  GlobalLogger->info(
+      "Loaded attributes of {} records in {} ms", attributes_.size(),
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - attributes_start)
+          .count());
+
+  recovery_phase_ = RecoveryPhase::LOADING_SNAPSHOT;
   persistence_.loadSnapshot(scalar_storage_);
+  rebuildFilterIndex();
+  recovery_phase_ = RecoveryPhase::REPLAYING_WAL;
+  GlobalLogger->info("Snapshot loaded, replaying {:.1f} MB of WAL",
+                     persistence_.getReplayBytesTotal() / 1048576.0);
 
-  std::string operation_type;
-  rapidjson::Document json_data;
-  persistence_.readNextWALLog(&operation_type, &json_data);
+  unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+  ReplayPipeline pipeline(
+      [this](WALRecordView *view) {
+        if (!persistence_.nextWALRecord(view)) {
+          return false;
+        }
+        replayed_bytes_ += sizeof(WALRecordHeader) + view->payload_size;
+        return true;
+      },
+      num_threads);
 
-  while (!operation_type.empty()) {
-    GlobalLogger->info("Operation Type: {}", operation_type);
+  auto start_time = std::chrono::steady_clock::now();
+  auto last_report = start_time;
+  size_t replayed = 0;
+  while (true) {
+    std::vector<ReplayRecord> chunk = pipeline.next();
+    if (chunk.empty()) {
+      break;
+    }
 
-    rapidjson::StringBuffer buffer;
-    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
-    json_data.Accept(writer);
-    GlobalLogger->info("Read Line: {}", buffer.GetString());
+    // consecutive upserts of distinct ids into the same index are applied as
+    // one batch, a repeated id closes the batch to keep the log order
+    std::vector<uint64_t> batch_ids;
+    std::vector<const rapidjson::Document *> batch_data;
+    std::set<uint64_t> batch_id_set;
+    IndexFactory::IndexType batch_type = IndexFactory::IndexType::UNKNOWN;
+    auto flush = [&]() {
+      if (!batch_ids.empty()) {
+        upsertBatch(batch_ids, batch_data, batch_type);
+      }
+      batch_ids.clear();
+      batch_data.clear();
+      batch_id_set.clear();
+    };
 
-    if (operation_type == "upsert") {
-      uint64_t id = json_data[REQUEST_ID].GetUint64();
-      IndexFactory::IndexType index_type = getIndexTypeFromRequest(json_data);
+    for (const auto &record : chunk) {
+      if (!record.decoded) {
+        GlobalLogger->error("Skipping undecodable WAL log entry: log_id={}",
+                            record.log_id);
+        continue;
+      }
+      if (record.op_code != Persistence::OpCode::UPSERT) {
+        continue;
+      }
+      uint64_t id = record.json_data[REQUEST_ID].GetUint64();
+      IndexFactory::IndexType index_type =
+          getIndexTypeFromRequest(record.json_data);
+      if (index_type != batch_type || batch_id_set.count(id) != 0) {
+        flush();
+        batch_type = index_type;
+      }
+      batch_ids.push_back(id);
+      batch_data.push_back(&record.json_data);
+      batch_id_set.insert(id);
+    }
+    flush();
+    replayed += chunk.size();
+    replayed_records_ = replayed;
 
-      upsert(id, json_data, index_type);
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_report >= kReplayProgressInterval) {
+      double seconds =
+          std::chrono::duration<double>(now - start_time).count();
+      GlobalLogger->info("WAL replay progress: {} records, {:.1f} MB, "
+                         "{:.0f} records/s",
+                         replayed, replayed_bytes_.load() / 1048576.0,
+                         replayed / seconds);
+      last_report = now;
     }
+  }
+  persistence_.finishReplay();
+  incarnation_log_id_ = persistence_.getID();
 
-    rapidjson::Document().Swap(json_data);
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start_time)
+                       .count();
+  double megabytes = replayed_bytes_.load() / 1048576.0;
+  GlobalLogger->info("WAL replay finished: {} records, {:.1f} MB in {:.2f}s "
+                     "({:.0f} records/s, {:.1f} MB/s)",
+                     replayed, megabytes, seconds,
+                     seconds > 0 ? replayed / seconds : 0.0,
+                     seconds > 0 ? megabytes / seconds : 0.0);
+  recovery_millis_ = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         std::chrono::steady_clock::now() - recovery_start_)
+                         .count();
+  recovery_phase_ = RecoveryPhase::READY;
+  GlobalLogger->info("Recovery finished in {} ms", recovery_millis_.load());
+}
 
-    operation_type.clear();
-    persistence_.readNextWALLog(&operation_type, &json_data);
+void VectorDatabase::rebuildFilterIndex() {
+  FilterIndex *filter_index = static_cast<FilterIndex *>(
+      getGlobalIndexFactory()->getIndex(IndexFactory::IndexType::FILTER));
+  if (filter_index == nullptr) {
+    return;
+  }
+  // the bitmaps are not saved with the snapshot. replay moves ids between
+  // them by the old values it finds in attributes_, so they are built from
+  // attributes_ first and every replayed update keeps the two in step.
+  std::unique_lock<std::shared_mutex> lock(index_mutex_);
+  filter_index->clear();
+  size_t entries = 0;
+  attributes_.forEachInt([filter_index, &entries](uint64_t id,
+                                                  const std::string &field,
+                                                  int64_t value) {
+    // upserts only filter on values that fit an int
+    if (value < INT_MIN || value > INT_MAX) {
+      return;
+    }
+    filter_index->updateIntFieldFilter(field, nullptr, value, id);
+    entries++;
+  });
+  GlobalLogger->info("Rebuilt the filter index from {} attribute values",
+                     entries);
+}
+
+VectorDatabase::RecoveryStatus VectorDatabase::getRecoveryStatus() const {
+  RecoveryStatus status;
+  status.phase = recovery_phase_.load();
+  status.replayed_records = replayed_records_.load();
+  status.replayed_bytes = replayed_bytes_.load();
+  status.total_bytes = persistence_.getReplayBytesTotal();
+  int64_t millis = recovery_millis_.load();
+  status.elapsed_seconds =
+      millis >= 0 ? millis / 1000.0
+                  : std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - recovery_start_)
+                        .count();
+  return status;
+}
+
+std::string VectorDatabase::recoveryPhaseToString(RecoveryPhase phase) {
+  switch (phase) {
+  case RecoveryPhase::STARTING:
+    return "starting";
+  case RecoveryPhase::LOADING_ATTRIBUTES:
+    return "loading_attributes";
+  case RecoveryPhase::LOADING_SNAPSHOT:
+    return "loading_snapshot";
+  case RecoveryPhase::REPLAYING_WAL:
+    return "replaying_wal";
+  case RecoveryPhase::READY:
+    return "ready";
+  default:
+    return "";
   }
 }
+
 void VectorDatabase::upsert(uint64_t id, const rapidjson::Document &data,
                             IndexFactory::IndexType index_type) {
-  rapidjson::StringBuffer buffer;
-  rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
-  data.Accept(writer);
-  GlobalLogger->info("Upsert data: {}", buffer.GetString());
+  upsertBatch({id}, {&data}, index_type);
+}
 
-  rapidjson::Document existingData;
-  try {
-    // get old json data
-    existingData = scalar_storage_.get_scalar(id);
-  } catch (const std::runtime_error &e) {
+void VectorDatabase::logAndUpsert(uint64_t id,
+                                  const rapidjson::Document &data,
+                                  IndexFactory::IndexType index_type) {
+  if (RequestTrace *trace = RequestTrace::current()) {
+    trace->annotate("id", id);
+    if (data.HasMember(REQUEST_VECTORS) && data[REQUEST_VECTORS].IsArray()) {
+      trace->annotate("dim", data[REQUEST_VECTORS].Size());
+    }
   }
 
-  if (existingData.IsObject()) {
-    // remove old data in index
-    GlobalLogger->debug("try remove old index");
-    // TODO: existingVector is not used
-    std::vector<float> existingVector(existingData[REQUEST_VECTORS].Size());
-    for (rapidjson::SizeType i = 0; i < existingData[REQUEST_VECTORS].Size();
-         ++i) {
-      existingVector[i] = existingData[REQUEST_VECTORS][i].GetFloat();
+  // encoded before the index lock, which only covers the log id and crc
+  std::string record;
+  {
+    TraceSpan span("wal_encode");
+    record = Persistence::encodeWALRecord(0, Persistence::OpCode::UPSERT,
+                                          data);
+  }
+  uint64_t log_id;
+  {
+    std::shared_lock<std::shared_mutex> gate(write_gate_);
+    std::unique_lock<std::shared_mutex> lock(index_mutex_, std::defer_lock);
+    {
+      TraceSpan span("index_lock");
+      lock.lock();
+    }
+    {
+      TraceSpan span("wal_append");
+      log_id = persistence_.appendWALRecord(std::move(record));
+    }
+    {
+      TraceSpan span("apply");
+      applyUpsertBatch({id}, {&data}, index_type);
     }
+    storeScalars(lock, {id}, {&data});
+  }
+  TraceSpan span("wal_wait_durable");
+  persistence_.waitDurable(log_id);
+}
+
+void VectorDatabase::upsertBatch(
+    const std::vector<uint64_t> &ids,
+    const std::vector<const rapidjson::Document *> &data,
+    IndexFactory::IndexType index_type) {
+  std::shared_lock<std::shared_mutex> gate(write_gate_);
+  std::unique_lock<std::shared_mutex> lock(index_mutex_);
+  applyUpsertBatch(ids, data, index_type);
+  storeScalars(lock, ids, data);
+}
 
-    void *index = getGlobalIndexFactory()->getIndex(index_type);
+void VectorDatabase::storeScalars(
+    std::unique_lock<std::shared_mutex> &index_lock,
+    const std::vector<uint64_t> &ids,
+    const std::vector<const rapidjson::Document *> &data) {
+  // taken before the index lock is let go, so the records reach rocksdb in
+  // the order their updates were applied
+  std::lock_guard<std::mutex> storage_lock(storage_mutex_);
+  index_lock.unlock();
+  scalar_storage_.insert_scalars(ids, data);
+}
+
+void VectorDatabase::applyUpsertBatch(
+    const std::vector<uint64_t> &ids,
+    const std::vector<const rapidjson::Document *> &data,
+    IndexFactory::IndexType index_type) {
+  GlobalLogger->debug("Upsert {} documents", ids.size());
+
+  void *index = getGlobalIndexFactory()->getIndex(index_type);
+
+  // remove old data in index
+  std::vector<long> existingIds;
+  for (size_t i = 0; i < ids.size(); ++i) {
+    if (attributes_.contains(ids[i])) {
+      existingIds.push_back(static_cast<long>(ids[i]));
+    }
+  }
+  if (!existingIds.empty()) {
+    GlobalLogger->debug("try remove old index");
     switch (index_type) {
     case IndexFactory::IndexType::FLAT: {
       FaissIndex *faiss_index = static_cast<FaissIndex *>(index);
-      faiss_index->remove_vectors({static_cast<long>(id)});
+      faiss_index->remove_vectors(existingIds);
       break;
     }
     case IndexFactory::IndexType::HNSW: {
-      HNSWLibIndex *hnsw_index = static_cast<HNSWLibIndex *>(index);
-      // TODO: markdelete
+      // addPoint on an existing label replaces the old vector
       break;
     }
     default:
@@ -90,23 +466,26 @@ void VectorDatabase::upsert(uint64_t id, const rapidjson::Document &data,
   }
 
   // get vectors
-  std::vector<float> newVector(data[REQUEST_VECTORS].Size());
-  for (rapidjson::SizeType i = 0; i < data[REQUEST_VECTORS].Size(); ++i) {
-    newVector[i] = data[REQUEST_VECTORS][i].GetFloat();
+  std::vector<float> newVectors;
+  std::vector<long> labels;
+  for (size_t i = 0; i < ids.size(); ++i) {
+    for (const auto &v : (*data[i])[REQUEST_VECTORS].GetArray()) {
+      newVectors.push_back(v.GetFloat());
+    }
+    labels.push_back(static_cast<long>(ids[i]));
   }
 
   GlobalLogger->debug("try add new index");
 
-  void *index = getGlobalIndexFactory()->getIndex(index_type);
   switch (index_type) {
   case IndexFactory::IndexType::FLAT: {
     FaissIndex *faiss_index = static_cast<FaissIndex *>(index);
-    faiss_index->insert_vectors(newVector, id);
+    faiss_index->insert_vectors(newVectors, labels);
     break;
   }
   case IndexFactory::IndexType::HNSW: {
     HNSWLibIndex *hnsw_index = static_cast<HNSWLibIndex *>(index);
-    hnsw_index->insert_vectors(newVector, id);
+    hnsw_index->insert_vectors(newVectors, labels);
     break;
   }
   default:
@@ -116,34 +495,43 @@ void VectorDatabase::upsert(uint64_t id, const rapidjson::Document &data,
   GlobalLogger->debug("try add new filter");
   FilterIndex *filter_index = static_cast<FilterIndex *>(
       getGlobalIndexFactory()->getIndex(IndexFactory::IndexType::FILTER));
-  for (auto it = data.MemberBegin(); it != data.MemberEnd(); ++it) {
-    std::string field_name = it->name.GetString();
-    GlobalLogger->debug("try filter member {} {}", it->value.IsInt(),
-                        field_name);
-    if (it->value.IsInt() && field_name != "id") {
-      int64_t field_value = it->value.GetInt64();
+  BM25Index *bm25_index = static_cast<BM25Index *>(
+      getGlobalIndexFactory()->getIndex(IndexFactory::IndexType::BM25));
+  for (size_t i = 0; i < ids.size(); ++i) {
+    const rapidjson::Document &doc = *data[i];
+    for (auto it = doc.MemberBegin(); it != doc.MemberEnd(); ++it) {
+      std::string field_name = it->name.GetString();
+      if (it->value.IsInt() && field_name != REQUEST_ID) {
+        int64_t field_value = it->value.GetInt64();
+
+        int64_t old_field_value;
+        int64_t *old_field_value_p = nullptr;
+        if (attributes_.getInt(ids[i], field_name, &old_field_value)) {
+          old_field_value_p = &old_field_value;
+        }
 
-      int64_t *old_field_value_p = nullptr;
-      if (existingData.IsObject()) {
-        old_field_value_p = (int64_t *)malloc(sizeof(int64_t));
-        *old_field_value_p = existingData[field_name.c_str()].GetInt64();
+        filter_index->updateIntFieldFilter(field_name, old_field_value_p,
+                                           field_value, ids[i]);
       }
+    }
 
-      filter_index->updateIntFieldFilter(field_name, old_field_value_p,
-                                         field_value, id);
-      if (old_field_value_p) {
-        delete old_field_value_p;
+    if (bm25_index != nullptr) {
+      std::vector<std::string> texts;
+      for (auto it = doc.MemberBegin(); it != doc.MemberEnd(); ++it) {
+        if (it->value.IsString() &&
+            bm25_index->isTextField(it->name.GetString())) {
+          texts.push_back(it->value.GetString());
+        }
       }
+      bm25_index->upsertDocument(ids[i], texts);
     }
+    attributes_.upsert(ids[i], doc);
   }
-
-  scalar_storage_.insert_scalar(id, data);
 }
 
 void VectorDatabase::writeWALLog(const std::string &operation_type,
                                  const rapidjson::Document &json_data) {
-  std::string version(VERSION);
-  persistence_.writeWALLog(operation_type, json_data, version);
+  persistence_.waitDurable(persistence_.writeWALLog(operation_type, json_data));
 }
 IndexFactory::IndexType VectorDatabase::getIndexTypeFromRequest(
     const rapidjson::Document &json_request) {
@@ -159,48 +547,60 @@ IndexFactory::IndexType VectorDatabase::getIndexTypeFromRequest(
   return IndexFactory::IndexType::UNKNOWN;
 }
 
-rapidjson::Document VectorDatabase::query(uint64_t id) {
-  return scalar_storage_.get_scalar(id);
+rapidjson::Document
+VectorDatabase::query(uint64_t id, const std::vector<std::string> *fields) {
+  return scalar_storage_.get_scalar(id, fields);
 }
 
-std::pair<std::vector<long>, std::vector<float>>
-VectorDatabase::search(const rapidjson::Document &json_request) {
-  std::vector<float> query;
-  for (const auto &q : json_request[REQUEST_VECTORS].GetArray()) {
-    query.push_back(q.GetFloat());
-  }
-  int k = json_request[REQUEST_K].GetInt();
+std::vector<rapidjson::Document>
+VectorDatabase::query(const std::vector<uint64_t> &ids,
+                      const std::vector<std::string> *fields) {
+  return scalar_storage_.get_scalars(ids, fields);
+}
 
-  IndexFactory::IndexType indexType = IndexFactory::IndexType::UNKNOWN;
-  if (json_request.HasMember(REQUEST_INDEX_TYPE) &&
-      json_request[REQUEST_INDEX_TYPE].IsString()) {
-    std::string index_type_str = json_request[REQUEST_INDEX_TYPE].GetString();
-    if (index_type_str == INDEX_TYPE_FLAT) {
-      indexType = IndexFactory::IndexType::FLAT;
-    } else if (index_type_str == INDEX_TYPE_HNSW) {
-      indexType = IndexFactory::IndexType::HNSW;
-    }
-  }
+std::unique_ptr<ScalarStorage::ScanCursor>
+VectorDatabase::openScan(uint64_t start_id,
+                         const std::vector<std::string> *fields) {
+  return scalar_storage_.openScan(start_id, fields);
+}
 
-  roaring_bitmap_t *filter_bitmap = nullptr;
-  if (json_request.HasMember(REQUEST_FILTER) &&
-      json_request[REQUEST_FILTER].IsObject()) {
-    const auto &filter = json_request[REQUEST_FILTER];
-    std::string fieldName = filter[REQUEST_FILTER_FIELD].GetString();
-    std::string op_str = filter[REQUEST_FILTER_OP].GetString();
-    int64_t value = filter[REQUEST_FILTER_FIELD_VALUE].GetInt64();
+roaring_bitmap_t *
+VectorDatabase::buildFilterBitmap(const rapidjson::Document &json_request) {
+  if (!json_request.HasMember(REQUEST_FILTER) ||
+      !json_request[REQUEST_FILTER].IsObject()) {
+    return nullptr;
+  }
+  const auto &filter = json_request[REQUEST_FILTER];
+  std::string fieldName = filter[REQUEST_FILTER_FIELD].GetString();
+  std::string op_str = filter[REQUEST_FILTER_OP].GetString();
+  int64_t value = filter[REQUEST_FILTER_FIELD_VALUE].GetInt64();
 
-    FilterIndex::Operation op = (op_str == "=")
-                                    ? FilterIndex::Operation::EQUAL
-                                    : FilterIndex::Operation::NOT_EQUAL;
+  FilterIndex::Operation op = (op_str == "=")
+                                  ? FilterIndex::Operation::EQUAL
+                                  : FilterIndex::Operation::NOT_EQUAL;
 
-    FilterIndex *filter_index = static_cast<FilterIndex *>(
-        getGlobalIndexFactory()->getIndex(IndexFactory::IndexType::FILTER));
+  FilterIndex *filter_index = static_cast<FilterIndex *>(
+      getGlobalIndexFactory()->getIndex(IndexFactory::IndexType::FILTER));
 
-    filter_bitmap = roaring_bitmap_create();
-    filter_index->getIntFieldFilterBitmap(fieldName, op, value, filter_bitmap);
+  roaring_bitmap_t *filter_bitmap = roaring_bitmap_create();
+  {
+    StageTimer timer(Metrics::Stage::FILTER_BITMAP);
+    filter_index->getIntFieldFilterBitmap(fieldName, op, value,
+                                          filter_bitmap);
+  }
+  if (RequestTrace *trace = RequestTrace::current()) {
+    trace->annotate("filter", fieldName + op_str + std::to_string(value));
+    trace->annotate("filter_matches",
+                    roaring_bitmap_get_cardinality(filter_bitmap));
   }
+  return filter_bitmap;
+}
 
+std::pair<std::vector<long>, std::vector<float>>
+VectorDatabase::vectorSearch(const std::vector<float> &query, int k,
+                             IndexFactory::IndexType indexType,
+                             const roaring_bitmap_t *filter_bitmap) {
+  StageTimer timer(Metrics::Stage::INDEX_SEARCH);
   void *index = getGlobalIndexFactory()->getIndex(indexType);
 
   std::pair<std::vector<long>, std::vector<float>> results;
@@ -218,12 +618,481 @@ VectorDatabase::search(const rapidjson::Document &json_request) {
   default:
     break;
   }
+
+  if (RequestTrace *trace = RequestTrace::current()) {
+    bool flat = indexType == IndexFactory::IndexType::FLAT;
+    std::string plan = flat ? "flat_scan" : "hnsw";
+    if (filter_bitmap != nullptr) {
+      plan += "+bitmap";
+    }
+    trace->annotate("plan", plan);
+    // the flat scan computes one distance per id the filter lets through
+    if (flat && index != nullptr) {
+      trace->annotate("distance_computations",
+                      filter_bitmap != nullptr
+                          ? roaring_bitmap_get_cardinality(filter_bitmap)
+                          : static_cast<FaissIndex *>(index)->size());
+    }
+  }
+  return results;
+}
+
+namespace {
+// the query shape for the slow query log, the filter is added once its
+// bitmap is built
+void annotateSearch(size_t dim, int k,
+                    const rapidjson::Document &json_request) {
+  RequestTrace *trace = RequestTrace::current();
+  if (trace == nullptr) {
+    return;
+  }
+  trace->annotate("dim", dim);
+  trace->annotate("k", static_cast<uint64_t>(k));
+  if (json_request.HasMember(REQUEST_INDEX_TYPE) &&
+      json_request[REQUEST_INDEX_TYPE].IsString()) {
+    trace->annotate("index", json_request[REQUEST_INDEX_TYPE].GetString());
+  }
+  if (json_request.HasMember(REQUEST_TEXT_QUERY)) {
+    trace->annotate("hybrid", "true");
+  }
+}
+} // namespace
+
+std::pair<std::vector<long>, std::vector<float>>
+VectorDatabase::search(const rapidjson::Document &json_request) {
+  std::vector<float> query;
+  for (const auto &q : json_request[REQUEST_VECTORS].GetArray()) {
+    query.push_back(q.GetFloat());
+  }
+  int k = json_request[REQUEST_K].GetInt();
+  annotateSearch(query.size(), k, json_request);
+
+  IndexFactory::IndexType indexType = getIndexTypeFromRequest(json_request);
+  std::shared_lock<std::shared_mutex> lock(index_mutex_, std::defer_lock);
+  {
+    TraceSpan span("index_lock");
+    lock.lock();
+  }
+  // a request past its deadline stops at the next stage, the handler
+  // answers 504 for it
+  if (RequestDeadline::exceeded()) {
+    return {};
+  }
+  roaring_bitmap_t *filter_bitmap = buildFilterBitmap(json_request);
+  if (RequestDeadline::exceeded()) {
+    if (filter_bitmap != nullptr) {
+      roaring_bitmap_free(filter_bitmap);
+    }
+    return {};
+  }
+
+  std::pair<std::vector<long>, std::vector<float>> results =
+      vectorSearch(query, k, indexType, filter_bitmap);
+  // the handler throws the results of an expired request away
+  if (RequestDeadline::exceeded()) {
+    results = {};
+  }
+  // flat results are exact already
+  if (!results.first.empty() && indexType == IndexFactory::IndexType::HNSW &&
+      recall_monitor_.shouldSample()) {
+    recall_monitor_.submit(indexType, query, k, filter_bitmap, results.first);
+  }
+
+  if (filter_bitmap != nullptr) {
+    roaring_bitmap_free(filter_bitmap);
+  }
+  return results;
+}
+
+std::vector<long>
+VectorDatabase::exactSearch(const RecallMonitor::Sample &sample) {
+  std::shared_lock<std::shared_mutex> lock(index_mutex_);
+  void *index = getGlobalIndexFactory()->getIndex(sample.index_type);
+  if (sample.index_type != IndexFactory::IndexType::HNSW || index == nullptr) {
+    return {};
+  }
+  // scanned in blocks so a long brute force never keeps writers waiting on
+  // the index lock for more than one block. the yield lets a waiting writer
+  // take the lock before this thread asks for it again.
+  return static_cast<HNSWLibIndex *>(index)->exactSearch(
+      sample.query, sample.k, sample.bitmap, kExactSearchBlock, [&lock]() {
+        lock.unlock();
+        std::this_thread::yield();
+        lock.lock();
+      });
+}
+
+namespace {
+// ranks a result list best-first and drops the -1 padding faiss emits
+std::vector<std::pair<long, float>>
+rankResults(const std::pair<std::vector<long>, std::vector<float>> &results,
+            bool higher_is_better) {
+  std::vector<std::pair<long, float>> ranked;
+  for (size_t i = 0; i < results.first.size(); ++i) {
+    if (results.first[i] != -1) {
+      ranked.emplace_back(results.first[i], results.second[i]);
+    }
+  }
+  std::stable_sort(ranked.begin(), ranked.end(),
+                   [higher_is_better](const auto &a, const auto &b) {
+                     return higher_is_better ? a.second > b.second
+                                             : a.second < b.second;
+                   });
+  return ranked;
+}
+
+// min-max normalizes a best-first list into [0, 1], 1 being the best
+void addNormalizedScores(const std::vector<std::pair<long, float>> &ranked,
+                         float weight, std::map<long, float> &fused) {
+  if (ranked.empty()) {
+    return;
+  }
+  float best = ranked.front().second;
+  float worst = ranked.back().second;
+  for (const auto &entry : ranked) {
+    float normalized =
+        (best == worst) ? 1.0f : (entry.second - worst) / (best - worst);
+    fused[entry.first] += weight * normalized;
+  }
+}
+} // namespace
+
+std::pair<std::vector<long>, std::vector<float>>
+VectorDatabase::hybridSearch(const rapidjson::Document &json_request) {
+  std::vector<float> query;
+  for (const auto &q : json_request[REQUEST_VECTORS].GetArray()) {
+    query.push_back(q.GetFloat());
+  }
+  int k = json_request[REQUEST_K].GetInt();
+  int candidate_k = k;
+  if (json_request.HasMember(REQUEST_CANDIDATE_K) &&
+      json_request[REQUEST_CANDIDATE_K].IsInt()) {
+    candidate_k = std::max(k, json_request[REQUEST_CANDIDATE_K].GetInt());
+  }
+  std::string text_query = json_request[REQUEST_TEXT_QUERY].GetString();
+  annotateSearch(query.size(), k, json_request);
+
+  IndexFactory::IndexType indexType = getIndexTypeFromRequest(json_request);
+  std::shared_lock<std::shared_mutex> lock(index_mutex_, std::defer_lock);
+  {
+    TraceSpan span("index_lock");
+    lock.lock();
+  }
+  if (RequestDeadline::exceeded()) {
+    return {};
+  }
+  roaring_bitmap_t *filter_bitmap = buildFilterBitmap(json_request);
+  if (RequestDeadline::exceeded()) {
+    if (filter_bitmap != nullptr) {
+      roaring_bitmap_free(filter_bitmap);
+    }
+    return {};
+  }
+
+  // the keywords are scored on the shared pool while this thread runs the
+  // dense side, the pool has a fixed size whatever the number of requests
+  std::pair<std::vector<long>, std::vector<float>> text_results;
+  BM25Index *bm25_index = static_cast<BM25Index *>(
+      getGlobalIndexFactory()->getIndex(IndexFactory::IndexType::BM25));
+  std::shared_ptr<WorkerPool::Job> text_job;
+  if (bm25_index != nullptr) {
+    RequestTrace *trace = RequestTrace::current();
+    auto deadline = RequestDeadline::current();
+    text_job = search_pool_.submit([&, trace, deadline]() {
+      RequestTrace::Scope trace_scope(trace);
+      RequestDeadline::Scope deadline_scope(deadline);
+      if (RequestDeadline::exceeded()) {
+        return;
+      }
+      TraceSpan span("bm25_search");
+      text_results = bm25_index->search(text_query, candidate_k, filter_bitmap);
+    });
+  }
+  std::pair<std::vector<long>, std::vector<float>> vector_results =
+      vectorSearch(query, candidate_k, indexType, filter_bitmap);
+  if (text_job) {
+    WorkerPool::wait(text_job);
+  }
+
   if (filter_bitmap != nullptr) {
-    delete filter_bitmap;
+    roaring_bitmap_free(filter_bitmap);
   }
+  // the handler throws the results of an expired request away
+  if (RequestDeadline::exceeded()) {
+    return {};
+  }
+
+  // only faiss inner product returns similarities, everything else distances
+  bool vector_higher_is_better =
+      indexType == IndexFactory::IndexType::FLAT &&
+      getGlobalIndexFactory()->getMetricType(indexType) ==
+          IndexFactory::MetricType::IP;
+  auto vector_ranked = rankResults(vector_results, vector_higher_is_better);
+  auto text_ranked = rankResults(text_results, true);
+
+  std::string fusion = FUSION_RRF;
+  if (json_request.HasMember(REQUEST_FUSION) &&
+      json_request[REQUEST_FUSION].IsString()) {
+    fusion = json_request[REQUEST_FUSION].GetString();
+  }
+
+  std::map<long, float> fused;
+  if (fusion == FUSION_WEIGHTED) {
+    float alpha = 0.5f;
+    if (json_request.HasMember(REQUEST_FUSION_ALPHA) &&
+        json_request[REQUEST_FUSION_ALPHA].IsNumber()) {
+      alpha = json_request[REQUEST_FUSION_ALPHA].GetFloat();
+    }
+    addNormalizedScores(vector_ranked, alpha, fused);
+    addNormalizedScores(text_ranked, 1.0f - alpha, fused);
+  } else {
+    for (size_t i = 0; i < vector_ranked.size(); ++i) {
+      fused[vector_ranked[i].first] += 1.0f / (FUSION_RRF_K + i + 1);
+    }
+    for (size_t i = 0; i < text_ranked.size(); ++i) {
+      fused[text_ranked[i].first] += 1.0f / (FUSION_RRF_K + i + 1);
+    }
+  }
+
+  std::vector<std::pair<long, float>> ranked(fused.begin(), fused.end());
+  std::stable_sort(
+      ranked.begin(), ranked.end(),
+      [](const auto &a, const auto &b) { return a.second > b.second; });
+
+  std::pair<std::vector<long>, std::vector<float>> results;
+  for (size_t i = 0; i < ranked.size() && i < static_cast<size_t>(k); ++i) {
+    results.first.push_back(ranked[i].first);
+    results.second.push_back(ranked[i].second);
+  }
+  GlobalLogger->debug("Hybrid search fused {} dense and {} sparse candidates",
+                      vector_ranked.size(), text_ranked.size());
   return results;
 }
 
-void VectorDatabase::takeSnapshot() {
-  persistence_.takeSnapshot(scalar_storage_);
-}
\ No newline at end of file
+std::map<long, uint64_t>
+VectorDatabase::facet(const rapidjson::Document &json_request) {
+  std::string fieldName = json_request[REQUEST_FACET_FIELD].GetString();
+  std::shared_lock<std::shared_mutex> lock(index_mutex_);
+  roaring_bitmap_t *base_bitmap = buildFilterBitmap(json_request);
+
+  // with a query vector the counts only cover the top-k candidates
+  if (json_request.HasMember(REQUEST_VECTORS) &&
+      json_request.HasMember(REQUEST_K)) {
+    std::vector<float> query;
+    for (const auto &q : json_request[REQUEST_VECTORS].GetArray()) {
+      query.push_back(q.GetFloat());
+    }
+    int k = json_request[REQUEST_K].GetInt();
+    IndexFactory::IndexType indexType = getIndexTypeFromRequest(json_request);
+
+    auto results = vectorSearch(query, k, indexType, base_bitmap);
+    roaring_bitmap_t *candidates = roaring_bitmap_create();
+    for (long id : results.first) {
+      if (id != -1) {
+        roaring_bitmap_add(candidates, static_cast<uint32_t>(id));
+      }
+    }
+    if (base_bitmap != nullptr) {
+      roaring_bitmap_free(base_bitmap);
+    }
+    base_bitmap = candidates;
+  }
+
+  FilterIndex *filter_index = static_cast<FilterIndex *>(
+      getGlobalIndexFactory()->getIndex(IndexFactory::IndexType::FILTER));
+  std::map<long, uint64_t> counts =
+      filter_index->getIntFieldFacetCounts(fieldName, base_bitmap);
+
+  if (base_bitmap != nullptr) {
+    roaring_bitmap_free(base_bitmap);
+  }
+  return counts;
+}
+
+uint64_t VectorDatabase::appliedLogID() {
+  // updates hold the lock exclusively from their wal write to their apply
+  std::shared_lock<std::shared_mutex> lock(index_mutex_);
+  uint64_t log_id = persistence_.getID();
+  // at most one of them is still writing rocksdb, it holds storage_mutex_
+  std::lock_guard<std::mutex> storage_lock(storage_mutex_);
+  return log_id;
+}
+
+uint64_t VectorDatabase::latestLogID() const { return persistence_.getID(); }
+
+void VectorDatabase::putMetadata(const std::string &key,
+                                 const std::string &value) {
+  scalar_storage_.put(key, value);
+}
+
+std::string VectorDatabase::getMetadata(const std::string &key) {
+  return scalar_storage_.get(key);
+}
+
+size_t
+VectorDatabase::removeRecordsExcept(uint64_t first_id, uint64_t last_id,
+                                    const std::unordered_set<uint64_t> &keep) {
+  static const std::vector<std::string> no_fields;
+  std::vector<uint64_t> stale;
+  scalar_storage_.scan(
+      first_id, SIZE_MAX, &no_fields,
+      [last_id, &keep, &stale](uint64_t id, rapidjson::Document &) {
+        if (id > last_id) {
+          return false;
+        }
+        if (keep.count(id) == 0) {
+          stale.push_back(id);
+        }
+        return true;
+      },
+      false);
+  if (stale.empty()) {
+    return 0;
+  }
+
+  std::shared_lock<std::shared_mutex> gate(write_gate_);
+  std::unique_lock<std::shared_mutex> lock(index_mutex_);
+  // the record does not say which vector index holds the id, removing a
+  // missing one is a no-op in both
+  std::vector<long> labels(stale.begin(), stale.end());
+  IndexFactory *index_factory = getGlobalIndexFactory();
+  if (auto *faiss_index = static_cast<FaissIndex *>(
+          index_factory->getIndex(IndexFactory::IndexType::FLAT))) {
+    faiss_index->remove_vectors(labels);
+  }
+  if (auto *hnsw_index = static_cast<HNSWLibIndex *>(
+          index_factory->getIndex(IndexFactory::IndexType::HNSW))) {
+    hnsw_index->remove_vectors(labels);
+  }
+  FilterIndex *filter_index = static_cast<FilterIndex *>(
+      index_factory->getIndex(IndexFactory::IndexType::FILTER));
+  BM25Index *bm25_index = static_cast<BM25Index *>(
+      index_factory->getIndex(IndexFactory::IndexType::BM25));
+  for (uint64_t id : stale) {
+    if (filter_index != nullptr) {
+      attributes_.forEachIntOf(
+          id, [filter_index, id](const std::string &field, int64_t value) {
+            filter_index->removeIntFieldFilter(field, value, id);
+          });
+    }
+    if (bm25_index != nullptr) {
+      bm25_index->removeDocument(id);
+    }
+    attributes_.remove(id);
+  }
+
+  std::lock_guard<std::mutex> storage_lock(storage_mutex_);
+  lock.unlock();
+  scalar_storage_.remove_scalars(stale);
+  return stale.size();
+}
+
+void VectorDatabase::reindexFromStorage() {
+  auto start_time = std::chrono::steady_clock::now();
+  auto cursor = scalar_storage_.openScan(0, nullptr);
+  size_t reindexed = 0;
+  while (true) {
+    std::vector<uint64_t> ids;
+    std::vector<rapidjson::Document> records;
+    size_t visited = cursor->next(
+        SCAN_CHUNK_SIZE, [&ids, &records](uint64_t id,
+                                          rapidjson::Document &record) {
+          ids.push_back(id);
+          records.push_back(std::move(record));
+          return true;
+        });
+
+    std::map<IndexFactory::IndexType,
+             std::pair<std::vector<uint64_t>,
+                       std::vector<const rapidjson::Document *>>>
+        batches;
+    for (size_t i = 0; i < ids.size(); ++i) {
+      auto &batch = batches[getIndexTypeFromRequest(records[i])];
+      batch.first.push_back(ids[i]);
+      batch.second.push_back(&records[i]);
+    }
+    {
+      std::unique_lock<std::shared_mutex> lock(index_mutex_);
+      for (const auto &batch : batches) {
+        applyUpsertBatch(batch.second.first, batch.second.second,
+                         batch.first);
+      }
+    }
+    reindexed += visited;
+    if (visited < SCAN_CHUNK_SIZE) {
+      break;
+    }
+  }
+  GlobalLogger->info(
+      "Indexed {} records from rocksdb in {} ms", reindexed,
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - start_time)
+          .count());
+}
+
+bool VectorDatabase::hasWALFrom(uint64_t log_id) const {
+  return persistence_.hasWALFrom(log_id);
+}
+
+uint64_t VectorDatabase::readWAL(WALCursor *cursor, uint64_t from_id,
+                                 size_t max_bytes, std::string *out) const {
+  return persistence_.readWAL(cursor, from_id, max_bytes, out);
+}
+
+void VectorDatabase::waitForWAL(uint64_t log_id,
+                                std::chrono::milliseconds timeout) {
+  persistence_.waitWritten(log_id, timeout);
+}
+
+SnapshotResult VectorDatabase::takeSnapshot() {
+  // a snapshot taken halfway through replay would record the replayed
+  // updates as covered while part of them is still missing
+  if (recovery_phase_ != RecoveryPhase::READY) {
+    GlobalLogger->info("Skipping snapshot, recovery is still running");
+    return SnapshotResult::SKIPPED;
+  }
+  return persistence_.takeSnapshot(scalar_storage_, write_gate_,
+                                   index_mutex_);
+}
+
+uint64_t VectorDatabase::walRecordsSinceSnapshot() const {
+  return persistence_.getID() - persistence_.getLastSnapshotID();
+}
+
+uint64_t VectorDatabase::walBytesSinceSnapshot() const {
+  return persistence_.getWALBytesSinceSnapshot();
+}
+
+VectorDatabase::Stats VectorDatabase::getStats() {
+  Stats stats;
+  stats.wal_records_since_snapshot = walRecordsSinceSnapshot();
+  stats.wal_bytes_since_snapshot = walBytesSinceSnapshot();
+  stats.storage_keys = scalar_storage_.getIntProperty(
+      "rocksdb.estimate-num-keys");
+  stats.storage_live_bytes = scalar_storage_.getIntProperty(
+      "rocksdb.estimate-live-data-size");
+  stats.storage_sst_bytes = scalar_storage_.getIntProperty(
+      "rocksdb.total-sst-files-size");
+  stats.storage_memtable_bytes = scalar_storage_.getIntProperty(
+      "rocksdb.cur-size-all-mem-tables");
+  stats.storage_pending_compaction_bytes = scalar_storage_.getIntProperty(
+      "rocksdb.estimate-pending-compaction-bytes");
+  stats.block_cache_bytes = scalar_storage_.blockCacheUsage();
+
+  IndexFactory *factory = getGlobalIndexFactory();
+  std::shared_lock<std::shared_mutex> lock(index_mutex_);
+  if (void *flat = factory->getIndex(IndexFactory::IndexType::FLAT)) {
+    stats.flat_vectors = static_cast<FaissIndex *>(flat)->size();
+  }
+  if (void *hnsw = factory->getIndex(IndexFactory::IndexType::HNSW)) {
+    stats.hnsw_vectors = static_cast<HNSWLibIndex *>(hnsw)->size();
+  }
+  if (void *filter = factory->getIndex(IndexFactory::IndexType::FILTER)) {
+    stats.filter_bitmaps = static_cast<FilterIndex *>(filter)->bitmapCount();
+    stats.filter_bitmap_bytes =
+        static_cast<FilterIndex *>(filter)->bitmapBytes();
+  }
+  stats.attribute_rows = attributes_.size();
+  stats.recall = recall_monitor_.getRecall();
+  return stats;
+}
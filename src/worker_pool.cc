@@ -0,0 +1,65 @@
+#include "worker_pool.h"
+
+void WorkerPool::Job::run() {
+  work_();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_ = true;
+  }
+  cv_.notify_all();
+}
+
+WorkerPool::WorkerPool(size_t num_threads) {
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads_.emplace_back(&WorkerPool::workerLoop, this);
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+}
+
+std::shared_ptr<WorkerPool::Job>
+WorkerPool::submit(std::function<void()> work) {
+  auto job = std::make_shared<Job>(std::move(work));
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.push_back(job);
+  }
+  cv_.notify_one();
+  return job;
+}
+
+void WorkerPool::wait(const std::shared_ptr<Job> &job) {
+  if (job->claim()) {
+    job->run();
+    return;
+  }
+  std::unique_lock<std::mutex> lock(job->mutex_);
+  job->cv_.wait(lock, [&job] { return job->done_; });
+}
+
+void WorkerPool::workerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+    if (stop_) {
+      return;
+    }
+    std::shared_ptr<Job> job = std::move(jobs_.front());
+    jobs_.pop_front();
+    lock.unlock();
+    // the waiting thread may have run it already
+    if (job->claim()) {
+      job->run();
+    }
+    lock.lock();
+  }
+}
@@ -0,0 +1,35 @@
+curl -i -X POST localhost:8080/search \
+  -H "Content-Type: application/json" \
+  -H "X-Timeout-Ms: abc" \
+  -d '{"vectors":[0.9],"k":5,"indexType":"FLAT"}'
+
+echo -e "\n invalid timeout, 400 \n"
+
+curl -X POST localhost:8080/search \
+  -H "Content-Type: application/json" \
+  -H "X-Timeout-Ms: 500" \
+  -d '{"vectors":[0.9],"k":5,"indexType":"FLAT"}'
+
+echo -e "\n search with a budget \n"
+
+# a snapshot holds the only snapshot slot, the second one is rejected with
+# Retry-After while searches keep being served
+curl -s -X POST localhost:8080/admin/snapshot > /dev/null &
+sleep 0.05
+curl -i -X POST localhost:8080/admin/snapshot
+echo -e "\n second snapshot, 503 \n"
+curl -X POST localhost:8080/search \
+  -H "Content-Type: application/json" \
+  -d '{"vectors":[0.9],"k":5,"indexType":"FLAT"}'
+echo -e "\n search during the snapshot \n"
+wait
+
+# exports are admitted in the stream class
+curl -X POST localhost:8080/scan \
+  -H "Content-Type: application/json" \
+  -d '{"limit":2}'
+echo -e "\n scan \n"
+
+curl localhost:8080/metrics | grep '^vdb_admission'
+
+echo -e "\n metrics \n"
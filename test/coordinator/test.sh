@@ -0,0 +1,35 @@
+# shards: simple_vector --port=8081 and simple_vector --port=8082, each in
+# its own directory
+# coordinator: simple_vector --shards=localhost:8081,localhost:8082
+for id in 1 2 3 4 5 6; do
+  curl -X POST localhost:8080/upsert \
+    -H "Content-Type: application/json" \
+    -d "{\"id\":$id,\"vectors\":[0.$id],\"int_field\":$id,\"indexType\":\"FLAT\"}"
+done
+
+echo -e "\n upsert \n"
+
+curl -X POST localhost:8080/search \
+  -H "Content-Type: application/json" \
+  -d '{"vectors":[0.35],"k":3,"indexType":"FLAT","fields":["int_field"]}'
+
+echo -e "\n search, merged over both shards \n"
+
+curl -X POST localhost:8080/query \
+  -H "Content-Type: application/json" \
+  -d '{"ids":[6,1,4],"fields":["int_field"]}'
+
+echo -e "\n query ids \n"
+
+curl -X POST localhost:8081/query \
+  -H "Content-Type: application/json" \
+  -d '{"ids":[1,2,3,4,5,6],"fields":["int_field"]}'
+
+echo -e "\n records of shard 0 \n"
+
+# stop the shard on 8082 before this one
+curl -X POST localhost:8080/search \
+  -H "Content-Type: application/json" \
+  -d '{"vectors":[0.35],"k":3,"indexType":"FLAT"}'
+
+echo -e "\n search with a shard down, partial \n"
@@ -0,0 +1,11 @@
+curl -X POST localhost:8080/facet \
+  -H "Content-Type: application/json" \
+  -d @facet.json
+
+echo -e "\n facet \n"
+
+curl -X POST localhost:8080/facet \
+  -H "Content-Type: application/json" \
+  -d @facet_topk.json
+
+echo -e "\n facet top k \n"
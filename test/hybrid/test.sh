@@ -0,0 +1,23 @@
+curl -X POST localhost:8080/upsert \
+  -H "Content-Type: application/json" \
+  -d @upsert_1.json
+
+echo -e "\n upsert 1 \n"
+
+curl -X POST localhost:8080/upsert \
+  -H "Content-Type: application/json" \
+  -d @upsert_2.json
+
+echo -e "\n upsert 2 \n"
+
+curl -X POST localhost:8080/search \
+  -H "Content-Type: application/json" \
+  -d @search_rrf.json
+
+echo -e "\n search rrf \n"
+
+curl -X POST localhost:8080/search \
+  -H "Content-Type: application/json" \
+  -d @search_weighted.json
+
+echo -e "\n search weighted \n"
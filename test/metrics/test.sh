@@ -0,0 +1,9 @@
+curl -X POST localhost:8080/search \
+  -H "Content-Type: application/json" \
+  -d '{"vectors":[0.9],"k":5,"indexType":"FLAT","filter":{"fieldName":"int_field","fieldValue":47,"op":"="}}'
+
+echo -e "\n search \n"
+
+curl localhost:8080/metrics | grep -E 'handler="search"|stage="(json_parse|filter_bitmap|index_search)"|^vdb_index_vectors'
+
+echo -e "\n metrics \n"
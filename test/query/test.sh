@@ -0,0 +1,11 @@
+curl -X POST localhost:8080/query \
+  -H "Content-Type: application/json" \
+  -d @query_ids.json
+
+echo -e "\n query ids \n"
+
+curl -X POST localhost:8080/search \
+  -H "Content-Type: application/json" \
+  -d @search_fields.json
+
+echo -e "\n search with fields \n"
@@ -0,0 +1,10 @@
+# run right after starting simple_vector on a large wal
+curl localhost:8080/admin/ready
+
+echo -e "\n ready \n"
+
+curl -X POST localhost:8080/search \
+  -H "Content-Type: application/json" \
+  -d @search_stale.json
+
+echo -e "\n search stale \n"
@@ -0,0 +1,35 @@
+# leader: simple_vector in one directory (port 8080)
+# replica: simple_vector --port=8081 --leader=localhost:8080 in another one
+curl -X POST localhost:8080/upsert \
+  -H "Content-Type: application/json" \
+  -d '{"id":101,"vectors":[0.5],"int_field":7,"indexType":"FLAT"}'
+
+echo -e "\n upsert leader \n"
+
+sleep 1
+
+curl -X POST localhost:8081/query \
+  -H "Content-Type: application/json" \
+  -d '{"id":101}'
+
+echo -e "\n query replica \n"
+
+curl -X POST localhost:8081/search \
+  -H "Content-Type: application/json" \
+  -d '{"vectors":[0.5],"k":1,"indexType":"FLAT"}'
+
+echo -e "\n search replica \n"
+
+curl -X POST localhost:8081/upsert \
+  -H "Content-Type: application/json" \
+  -d '{"id":102,"vectors":[0.6],"indexType":"FLAT"}'
+
+echo -e "\n upsert replica, 403 \n"
+
+curl localhost:8081/admin/replication
+
+echo -e "\n replication status \n"
+
+curl localhost:8081/metrics | grep ^vdb_replication
+
+echo -e "\n metrics \n"
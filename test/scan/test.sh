@@ -0,0 +1,11 @@
+curl -X POST localhost:8080/scan \
+  -H "Content-Type: application/json" \
+  -d @scan.json
+
+echo -e "\n scan \n"
+
+curl -X POST localhost:8080/scan \
+  -H "Content-Type: application/json" \
+  -d '{}'
+
+echo -e "\n scan all \n"